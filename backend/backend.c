@@ -1,21 +1,174 @@
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <libudev.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wlr/util/log.h>
 #include <xf86drm.h>
 #include "backend/backend.h"
+#include "trace.h"
 
 static const struct wlr_backend_impl backend_impl;
 
+static uint32_t get_udev_id_property(struct udev_device *udev_dev,
+		const char *name) {
+	const char *str = udev_device_get_property_value(udev_dev, name);
+	if (str == NULL) {
+		return 0;
+	}
+	char *end;
+	errno = 0;
+	unsigned long id = strtoul(str, &end, 10);
+	if (errno != 0 || *end != '\0' || id > UINT32_MAX) {
+		wlr_log(WLR_ERROR, "Invalid %s uevent property: %s", name, str);
+		return 0;
+	}
+	return id;
+}
+
+static int handle_udev_event(int fd, uint32_t mask, void *data) {
+	struct glider_drm_backend *backend = data;
+
+	struct udev_device *udev_dev =
+		udev_monitor_receive_device(backend->udev_monitor);
+	if (udev_dev == NULL) {
+		return 1;
+	}
+
+	const char *action = udev_device_get_action(udev_dev);
+	const char *hotplug = udev_device_get_property_value(udev_dev, "HOTPLUG");
+	if (action == NULL || strcmp(action, "change") != 0 ||
+			hotplug == NULL || strcmp(hotplug, "1") != 0) {
+		goto out;
+	}
+
+	if (!backend->probed) {
+		goto out; // the initial refresh will pick up the changes
+	}
+
+	dev_t devnum = udev_device_get_devnum(udev_dev);
+	for (size_t i = 0; i < backend->devices_len; i++) {
+		struct glider_drm_device *device = &backend->devices[i];
+		if (device->devnum == devnum) {
+			// Recent kernels tell which connector and property changed
+			uint32_t conn_id = get_udev_id_property(udev_dev, "CONNECTOR");
+			uint32_t prop_id = get_udev_id_property(udev_dev, "PROPERTY");
+			handle_drm_device_hotplug(device, conn_id, prop_id);
+			break;
+		}
+	}
+
+out:
+	udev_device_unref(udev_dev);
+	return 1;
+}
+
+static void finish_udev(struct glider_drm_backend *backend) {
+	if (backend->udev_event != NULL) {
+		wl_event_source_remove(backend->udev_event);
+	}
+	if (backend->udev_monitor != NULL) {
+		udev_monitor_unref(backend->udev_monitor);
+	}
+	if (backend->udev != NULL) {
+		udev_unref(backend->udev);
+	}
+	backend->udev_event = NULL;
+	backend->udev_monitor = NULL;
+	backend->udev = NULL;
+}
+
+/* Listen to DRM uevents ourselves: the session only tells us that something
+ * changed on a device, without the uevent properties. */
+static bool init_udev(struct glider_drm_backend *backend) {
+	backend->udev = udev_new();
+	if (backend->udev == NULL) {
+		wlr_log(WLR_ERROR, "udev_new failed");
+		return false;
+	}
+
+	backend->udev_monitor =
+		udev_monitor_new_from_netlink(backend->udev, "udev");
+	if (backend->udev_monitor == NULL) {
+		wlr_log(WLR_ERROR, "udev_monitor_new_from_netlink failed");
+		goto error;
+	}
+	udev_monitor_filter_add_match_subsystem_devtype(backend->udev_monitor,
+		"drm", NULL);
+	if (udev_monitor_enable_receiving(backend->udev_monitor) < 0) {
+		wlr_log(WLR_ERROR, "udev_monitor_enable_receiving failed");
+		goto error;
+	}
+
+	struct wl_event_loop *event_loop =
+		wl_display_get_event_loop(backend->display);
+	backend->udev_event = wl_event_loop_add_fd(event_loop,
+		udev_monitor_get_fd(backend->udev_monitor), WL_EVENT_READABLE,
+		handle_udev_event, backend);
+	if (backend->udev_event == NULL) {
+		wlr_log(WLR_ERROR, "wl_event_loop_add_fd failed");
+		goto error;
+	}
+
+	return true;
+
+error:
+	finish_udev(backend);
+	return false;
+}
+
 struct glider_drm_backend *get_drm_backend_from_backend(
 		struct wlr_backend *wlr_backend) {
 	assert(wlr_backend->impl == &backend_impl);
 	return (struct glider_drm_backend *)wlr_backend;
 }
 
+static void probe_drm_device(struct glider_drm_device *device) {
+	glider_trace_begin(GLIDER_TRACE_DRM_PROBE);
+	device->probe_ok = init_drm_device(device, device->backend, device->fd);
+	glider_trace_end(GLIDER_TRACE_DRM_PROBE);
+}
+
+static void *probe_device_thread(void *data) {
+	probe_drm_device(data);
+	return NULL;
+}
+
+/* Wait for all devices to be probed. Returns false if any of them failed. */
+static bool wait_drm_devices(struct glider_drm_backend *backend) {
+	bool ok = true;
+	for (size_t i = 0; i < backend->devices_len; i++) {
+		struct glider_drm_device *device = &backend->devices[i];
+		if (device->probe_threaded) {
+			pthread_join(device->probe_thread, NULL);
+			device->probe_threaded = false;
+		}
+		ok = ok && device->probe_ok;
+	}
+	return ok;
+}
+
 static bool backend_start(struct wlr_backend *wlr_backend) {
 	struct glider_drm_backend *backend =
 		get_drm_backend_from_backend(wlr_backend);
+
+	if (!backend->probed) {
+		glider_trace_begin(GLIDER_TRACE_DRM_WAIT);
+		bool ok = wait_drm_devices(backend);
+		glider_trace_end(GLIDER_TRACE_DRM_WAIT);
+		if (!ok) {
+			wlr_log(WLR_ERROR, "Failed to probe DRM devices");
+			return false;
+		}
+		for (size_t i = 0; i < backend->devices_len; i++) {
+			if (!start_drm_device(&backend->devices[i])) {
+				return false;
+			}
+		}
+		backend->probed = true;
+	}
+
 	for (size_t i = 0; i < backend->devices_len; i++) {
 		if (!refresh_drm_device(&backend->devices[i])) {
 			return false;
@@ -31,9 +184,16 @@ static void backend_destroy(struct wlr_backend *wlr_backend) {
 	wl_list_remove(&backend->display_destroy.link);
 	wl_list_remove(&backend->session_destroy.link);
 	wl_list_remove(&backend->session_signal.link);
+	wait_drm_devices(backend);
 	for (size_t i = 0; i < backend->devices_len; i++) {
-		finish_drm_device(&backend->devices[i]);
+		struct glider_drm_device *device = &backend->devices[i];
+		if (device->probe_ok) {
+			finish_drm_device(device);
+		} else {
+			wlr_session_close_file(backend->session, device->fd);
+		}
 	}
+	finish_udev(backend);
 	free(backend);
 }
 
@@ -57,7 +217,27 @@ static void handle_session_destroy(struct wl_listener *listener, void *data) {
 static void handle_session_signal(struct wl_listener *listener, void *data) {
 	struct glider_drm_backend *backend =
 		wl_container_of(listener, backend, session_signal);
-	// TODO
+
+	if (!backend->probed) {
+		return;
+	}
+
+	if (!backend->session->active) {
+		wlr_log(WLR_INFO, "Session deactivated, pausing DRM backend");
+		for (size_t i = 0; i < backend->devices_len; i++) {
+			pause_drm_device(&backend->devices[i]);
+		}
+		return;
+	}
+
+	wlr_log(WLR_INFO, "Session activated, restoring DRM backend");
+	for (size_t i = 0; i < backend->devices_len; i++) {
+		struct glider_drm_device *device = &backend->devices[i];
+		if (!restore_drm_device(device)) {
+			// The outputs may have changed while we were away
+			refresh_drm_device(device);
+		}
+	}
 }
 
 struct wlr_backend *glider_drm_backend_create(struct wl_display *display,
@@ -71,20 +251,38 @@ struct wlr_backend *glider_drm_backend_create(struct wl_display *display,
 	backend->display = display;
 	backend->session = session;
 
+	init_drm_prop_specs();
+
+	if (!init_udev(backend)) {
+		wlr_log(WLR_INFO, "Falling back to session hotplug events");
+	}
+
 	int fds[sizeof(backend->devices) / sizeof(backend->devices[0])];
 	size_t fds_len = wlr_session_find_gpus(session,
 		sizeof(fds) / sizeof(fds[0]), fds);
 	if (fds_len == 0) {
 		wlr_log(WLR_ERROR, "Session returned zero GPUs");
-		goto error_device;
+		finish_udev(backend);
+		free(backend);
+		return NULL;
 	}
 
+	// Probe devices in parallel on worker threads, while the compositor
+	// initializes its renderer. They're waited for in backend_start.
 	for (size_t i = 0; i < fds_len; i++) {
-		if (!init_drm_device(&backend->devices[i], backend, fds[i])) {
-			goto error_device;
+		struct glider_drm_device *device = &backend->devices[i];
+		device->backend = backend;
+		device->fd = fds[i];
+		int ret = pthread_create(&device->probe_thread, NULL,
+			probe_device_thread, device);
+		if (ret == 0) {
+			device->probe_threaded = true;
+		} else {
+			wlr_log(WLR_ERROR, "pthread_create failed: %s", strerror(ret));
+			probe_drm_device(device);
 		}
-		backend->devices_len++;
 	}
+	backend->devices_len = fds_len;
 
 	backend->display_destroy.notify = handle_display_destroy;
 	wl_display_add_destroy_listener(display, &backend->display_destroy);
@@ -96,31 +294,93 @@ struct wlr_backend *glider_drm_backend_create(struct wl_display *display,
 	wl_signal_add(&session->session_signal, &backend->session_signal);
 
 	return &backend->base;
+}
 
-error_device:
-	for (size_t i = backend->devices_len; i < fds_len; i++) {
-		wlr_session_close_file(session, fds[i]);
-	}
-	for (size_t i = 0; i < backend->devices_len; i++) {
-		finish_drm_device(&backend->devices[i]);
-	}
-	return NULL;
+size_t glider_drm_backend_get_devices_len(struct wlr_backend *wlr_backend) {
+	struct glider_drm_backend *backend =
+		get_drm_backend_from_backend(wlr_backend);
+	return backend->devices_len;
 }
 
-int glider_drm_backend_get_render_fd(struct wlr_backend *wlr_backend) {
+int glider_drm_backend_get_device_render_fd(struct wlr_backend *wlr_backend,
+		size_t index) {
 	struct glider_drm_backend *backend =
 		get_drm_backend_from_backend(wlr_backend);
-	struct glider_drm_device *primary_device = &backend->devices[0];
-	char *render_path = drmGetRenderDeviceNameFromFd(primary_device->fd);
+	assert(index < backend->devices_len);
+	struct glider_drm_device *device = &backend->devices[index];
+	char *render_path = drmGetRenderDeviceNameFromFd(device->fd);
 	if (render_path == NULL) {
-		wlr_log_errno(WLR_ERROR, "drmGetRenderDeviceNameFromFd");
+		// Display-only devices such as vkms don't have a render node. Open a
+		// new file description on the primary node instead: sharing the KMS
+		// FD would alias the allocator GEM handles with the scan-out ones.
+		wlr_log(WLR_DEBUG, "DRM device %zu has no render node, "
+			"using its primary node", index);
+		render_path = drmGetDeviceNameFromFd2(device->fd);
+	}
+	if (render_path == NULL) {
+		wlr_log_errno(WLR_ERROR, "drmGetDeviceNameFromFd2 failed");
 		return -1;
 	}
 	int render_fd = open(render_path, O_RDWR | O_CLOEXEC);
 	if (render_fd < 0) {
 		wlr_log_errno(WLR_ERROR, "open(\"%s\") failed", render_path);
+		free(render_path);
 		return -1;
 	}
 	free(render_path);
 	return render_fd;
 }
+
+int glider_drm_backend_get_render_fd(struct wlr_backend *backend) {
+	return glider_drm_backend_get_device_render_fd(backend, 0);
+}
+
+void glider_drm_backend_log_stats(struct wlr_backend *wlr_backend) {
+	struct glider_drm_backend *backend =
+		get_drm_backend_from_backend(wlr_backend);
+	for (size_t i = 0; i < backend->devices_len; i++) {
+		struct glider_drm_device *device = &backend->devices[i];
+		wlr_log(WLR_INFO, "DRM device %zu: FB cache: %"PRIu64" hits, "
+			"%"PRIu64" misses, %"PRIu64" rejects, %"PRIu64" DMA-BUF re-uses, "
+			"%"PRIu64" imports", i, device->stats.fb_hits,
+			device->stats.fb_misses, device->stats.fb_rejects,
+			device->stats.fb_reuses, device->stats.fb_imports);
+		wlr_log(WLR_INFO, "DRM device %zu: device-wide page-flips: "
+			"%"PRIu64" in sync, %"PRIu64" out of sync", i,
+			device->stats.synced_flips, device->stats.unsynced_flips);
+		wlr_log(WLR_INFO, "DRM device %zu: %"PRIu64" in-fences, "
+			"%"PRIu64" buffers released by out-fences", i,
+			device->stats.in_fences, device->stats.out_fence_retires);
+		wlr_log(WLR_INFO, "DRM device %zu: %"PRIu64" async page-flips, "
+			"%"PRIu64" fell back to vsync", i, device->stats.async_flips,
+			device->stats.async_fallbacks);
+		double damaged = 0;
+		if (device->stats.plane_pixels > 0) {
+			damaged = 100.0 * device->stats.damaged_pixels /
+				device->stats.plane_pixels;
+		}
+		wlr_log(WLR_INFO, "DRM device %zu: %.1f%% of the plane pixels damaged, "
+			"%"PRIu64" damage blobs, %"PRIu64" re-used", i, damaged,
+			device->stats.damage_blobs, device->stats.damage_blob_reuses);
+		wlr_log(WLR_INFO, "DRM device %zu: %"PRIu64" ioctls during init, "
+			"%zu distinct properties", i, device->stats.init_ioctls,
+			device->prop_infos.len);
+
+		struct glider_drm_connector *conn;
+		wl_list_for_each(conn, &device->connectors, link) {
+			struct glider_drm_flip_intervals *intervals =
+				&conn->flip_intervals;
+			if (conn->crtc == NULL || intervals->count == 0) {
+				continue;
+			}
+			bool vrr = conn->crtc->props[GLIDER_DRM_CRTC_VRR_ENABLED].current;
+			wlr_log(WLR_INFO, "Connector %"PRIu32": VRR %s, page-flip "
+				"intervals over %"PRIu64" frames: min %.2fms, "
+				"avg %.2fms, max %.2fms", conn->id,
+				vrr ? "enabled" : "disabled", intervals->count,
+				(double)intervals->min_nsec / 1000000,
+				(double)intervals->sum_nsec / intervals->count / 1000000,
+				(double)intervals->max_nsec / 1000000);
+		}
+	}
+}
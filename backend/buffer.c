@@ -0,0 +1,635 @@
+#include <assert.h>
+#include <drm_fourcc.h>
+#include <gbm.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-server-core.h>
+#include <wlr/util/log.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include "backend/backend.h"
+
+static struct gbm_bo *import_dmabuf(struct glider_drm_device *device,
+		struct wlr_dmabuf_attributes *dmabuf) {
+	uint32_t usage = GBM_BO_USE_SCANOUT;
+
+	if (dmabuf->n_planes > GBM_MAX_PLANES) {
+		wlr_log(WLR_ERROR, "DMA-BUF contains too many planes (%d)",
+			dmabuf->n_planes);
+		return NULL;
+	}
+
+	struct gbm_bo *bo;
+	if (dmabuf->modifier != DRM_FORMAT_MOD_INVALID || dmabuf->n_planes > 1 ||
+			dmabuf->offset[0] > 0) {
+		struct gbm_import_fd_modifier_data import_mod = {
+			.width = dmabuf->width,
+			.height = dmabuf->height,
+			.format = dmabuf->format,
+			.modifier = dmabuf->modifier,
+			.num_fds = dmabuf->n_planes,
+		};
+		memcpy(import_mod.fds, dmabuf->fd,
+			sizeof(dmabuf->fd[0]) * dmabuf->n_planes);
+		memcpy(import_mod.strides, dmabuf->stride,
+			sizeof(dmabuf->stride[0]) * dmabuf->n_planes);
+		memcpy(import_mod.offsets, dmabuf->offset,
+			sizeof(dmabuf->offset[0]) * dmabuf->n_planes);
+		bo = gbm_bo_import(device->gbm, GBM_BO_IMPORT_FD_MODIFIER, &import_mod,
+			usage);
+	} else {
+		struct gbm_import_fd_data import = {
+			.width = dmabuf->width,
+			.height = dmabuf->height,
+			.stride = dmabuf->stride[0],
+			.format = dmabuf->format,
+			.fd = dmabuf->fd[0],
+		};
+		bo = gbm_bo_import(device->gbm, GBM_BO_IMPORT_FD, &import, usage);
+	}
+	if (bo == NULL) {
+		wlr_log(WLR_ERROR, "gbm_bo_import failed");
+	}
+	return bo;
+}
+
+static uint32_t add_fb(struct glider_drm_device *device,
+		uint32_t width, uint32_t height, uint32_t format, uint64_t modifier,
+		const uint32_t handles[4], const uint32_t strides[4],
+		const uint32_t offsets[4], int n_planes) {
+	uint64_t modifiers[4] = {0};
+	for (int i = 0; i < n_planes; i++) {
+		// KMS requires all BO planes to have the same modifier
+		modifiers[i] = modifier;
+	}
+
+	uint32_t fb_id = 0;
+	if (device->cap_addfb2_modifiers && modifier != DRM_FORMAT_MOD_INVALID) {
+		if (drmModeAddFB2WithModifiers(device->fd, width, height, format,
+				handles, strides, offsets, modifiers, &fb_id,
+				DRM_MODE_FB_MODIFIERS) != 0) {
+			wlr_log_errno(WLR_ERROR, "drmModeAddFB2WithModifiers failed");
+			return 0;
+		}
+	} else {
+		if (drmModeAddFB2(device->fd, width, height, format, handles, strides,
+				offsets, &fb_id, 0) != 0) {
+			wlr_log_errno(WLR_ERROR, "drmModeAddFB2 failed");
+			return 0;
+		}
+	}
+
+	return fb_id;
+}
+
+static uint32_t add_gbm_bo(struct glider_drm_device *device,
+		struct gbm_bo *bo) {
+	uint32_t handles[4] = {0};
+	uint32_t strides[4] = {0};
+	uint32_t offsets[4] = {0};
+	int n_planes = gbm_bo_get_plane_count(bo);
+	for (int i = 0; i < n_planes; i++) {
+		handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
+		strides[i] = gbm_bo_get_stride_for_plane(bo, i);
+		offsets[i] = gbm_bo_get_offset(bo, i);
+	}
+
+	return add_fb(device, gbm_bo_get_width(bo), gbm_bo_get_height(bo),
+		gbm_bo_get_format(bo), gbm_bo_get_modifier(bo),
+		handles, strides, offsets, n_planes);
+}
+
+static struct glider_drm_gem_handle *find_gem_handle(
+		struct glider_drm_device *device, uint32_t handle, uint64_t hash) {
+	struct wl_list *bucket =
+		glider_hash_table_bucket(&device->gem_handles, hash);
+	struct glider_drm_gem_handle *gem;
+	wl_list_for_each(gem, bucket, entry.link) {
+		if (gem->handle == handle) {
+			return gem;
+		}
+	}
+	return NULL;
+}
+
+static void unref_gem_handle(struct glider_drm_device *device,
+		uint32_t handle) {
+	uint64_t hash = glider_hash_u64(handle);
+	struct glider_drm_gem_handle *gem = find_gem_handle(device, handle, hash);
+	assert(gem != NULL && gem->n_refs > 0);
+
+	gem->n_refs--;
+	if (gem->n_refs > 0) {
+		return;
+	}
+
+	struct drm_gem_close args = { .handle = handle };
+	if (drmIoctl(device->fd, DRM_IOCTL_GEM_CLOSE, &args) != 0) {
+		wlr_log_errno(WLR_ERROR, "DRM_IOCTL_GEM_CLOSE failed");
+	}
+	glider_hash_table_remove(&device->gem_handles, &gem->entry);
+	free(gem);
+}
+
+/* The kernel returns the same GEM handle each time the same buffer is
+ * imported on a DRM FD, and closing a handle closes it for all users. Keep
+ * track of handle users so that we only close it once the last one is gone. */
+static bool import_gem_handle(struct glider_drm_device *device, int fd,
+		uint32_t *handle) {
+	if (drmPrimeFDToHandle(device->fd, fd, handle) != 0) {
+		wlr_log_errno(WLR_ERROR, "drmPrimeFDToHandle failed");
+		return false;
+	}
+
+	uint64_t hash = glider_hash_u64(*handle);
+	struct glider_drm_gem_handle *gem = find_gem_handle(device, *handle, hash);
+	if (gem == NULL) {
+		gem = calloc(1, sizeof(*gem));
+		if (gem == NULL) {
+			struct drm_gem_close args = { .handle = *handle };
+			drmIoctl(device->fd, DRM_IOCTL_GEM_CLOSE, &args);
+			return false;
+		}
+		gem->handle = *handle;
+		glider_hash_table_insert(&device->gem_handles, &gem->entry, hash);
+	}
+	gem->n_refs++;
+	return true;
+}
+
+static uint32_t add_prime_fb(struct glider_drm_device *device,
+		struct wlr_dmabuf_attributes *dmabuf, uint32_t handles[4]) {
+	int i;
+	for (i = 0; i < dmabuf->n_planes; i++) {
+		if (!import_gem_handle(device, dmabuf->fd[i], &handles[i])) {
+			goto error_handles;
+		}
+	}
+
+	uint32_t fb_id = add_fb(device, dmabuf->width, dmabuf->height,
+		dmabuf->format, dmabuf->modifier, handles, dmabuf->stride,
+		dmabuf->offset, dmabuf->n_planes);
+	if (fb_id == 0) {
+		goto error_handles;
+	}
+	return fb_id;
+
+error_handles:
+	for (int j = 0; j < i; j++) {
+		unref_gem_handle(device, handles[j]);
+		handles[j] = 0;
+	}
+	return 0;
+}
+
+/* Two DMA-BUF FDs refer to the same buffer if they point to the same inode.
+ * The inode can't be re-used by another DMA-BUF while we hold a GEM handle
+ * for it, so this is safe to use as a cache key, provided that the kernel
+ * gives each DMA-BUF its own inode (see check_dmabuf_inodes). */
+static bool fb_key_init(struct glider_drm_fb_key *key,
+		const struct wlr_dmabuf_attributes *dmabuf) {
+	// The key is hashed and compared as raw memory, clear any padding
+	memset(key, 0, sizeof(*key));
+	key->width = dmabuf->width;
+	key->height = dmabuf->height;
+	key->format = dmabuf->format;
+	key->modifier = dmabuf->modifier;
+	key->n_planes = dmabuf->n_planes;
+	for (int i = 0; i < dmabuf->n_planes; i++) {
+		key->offset[i] = dmabuf->offset[i];
+		key->stride[i] = dmabuf->stride[i];
+
+		struct stat st;
+		if (fstat(dmabuf->fd[i], &st) != 0) {
+			wlr_log_errno(WLR_ERROR, "fstat failed");
+			return false;
+		}
+		key->dev[i] = st.st_dev;
+		key->ino[i] = st.st_ino;
+	}
+	return true;
+}
+
+static struct glider_drm_fb *find_drm_fb(struct glider_drm_device *device,
+		const struct glider_drm_fb_key *key, uint64_t hash) {
+	struct wl_list *bucket = glider_hash_table_bucket(&device->fbs, hash);
+	struct glider_drm_fb *fb;
+	wl_list_for_each(fb, bucket, entry.link) {
+		if (memcmp(&fb->key, key, sizeof(*key)) == 0) {
+			return fb;
+		}
+	}
+	return NULL;
+}
+
+static int64_t get_now_msec(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void destroy_drm_fb(struct glider_drm_fb *fb) {
+	assert(fb->n_refs == 0);
+	if (drmModeRmFB(fb->device->fd, fb->id) != 0) {
+		wlr_log_errno(WLR_ERROR, "drmModeRmFB failed");
+	}
+	if (fb->gbm != NULL) {
+		gbm_bo_destroy(fb->gbm);
+	}
+	for (int i = 0; i < fb->key.n_planes; i++) {
+		if (fb->handles[i] != 0) {
+			unref_gem_handle(fb->device, fb->handles[i]);
+		}
+	}
+	if (!wl_list_empty(&fb->idle_link)) {
+		wl_list_remove(&fb->idle_link);
+		fb->device->idle_fbs_len--;
+	}
+	if (fb->device->share_fbs) {
+		glider_hash_table_remove(&fb->device->fbs, &fb->entry);
+	}
+	free(fb);
+}
+
+static struct glider_drm_fb *create_drm_fb(struct glider_drm_device *device,
+		struct wlr_dmabuf_attributes *dmabuf,
+		const struct glider_drm_fb_key *key, uint64_t hash) {
+	struct glider_drm_fb *fb = calloc(1, sizeof(*fb));
+	if (fb == NULL) {
+		return NULL;
+	}
+	fb->device = device;
+	fb->key = *key;
+
+	device->stats.fb_imports++;
+	switch (device->import_mode) {
+	case GLIDER_DRM_IMPORT_PRIME:
+		fb->id = add_prime_fb(device, dmabuf, fb->handles);
+		if (fb->id == 0) {
+			free(fb);
+			return NULL;
+		}
+		break;
+	case GLIDER_DRM_IMPORT_GBM:
+		fb->gbm = import_dmabuf(device, dmabuf);
+		if (fb->gbm == NULL) {
+			free(fb);
+			return NULL;
+		}
+		fb->id = add_gbm_bo(device, fb->gbm);
+		if (fb->id == 0) {
+			gbm_bo_destroy(fb->gbm);
+			free(fb);
+			return NULL;
+		}
+		break;
+	}
+
+	fb->n_refs = 1;
+	wl_list_init(&fb->idle_link);
+	if (device->share_fbs) {
+		glider_hash_table_insert(&device->fbs, &fb->entry, hash);
+	}
+	return fb;
+}
+
+static struct glider_drm_fb *ref_drm_fb(struct glider_drm_fb *fb) {
+	if (fb->n_refs == 0) {
+		wl_list_remove(&fb->idle_link);
+		wl_list_init(&fb->idle_link);
+		fb->device->idle_fbs_len--;
+	}
+	fb->n_refs++;
+	return fb;
+}
+
+/* Destroy the FBs which have been idle for too long, and wake up again when
+ * the next one expires. */
+static int handle_idle_fbs_timer(void *data) {
+	struct glider_drm_device *device = data;
+	int64_t now = get_now_msec();
+	while (!wl_list_empty(&device->idle_fbs)) {
+		struct glider_drm_fb *oldest =
+			wl_container_of(device->idle_fbs.prev, oldest, idle_link);
+		int64_t expiry = oldest->idle_since_msec + GLIDER_DRM_IDLE_FB_TIMEOUT_MS;
+		if (expiry > now) {
+			wl_event_source_timer_update(device->idle_fbs_timer,
+				expiry - now);
+			break;
+		}
+		destroy_drm_fb(oldest);
+	}
+	return 0;
+}
+
+static void unref_drm_fb(struct glider_drm_fb *fb) {
+	struct glider_drm_device *device = fb->device;
+
+	assert(fb->n_refs > 0);
+	fb->n_refs--;
+	if (fb->n_refs > 0) {
+		return;
+	}
+	if (!device->share_fbs) {
+		// No other buffer can pick it up
+		destroy_drm_fb(fb);
+		return;
+	}
+
+	if (device->idle_fbs_timer == NULL) {
+		struct wl_event_loop *event_loop =
+			wl_display_get_event_loop(device->backend->display);
+		device->idle_fbs_timer = wl_event_loop_add_timer(event_loop,
+			handle_idle_fbs_timer, device);
+		if (device->idle_fbs_timer == NULL) {
+			wlr_log(WLR_ERROR, "wl_event_loop_add_timer failed");
+			destroy_drm_fb(fb);
+			return;
+		}
+	}
+
+	// Clients often wrap the same DMA-BUF in a new wlr_buffer on each commit,
+	// and the previous wlr_buffer may be destroyed before the next one is
+	// attached. Keep a few unused FBs around for a short while, so that they
+	// can be picked up again without going through the import ioctls.
+	bool was_empty = wl_list_empty(&device->idle_fbs);
+	fb->idle_since_msec = get_now_msec();
+	wl_list_insert(&device->idle_fbs, &fb->idle_link);
+	device->idle_fbs_len++;
+	if (device->idle_fbs_len > GLIDER_DRM_IDLE_FBS_CAP) {
+		struct glider_drm_fb *oldest =
+			wl_container_of(device->idle_fbs.prev, oldest, idle_link);
+		destroy_drm_fb(oldest);
+	}
+	if (was_empty) {
+		wl_event_source_timer_update(device->idle_fbs_timer,
+			GLIDER_DRM_IDLE_FB_TIMEOUT_MS);
+	}
+}
+
+static void handle_buffer_destroy(struct wl_listener *listener, void *data) {
+	struct glider_drm_buffer *drm_buffer =
+		wl_container_of(listener, drm_buffer, destroy);
+	destroy_drm_buffer(drm_buffer);
+}
+
+static struct glider_drm_buffer *find_drm_buffer(
+		struct glider_drm_device *device, struct wlr_buffer *buffer,
+		uint64_t hash) {
+	struct wl_list *bucket = glider_hash_table_bucket(&device->buffers, hash);
+	struct glider_drm_buffer *drm_buffer;
+	wl_list_for_each(drm_buffer, bucket, entry.link) {
+		if (drm_buffer->buffer == buffer) {
+			return drm_buffer;
+		}
+	}
+	return NULL;
+}
+
+static struct glider_drm_fb *get_or_create_drm_fb(
+		struct glider_drm_device *device, struct wlr_buffer *buffer,
+		uint64_t *planes) {
+	struct wlr_dmabuf_attributes dmabuf;
+	if (!wlr_buffer_get_dmabuf(buffer, &dmabuf)) {
+		return NULL;
+	}
+
+	*planes = get_drm_format_planes(device, dmabuf.format, dmabuf.modifier);
+	if (*planes == 0 && !has_drm_format_untracked_plane(device, NULL,
+			dmabuf.format, dmabuf.modifier)) {
+		wlr_log(WLR_DEBUG, "No plane can scan-out format 0x%"PRIX32", "
+			"modifier 0x%"PRIX64"%s", dmabuf.format, dmabuf.modifier,
+			get_drm_format_modifiers(device, dmabuf.format) == 0 ?
+			" (unsupported format)" : "");
+		return NULL;
+	}
+
+	struct glider_drm_fb_key key;
+	if (!fb_key_init(&key, &dmabuf)) {
+		return NULL;
+	}
+	uint64_t hash = glider_hash_bytes(0, &key, sizeof(key));
+
+	struct glider_drm_fb *fb =
+		device->share_fbs ? find_drm_fb(device, &key, hash) : NULL;
+	if (fb != NULL) {
+		device->stats.fb_reuses++;
+		return ref_drm_fb(fb);
+	}
+	return create_drm_fb(device, &dmabuf, &key, hash);
+}
+
+struct glider_drm_buffer *get_or_create_drm_buffer(
+		struct glider_drm_device *device, struct wlr_buffer *buffer) {
+	uint64_t hash = glider_hash_ptr(buffer);
+	struct glider_drm_buffer *drm_buffer =
+		find_drm_buffer(device, buffer, hash);
+	if (drm_buffer != NULL) {
+		if (drm_buffer->fb != NULL) {
+			device->stats.fb_hits++;
+			return drm_buffer;
+		}
+		if (drm_buffer->formats_seq == device->formats_seq) {
+			device->stats.fb_rejects++;
+			return NULL;
+		}
+		// The scan-out formats have changed since this buffer has been
+		// rejected, give it another try
+	} else {
+		drm_buffer = calloc(1, sizeof(*drm_buffer));
+		if (drm_buffer == NULL) {
+			return NULL;
+		}
+
+		drm_buffer->buffer = buffer;
+		drm_buffer->device = device;
+		wl_list_init(&drm_buffer->attachments);
+
+		drm_buffer->destroy.notify = handle_buffer_destroy;
+		wl_signal_add(&buffer->events.destroy, &drm_buffer->destroy);
+
+		glider_hash_table_insert(&device->buffers, &drm_buffer->entry, hash);
+	}
+
+	device->stats.fb_misses++;
+	drm_buffer->fb = get_or_create_drm_fb(device, buffer, &drm_buffer->planes);
+	if (drm_buffer->fb == NULL) {
+		drm_buffer->formats_seq = device->formats_seq;
+		device->stats.fb_rejects++;
+		return NULL;
+	}
+
+	return drm_buffer;
+}
+
+void destroy_drm_buffer(struct glider_drm_buffer *buffer) {
+	struct glider_drm_attachment *att, *att_tmp;
+	wl_list_for_each_safe(att, att_tmp, &buffer->attachments, buffer_link) {
+		unlock_drm_attachment(att);
+	}
+	if (buffer->fb != NULL) {
+		unref_drm_fb(buffer->fb);
+	}
+	wl_list_remove(&buffer->destroy.link);
+	glider_hash_table_remove(&buffer->device->buffers, &buffer->entry);
+	free(buffer);
+}
+
+static enum glider_drm_import_mode get_import_mode(
+		struct glider_drm_device *device) {
+	uint64_t cap;
+	bool has_prime_import = drmGetCap(device->fd, DRM_CAP_PRIME, &cap) == 0 &&
+		(cap & DRM_PRIME_CAP_IMPORT);
+
+	const char *env = getenv("GLIDER_DRM_IMPORT");
+	if (env == NULL || strcmp(env, "prime") == 0) {
+		if (has_prime_import) {
+			return GLIDER_DRM_IMPORT_PRIME;
+		}
+		wlr_log(WLR_INFO, "PRIME import unsupported, falling back to GBM");
+	} else if (strcmp(env, "gbm") != 0) {
+		wlr_log(WLR_ERROR, "Invalid GLIDER_DRM_IMPORT value: %s", env);
+	}
+	return GLIDER_DRM_IMPORT_GBM;
+}
+
+uint32_t create_drm_dumb_fb(struct glider_drm_device *device,
+		uint32_t width, uint32_t height, uint32_t *handle) {
+	struct drm_mode_create_dumb create = {
+		.width = width,
+		.height = height,
+		.bpp = 32,
+	};
+	if (drmIoctl(device->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) != 0) {
+		wlr_log_errno(WLR_ERROR, "DRM_IOCTL_MODE_CREATE_DUMB failed");
+		return 0;
+	}
+
+	uint32_t handles[4] = { create.handle };
+	uint32_t strides[4] = { create.pitch };
+	uint32_t offsets[4] = {0};
+	uint32_t fb_id = add_fb(device, width, height, DRM_FORMAT_XRGB8888,
+		DRM_FORMAT_MOD_INVALID, handles, strides, offsets, 1);
+	if (fb_id == 0) {
+		struct drm_mode_destroy_dumb destroy = { .handle = create.handle };
+		drmIoctl(device->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+		return 0;
+	}
+	*handle = create.handle;
+	return fb_id;
+}
+
+void destroy_drm_dumb_fb(struct glider_drm_device *device, uint32_t fb_id,
+		uint32_t handle) {
+	if (drmModeRmFB(device->fd, fb_id) != 0) {
+		wlr_log_errno(WLR_ERROR, "drmModeRmFB failed");
+	}
+	struct drm_mode_destroy_dumb destroy = { .handle = handle };
+	if (drmIoctl(device->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy) != 0) {
+		wlr_log_errno(WLR_ERROR, "DRM_IOCTL_MODE_DESTROY_DUMB failed");
+	}
+}
+
+/* Before Linux 5.3, all DMA-BUFs share a single anonymous inode. Export two
+ * buffers and check that they get distinct inodes before relying on them to
+ * identify buffers. */
+static bool check_dmabuf_inodes(struct glider_drm_device *device) {
+	struct drm_mode_create_dumb create[2] = {0};
+	int fds[2] = { -1, -1 };
+	struct stat st[2];
+	bool unique = false;
+	for (size_t i = 0; i < 2; i++) {
+		create[i] = (struct drm_mode_create_dumb){
+			.width = 1,
+			.height = 1,
+			.bpp = 32,
+		};
+		if (drmIoctl(device->fd, DRM_IOCTL_MODE_CREATE_DUMB,
+				&create[i]) != 0) {
+			wlr_log_errno(WLR_DEBUG, "DRM_IOCTL_MODE_CREATE_DUMB failed");
+			create[i].handle = 0;
+			goto out;
+		}
+		if (drmPrimeHandleToFD(device->fd, create[i].handle, DRM_CLOEXEC,
+				&fds[i]) != 0) {
+			wlr_log_errno(WLR_DEBUG, "drmPrimeHandleToFD failed");
+			fds[i] = -1;
+			goto out;
+		}
+		if (fstat(fds[i], &st[i]) != 0) {
+			wlr_log_errno(WLR_DEBUG, "fstat failed");
+			goto out;
+		}
+	}
+	unique = st[0].st_dev != st[1].st_dev || st[0].st_ino != st[1].st_ino;
+
+out:
+	for (size_t i = 0; i < 2; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+		}
+		if (create[i].handle != 0) {
+			struct drm_mode_destroy_dumb destroy = {
+				.handle = create[i].handle,
+			};
+			drmIoctl(device->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+		}
+	}
+	return unique;
+}
+
+bool init_drm_buffers(struct glider_drm_device *device) {
+	device->import_mode = get_import_mode(device);
+	wlr_log(WLR_DEBUG, "Importing scan-out buffers via %s",
+		device->import_mode == GLIDER_DRM_IMPORT_PRIME ? "PRIME" : "GBM");
+
+	device->share_fbs = check_dmabuf_inodes(device);
+	if (!device->share_fbs) {
+		wlr_log(WLR_INFO, "Can't tell DMA-BUFs apart, disabling FB sharing");
+	}
+
+	wl_list_init(&device->idle_fbs);
+	if (!glider_hash_table_init(&device->buffers)) {
+		return false;
+	}
+	if (!glider_hash_table_init(&device->fbs)) {
+		goto error_buffers;
+	}
+	if (!glider_hash_table_init(&device->gem_handles)) {
+		goto error_fbs;
+	}
+	return true;
+
+error_fbs:
+	glider_hash_table_finish(&device->fbs);
+error_buffers:
+	glider_hash_table_finish(&device->buffers);
+	return false;
+}
+
+void finish_drm_buffers(struct glider_drm_device *device) {
+	for (size_t i = 0; i < device->buffers.buckets_len; i++) {
+		struct glider_drm_buffer *buf, *buf_tmp;
+		wl_list_for_each_safe(buf, buf_tmp, &device->buffers.buckets[i],
+				entry.link) {
+			destroy_drm_buffer(buf);
+		}
+	}
+
+	// All FBs are now unused
+	struct glider_drm_fb *fb, *fb_tmp;
+	wl_list_for_each_safe(fb, fb_tmp, &device->idle_fbs, idle_link) {
+		destroy_drm_fb(fb);
+	}
+	if (device->idle_fbs_timer != NULL) {
+		wl_event_source_remove(device->idle_fbs_timer);
+		device->idle_fbs_timer = NULL;
+	}
+
+	glider_hash_table_finish(&device->buffers);
+	glider_hash_table_finish(&device->fbs);
+	glider_hash_table_finish(&device->gem_handles);
+}
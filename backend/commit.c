@@ -0,0 +1,211 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wlr/util/log.h>
+#include "backend/backend.h"
+
+/* Device-wide commits: instead of submitting one atomic page-flip per
+ * connector, page-flips are queued and flushed from an idle callback, so that
+ * all connectors which rendered during the same event loop iteration are
+ * flipped with a single atomic commit. */
+
+static bool commit_connectors(struct glider_drm_device *device,
+		struct glider_drm_connector **conns, size_t conns_len,
+		uint32_t flags) {
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (req == NULL) {
+		wlr_log_errno(WLR_ERROR, "drmModeAtomicAlloc failed");
+		return false;
+	}
+
+	for (size_t i = 0; i < conns_len; i++) {
+		if (!apply_drm_connector_props(conns[i], req, flags)) {
+			drmModeAtomicFree(req);
+			return false;
+		}
+	}
+
+	int ret = drmModeAtomicCommit(device->fd, req, flags, device);
+	drmModeAtomicFree(req);
+	if (ret != 0) {
+		wlr_log(WLR_DEBUG, "Device-wide atomic commit with %zu connectors "
+			"failed: %s", conns_len, strerror(-ret));
+	}
+	return ret == 0;
+}
+
+/* Figure out which connectors can't be committed by bisecting the set with
+ * test-only commits. */
+static void check_connectors(struct glider_drm_device *device,
+		struct glider_drm_connector **conns, bool *ok, size_t conns_len) {
+	if (commit_connectors(device, conns, conns_len,
+			DRM_MODE_ATOMIC_TEST_ONLY)) {
+		for (size_t i = 0; i < conns_len; i++) {
+			ok[i] = true;
+		}
+		return;
+	}
+
+	if (conns_len == 1) {
+		wlr_log(WLR_ERROR, "Page-flip failed on connector %"PRIu32,
+			conns[0]->id);
+		ok[0] = false;
+		return;
+	}
+
+	size_t half = conns_len / 2;
+	check_connectors(device, conns, ok, half);
+	check_connectors(device, conns + half, ok + half, conns_len - half);
+}
+
+static void start_flip_sync(struct glider_drm_device *device,
+		struct glider_drm_connector **conns, size_t conns_len) {
+	if (conns_len < 2) {
+		return;
+	}
+
+	// Flips are synchronized if they all complete within half of the
+	// shortest refresh period
+	int32_t max_refresh = 0;
+	for (size_t i = 0; i < conns_len; i++) {
+		conns[i]->crtc->flip_sync_pending = true;
+		if (conns[i]->output.refresh > max_refresh) {
+			max_refresh = conns[i]->output.refresh;
+		}
+	}
+
+	device->flip_sync.expected = conns_len;
+	device->flip_sync.received = 0;
+	device->flip_sync.threshold_nsec = max_refresh > 0 ?
+		500000000000LL / max_refresh : 0;
+}
+
+static int64_t timespec_to_nsec(const struct timespec *t) {
+	return (int64_t)t->tv_sec * 1000000000 + t->tv_nsec;
+}
+
+void update_drm_flip_sync(struct glider_drm_crtc *crtc,
+		const struct timespec *t) {
+	if (!crtc->flip_sync_pending) {
+		return;
+	}
+	crtc->flip_sync_pending = false;
+
+	struct glider_drm_device *device = crtc->device;
+	int64_t nsec = timespec_to_nsec(t);
+	if (device->flip_sync.received == 0) {
+		device->flip_sync.min_nsec = device->flip_sync.max_nsec = nsec;
+	} else if (nsec < device->flip_sync.min_nsec) {
+		device->flip_sync.min_nsec = nsec;
+	} else if (nsec > device->flip_sync.max_nsec) {
+		device->flip_sync.max_nsec = nsec;
+	}
+
+	device->flip_sync.received++;
+	if (device->flip_sync.received < device->flip_sync.expected) {
+		return;
+	}
+
+	int64_t spread = device->flip_sync.max_nsec - device->flip_sync.min_nsec;
+	bool synced = spread <= device->flip_sync.threshold_nsec;
+	if (synced) {
+		device->stats.synced_flips++;
+	} else {
+		device->stats.unsynced_flips++;
+	}
+	wlr_log(WLR_DEBUG, "Device-wide page-flip of %zu CRTCs completed "
+		"%s (spread: %"PRId64"ns)", device->flip_sync.expected,
+		synced ? "in sync" : "out of sync", spread);
+}
+
+void flush_drm_device_commit(struct glider_drm_device *device) {
+	if (device->commit_idle != NULL) {
+		wl_event_source_remove(device->commit_idle);
+		device->commit_idle = NULL;
+	}
+
+	struct glider_drm_connector *conns[device->crtcs_len + 1];
+	size_t conns_len = 0;
+	struct glider_drm_connector *conn;
+	wl_list_for_each(conn, &device->connectors, link) {
+		if (!conn->commit_queued) {
+			continue;
+		}
+		conn->commit_queued = false;
+		if (conn->crtc != NULL) {
+			conns[conns_len++] = conn;
+		}
+	}
+	if (conns_len == 0) {
+		return;
+	}
+
+	wlr_log(WLR_DEBUG, "Performing device-wide atomic page-flip "
+		"on %zu connectors", conns_len);
+
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	bool ok[conns_len];
+	if (commit_connectors(device, conns, conns_len, flags)) {
+		for (size_t i = 0; i < conns_len; i++) {
+			ok[i] = true;
+		}
+	} else {
+		// Leave out the connectors which can't be committed, and try again
+		// with the others
+		check_connectors(device, conns, ok, conns_len);
+
+		struct glider_drm_connector *good[conns_len];
+		size_t good_len = 0;
+		for (size_t i = 0; i < conns_len; i++) {
+			if (ok[i]) {
+				good[good_len++] = conns[i];
+			}
+		}
+
+		if (good_len > 0 &&
+				!commit_connectors(device, good, good_len, flags)) {
+			wlr_log(WLR_ERROR, "Device-wide atomic page-flip failed");
+			for (size_t i = 0; i < conns_len; i++) {
+				ok[i] = false;
+			}
+		}
+	}
+
+	struct glider_drm_connector *flipped[conns_len];
+	size_t flipped_len = 0;
+	for (size_t i = 0; i < conns_len; i++) {
+		finish_drm_connector_commit(conns[i], flags, ok[i]);
+		if (ok[i]) {
+			flipped[flipped_len++] = conns[i];
+		} else {
+			// The compositor was told the commit succeeded and waits for a
+			// page-flip event which won't come
+			wlr_output_send_frame(&conns[i]->output);
+		}
+	}
+	start_flip_sync(device, flipped, flipped_len);
+}
+
+static void handle_commit_idle(void *data) {
+	struct glider_drm_device *device = data;
+	device->commit_idle = NULL;
+	flush_drm_device_commit(device);
+}
+
+void queue_drm_connector_commit(struct glider_drm_connector *conn) {
+	struct glider_drm_device *device = conn->device;
+
+	conn->commit_queued = true;
+	if (device->commit_idle != NULL) {
+		return;
+	}
+
+	struct wl_event_loop *event_loop =
+		wl_display_get_event_loop(device->backend->display);
+	device->commit_idle =
+		wl_event_loop_add_idle(event_loop, handle_commit_idle, device);
+	if (device->commit_idle == NULL) {
+		wlr_log(WLR_ERROR, "wl_event_loop_add_idle failed");
+		flush_drm_device_commit(device);
+	}
+}
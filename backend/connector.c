@@ -1,41 +1,38 @@
 #define _XOPEN_SOURCE 700
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
-#include <strings.h>
+#include <string.h>
+#include <unistd.h>
 #include <wlr/util/log.h>
 #include "backend/backend.h"
+#include "trace.h"
 
 static const struct wlr_output_impl output_impl;
 
+static uint64_t get_drm_connector_prop_value(drmModeConnector *drm_conn,
+		uint32_t prop_id, uint64_t default_value) {
+	for (int i = 0; i < drm_conn->count_props; i++) {
+		if (drm_conn->props[i] == prop_id) {
+			return drm_conn->prop_values[i];
+		}
+	}
+	return default_value;
+}
+
 static struct glider_drm_connector *get_drm_connector_from_output(
 		struct wlr_output *wlr_output) {
 	assert(wlr_output->impl == &output_impl);
 	return (struct glider_drm_connector *)wlr_output;
 }
 
+/* The CRTC is picked device-wide, so that connectors don't take CRTCs other
+ * connectors need, and so that CRTCs with more overlay planes are spread
+ * across outputs. */
 static struct glider_drm_crtc *connector_pick_crtc(
 		struct glider_drm_connector *conn) {
-	struct glider_drm_device *device = conn->device;
-
-	// Remove in-use CRTCs from the set
-	uint32_t possible_crtcs = conn->possible_crtcs;
-	struct glider_drm_connector *c;
-	wl_list_for_each(c, &device->connectors, link) {
-		if (c->crtc != NULL) {
-			size_t crtc_index = c->crtc - device->crtcs;
-			possible_crtcs &= ~(1 << crtc_index);
-		}
-	}
-	if (possible_crtcs == 0) {
-		return NULL;
-	} else {
-		size_t crtc_index = ffs(possible_crtcs) - 1;
-		if (crtc_index >= device->crtcs_len) {
-			// Some drivers set possible_crtcs to UINT32_MAX
-			return NULL;
-		}
-		return &device->crtcs[crtc_index];
-	}
+	assign_drm_crtcs(conn->device, conn);
+	return conn->assigned_crtc;
 }
 
 static void connector_set_crtc(struct glider_drm_connector *conn,
@@ -46,11 +43,10 @@ static void connector_set_crtc(struct glider_drm_connector *conn,
 
 	if (conn->crtc != NULL) {
 		// TODO: don't do this if another connector is using the CRTC
-		for (size_t i = 0; i < conn->crtc->attachments_cap; i++) {
-			struct glider_drm_attachment *att = &conn->crtc->attachments[i];
-			if (att->state == GLIDER_DRM_BUFFER_PENDING) {
-				unlock_drm_attachment(att);
-			}
+		struct glider_drm_layer *layer, *layer_tmp;
+		wl_list_for_each_safe(layer, layer_tmp,
+				&conn->crtc->pending_layers, pending_link) {
+			unlock_drm_attachment(&layer->pending);
 		}
 	}
 
@@ -58,8 +54,8 @@ static void connector_set_crtc(struct glider_drm_connector *conn,
 	conn->props[GLIDER_DRM_CONNECTOR_CRTC_ID].pending = crtc ? crtc->id : 0;
 }
 
-static bool connector_apply_props(struct glider_drm_connector *conn,
-		drmModeAtomicReq *req) {
+bool apply_drm_connector_props(struct glider_drm_connector *conn,
+		drmModeAtomicReq *req, uint32_t flags) {
 	if (!apply_drm_props(conn->props, GLIDER_DRM_CONNECTOR_PROP_COUNT,
 			conn->id, req)) {
 		return false;
@@ -69,18 +65,202 @@ static bool connector_apply_props(struct glider_drm_connector *conn,
 				conn->crtc->id, req)) {
 			return false;
 		}
-		if (!liftoff_output_apply(conn->crtc->liftoff_output, req)) {
+		if (!liftoff_output_apply(conn->crtc->liftoff_output, req) ||
+				!apply_drm_layers_damage(conn->crtc, req)) {
 			return false;
 		}
+
+		// Ask KMS for a fence signalling when the page-flip is latched. Not
+		// for test-only commits, which would leak the FD, nor for async
+		// page-flips, which can't change CRTC properties. Other commits leave
+		// the fence of the last page-flip alone.
+		struct glider_drm_prop *out_fence =
+			&conn->crtc->props[GLIDER_DRM_CRTC_OUT_FENCE_PTR];
+		if (out_fence->id != 0 &&
+				!(flags & (DRM_MODE_ATOMIC_TEST_ONLY |
+					DRM_MODE_PAGE_FLIP_ASYNC)) &&
+				conn->crtc->props[GLIDER_DRM_CRTC_ACTIVE].pending) {
+			// The previous page-flip has completed, so its fence is done
+			assert(conn->crtc->out_fence_source == NULL &&
+				conn->crtc->out_fence_fd < 0);
+			conn->crtc->out_fence_fd = -1;
+			int ret = drmModeAtomicAddProperty(req, conn->crtc->id,
+				out_fence->id, (uint64_t)(uintptr_t)&conn->crtc->out_fence_fd);
+			if (ret < 0) {
+				wlr_log(WLR_ERROR, "drmModeAtomicAddProperty failed");
+				return false;
+			}
+		}
 	}
 
 	return true;
 }
 
+/* Async page-flips can only update the FB_ID of the primary plane. */
+static bool connector_can_flip_async(struct glider_drm_connector *conn) {
+	if (conn->crtc == NULL || !conn->device->cap_atomic_async_page_flip) {
+		return false;
+	}
+
+	// Plane allocation of the last commit, which is still valid as long as
+	// the layer configuration doesn't change
+	size_t n = 0;
+	struct glider_drm_layer *layer;
+	wl_list_for_each(layer, &conn->crtc->pending_layers, pending_link) {
+		if (n++ > 0 || liftoff_layer_get_plane_id(layer->layer) !=
+				conn->crtc->primary_plane->id) {
+			return false;
+		}
+	}
+	return n == 1;
+}
+
+/* Returns zero on success, a negative errno value on failure. */
+static int commit_connector(struct glider_drm_connector *conn,
+		uint32_t flags) {
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (req == NULL) {
+		wlr_log_errno(WLR_ERROR, "drmModeAtomicAlloc failed");
+		return -ENOMEM;
+	}
+
+	if (!apply_drm_connector_props(conn, req, flags)) {
+		drmModeAtomicFree(req);
+		return -EINVAL;
+	}
+
+	int ret = drmModeAtomicCommit(conn->device->fd, req, flags, conn->device);
+	drmModeAtomicFree(req);
+	if (ret != 0) {
+		wlr_log(WLR_DEBUG, "Atomic commit failed: %s", strerror(-ret));
+	}
+	return ret;
+}
+
+/* Check with a test-only modeset that the CRTC can drive the mode on the
+ * connector, e.g. that the link bandwidth is sufficient. Some drivers reject
+ * modesets without an enabled primary plane, so fb_id is displayed on it. */
+static bool test_drm_mode(struct glider_drm_connector *conn,
+		struct glider_drm_crtc *crtc, struct glider_drm_mode *mode,
+		uint32_t fb_id) {
+	if (!init_drm_mode_blob(conn->device, mode)) {
+		return false;
+	}
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (req == NULL) {
+		wlr_log_errno(WLR_ERROR, "drmModeAtomicAlloc failed");
+		return false;
+	}
+
+	struct glider_drm_plane *plane = crtc->primary_plane;
+	uint64_t width = mode->drm_mode.hdisplay, height = mode->drm_mode.vdisplay;
+	const struct {
+		enum glider_drm_plane_prop prop;
+		uint64_t value;
+	} plane_props[] = {
+		{ GLIDER_DRM_PLANE_FB_ID, fb_id },
+		{ GLIDER_DRM_PLANE_CRTC_ID, crtc->id },
+		{ GLIDER_DRM_PLANE_SRC_X, 0 },
+		{ GLIDER_DRM_PLANE_SRC_Y, 0 },
+		{ GLIDER_DRM_PLANE_SRC_W, width << 16 },
+		{ GLIDER_DRM_PLANE_SRC_H, height << 16 },
+		{ GLIDER_DRM_PLANE_CRTC_X, 0 },
+		{ GLIDER_DRM_PLANE_CRTC_Y, 0 },
+		{ GLIDER_DRM_PLANE_CRTC_W, width },
+		{ GLIDER_DRM_PLANE_CRTC_H, height },
+	};
+
+	bool ok = drmModeAtomicAddProperty(req, conn->id,
+			conn->props[GLIDER_DRM_CONNECTOR_CRTC_ID].id, crtc->id) >= 0 &&
+		drmModeAtomicAddProperty(req, crtc->id,
+			crtc->props[GLIDER_DRM_CRTC_MODE_ID].id, mode->blob_id) >= 0 &&
+		drmModeAtomicAddProperty(req, crtc->id,
+			crtc->props[GLIDER_DRM_CRTC_ACTIVE].id, 1) >= 0;
+	for (size_t i = 0; ok && i < sizeof(plane_props) / sizeof(plane_props[0]);
+			i++) {
+		ok = drmModeAtomicAddProperty(req, plane->id,
+			plane->props[plane_props[i].prop].id, plane_props[i].value) >= 0;
+	}
+	if (ok) {
+		ok = drmModeAtomicCommit(conn->device->fd, req,
+			DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET,
+			NULL) == 0;
+	}
+	drmModeAtomicFree(req);
+	return ok;
+}
+
+/* Remove the modes which fail a test-only modeset from the output. This is
+ * done on the first enable rather than at hotplug, to keep one modeset test
+ * per mode off the startup path, so the commit falls back to another mode if
+ * the requested one is rejected. If no mode passes, something else than the
+ * mode is wrong, so keep them all. */
+static void validate_modes(struct glider_drm_connector *conn) {
+	struct glider_drm_device *device = conn->device;
+	struct glider_drm_crtc *crtc = conn->crtc;
+	if (conn->modes_len == 0 || crtc == NULL) {
+		return;
+	}
+
+	bool ok[conn->modes_len];
+	size_t ok_len = 0;
+	uint32_t fb_id = 0, fb_handle = 0;
+	int32_t fb_width = 0, fb_height = 0;
+	for (size_t i = 0; i < conn->modes_len; i++) {
+		struct glider_drm_mode *mode = &conn->modes[i];
+		// Modes of the same size are usually listed together
+		if (fb_id == 0 || fb_width != mode->wlr_mode.width ||
+				fb_height != mode->wlr_mode.height) {
+			if (fb_id != 0) {
+				destroy_drm_dumb_fb(device, fb_id, fb_handle);
+			}
+			fb_width = mode->wlr_mode.width;
+			fb_height = mode->wlr_mode.height;
+			fb_id = create_drm_dumb_fb(device, fb_width, fb_height,
+				&fb_handle);
+			if (fb_id == 0) {
+				return;
+			}
+		}
+
+		ok[i] = test_drm_mode(conn, crtc, mode, fb_id);
+		if (ok[i]) {
+			ok_len++;
+		}
+	}
+	destroy_drm_dumb_fb(device, fb_id, fb_handle);
+	if (ok_len == 0 || ok_len == conn->modes_len) {
+		return;
+	}
+
+	for (size_t i = 0; i < conn->modes_len; i++) {
+		if (ok[i]) {
+			continue;
+		}
+		struct glider_drm_mode *mode = &conn->modes[i];
+		wlr_log(WLR_DEBUG, "Connector %"PRIu32": rejecting mode "
+			"%"PRId32"x%"PRId32"@%"PRId32, conn->id, mode->wlr_mode.width,
+			mode->wlr_mode.height, mode->wlr_mode.refresh);
+		// Leave the link initialized, output_destroy removes it. An empty
+		// link marks the mode as rejected.
+		wl_list_remove(&mode->wlr_mode.link);
+		wl_list_init(&mode->wlr_mode.link);
+		finish_drm_mode_blob(device, mode);
+	}
+}
+
 static bool connector_commit(struct glider_drm_connector *conn,
 		bool test_only) {
 	struct wlr_output_state *pending = &conn->output.pending;
 
+	if (!conn->device->backend->session->active) {
+		// We're not DRM master, KMS would reject the commit anyways
+		wlr_log(WLR_DEBUG, "Skipping commit on connector %"PRIu32": "
+			"session is inactive", conn->id);
+		return false;
+	}
+
 	uint32_t flags = 0;
 	if (test_only) {
 		flags |= DRM_MODE_ATOMIC_TEST_ONLY;
@@ -110,8 +290,23 @@ static bool connector_commit(struct glider_drm_connector *conn,
 			}
 			connector_set_crtc(conn, crtc);
 		}
+		if (!conn->modes_validated) {
+			conn->modes_validated = true;
+			validate_modes(conn);
+		}
 
 		struct wlr_output_mode *wlr_mode = pending->mode;
+		if (wl_list_empty(&wlr_mode->link)) {
+			// Modes are validated after the compositor picked one, don't
+			// modeset a mode known to fail
+			struct wlr_output_mode *fallback =
+				wlr_output_preferred_mode(&conn->output);
+			wlr_log(WLR_ERROR, "Connector %"PRIu32": the requested mode "
+				"failed the test-only modeset, falling back to "
+				"%"PRId32"x%"PRId32"@%"PRId32, conn->id, fallback->width,
+				fallback->height, fallback->refresh);
+			pending->mode = wlr_mode = fallback;
+		}
 		struct glider_drm_mode *mode = (struct glider_drm_mode *)wlr_mode;
 		if (!set_drm_crtc_mode(conn->crtc, mode)) {
 			return false;
@@ -125,58 +320,86 @@ static bool connector_commit(struct glider_drm_connector *conn,
 	} else if (flags & DRM_MODE_ATOMIC_TEST_ONLY) {
 		wlr_log(WLR_DEBUG, "Performing test-only atomic commit "
 			"on connector %"PRIu32, conn->id);
+	} else if (conn->tearing && connector_can_flip_async(conn)) {
+		wlr_log(WLR_DEBUG, "Performing async page-flip on connector %"PRIu32,
+			conn->id);
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+	} else if (conn->device->aggregate_commits) {
+		// The page-flip will be submitted together with the other connectors
+		// of the device
+		queue_drm_connector_commit(conn);
+		return true;
 	} else {
 		wlr_log(WLR_DEBUG, "Performing atomic page-flip on connector %"PRIu32,
 			conn->id);
 	}
 
-	drmModeAtomicReq *req = drmModeAtomicAlloc();
-	if (req == NULL) {
-		wlr_log_errno(WLR_ERROR, "drmModeAtomicAlloc failed");
-		return false;
+	int ret = commit_connector(conn, flags);
+	if (ret != 0 && (flags & DRM_MODE_PAGE_FLIP_ASYNC)) {
+		// The driver doesn't support async page-flips for this plane
+		// configuration, fall back to vsync
+		conn->device->stats.async_fallbacks++;
+		flags &= ~DRM_MODE_PAGE_FLIP_ASYNC;
+		ret = commit_connector(conn, flags);
 	}
-
-	if (!connector_apply_props(conn, req)) {
-		drmModeAtomicFree(req);
-		return false;
+	if (flags & DRM_MODE_ATOMIC_TEST_ONLY) {
+		return ret == 0;
 	}
 
-	int ret = drmModeAtomicCommit(conn->device->fd, req, flags, conn->device);
-	drmModeAtomicFree(req);
-	if (ret != 0) {
-		wlr_log(WLR_DEBUG, "Atomic commit failed: %s", strerror(-ret));
+	finish_drm_connector_commit(conn, flags, ret == 0);
+	if (ret == 0 && (pending->committed & WLR_OUTPUT_STATE_MODE)) {
+		wlr_output_update_mode(&conn->output, pending->mode);
 	}
 
-	if (flags & DRM_MODE_ATOMIC_TEST_ONLY) {
-		return ret == 0;
-	}
+	return ret == 0;
+}
 
+void finish_drm_connector_commit(struct glider_drm_connector *conn,
+		uint32_t flags, bool ok) {
 	// Commit properties on success, rollback on failure
 	// TODO: release buffers when rolling back
 	move_drm_prop_values(conn->props,
-		GLIDER_DRM_CONNECTOR_PROP_COUNT, ret == 0);
-	move_drm_prop_values(conn->crtc->props,
-		GLIDER_DRM_CRTC_PROP_COUNT, ret == 0);
-
-	if ((flags & DRM_MODE_PAGE_FLIP_EVENT) && ret == 0 && conn->crtc != NULL) {
-		// On a successful page-flip, mark the buffers we've just submitted
-		// to KMS
-		for (size_t i = 0; i < conn->crtc->attachments_cap; i++) {
-			struct glider_drm_attachment *att = &conn->crtc->attachments[i];
-			if (att->state == GLIDER_DRM_BUFFER_PENDING) {
-				att->state = GLIDER_DRM_BUFFER_QUEUED;
+		GLIDER_DRM_CONNECTOR_PROP_COUNT, ok);
+	if (conn->crtc != NULL) {
+		move_drm_prop_values(conn->crtc->props,
+			GLIDER_DRM_CRTC_PROP_COUNT, ok);
+	}
+
+	if (conn->crtc != NULL) {
+		bool flipped = (flags & DRM_MODE_PAGE_FLIP_EVENT) && ok;
+		// Before the pending buffers are moved to the queued slots
+		finish_drm_layers_damage(conn->crtc, flipped);
+
+		struct glider_drm_layer *layer, *layer_tmp;
+		wl_list_for_each_safe(layer, layer_tmp,
+				&conn->crtc->pending_layers, pending_link) {
+			// KMS holds its own reference to the in-fences of the submitted
+			// buffers, and they're stale if the commit failed
+			if (ok && layer->pending.in_fence_fd >= 0) {
+				conn->device->stats.in_fences++;
+			}
+			reset_drm_attachment_in_fence(&layer->pending);
+
+			// On a successful page-flip, mark the buffers we've just
+			// submitted to KMS
+			if (flipped) {
+				move_drm_attachment(&layer->queued, &layer->pending);
 			}
 		}
-	}
 
-	if (ret == 0) {
-		wlr_output_update_enabled(&conn->output, true);
-		if (pending->committed & WLR_OUTPUT_STATE_MODE) {
-			wlr_output_update_mode(&conn->output, pending->mode);
+		if (flipped) {
+			conn->crtc->flip_seq++;
+			watch_drm_crtc_out_fence(conn->crtc);
+			conn->async_flip_pending = flags & DRM_MODE_PAGE_FLIP_ASYNC;
+			if (conn->async_flip_pending) {
+				conn->device->stats.async_flips++;
+			}
 		}
 	}
 
-	return ret == 0;
+	if (ok) {
+		wlr_output_update_enabled(&conn->output, true);
+	}
 }
 
 static bool output_attach_render(struct wlr_output *output, int *buffer_age) {
@@ -199,14 +422,18 @@ static bool output_commit(struct wlr_output *output) {
 static void output_destroy(struct wlr_output *output) {
 	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
 
+	conn->commit_queued = false;
 	connector_set_crtc(conn, NULL);
+	conn->assigned_crtc = NULL;
 
 	for (size_t i = 0; i < conn->modes_len; i++) {
 		wl_list_remove(&conn->modes[i].wlr_mode.link);
+		finish_drm_mode_blob(conn->device, &conn->modes[i]);
 	}
 	free(conn->modes);
 	conn->modes = NULL;
 	conn->modes_len = 0;
+	conn->modes_validated = false;
 
 	memset(&conn->output, 0, sizeof(struct wlr_output));
 }
@@ -254,6 +481,7 @@ struct glider_drm_connector *create_drm_connector(
 	}
 
 	// Populate the connector with properties that don't change across hotplugs
+	device->stats.init_ioctls++;
 	drmModeConnector *drm_conn = drmModeGetConnectorCurrent(device->fd, id);
 	if (drm_conn == NULL) {
 		free(conn);
@@ -261,6 +489,7 @@ struct glider_drm_connector *create_drm_connector(
 	}
 
 	conn->possible_crtcs = get_possible_crtcs(device->fd, drm_conn);
+	device->stats.init_ioctls += drm_conn->count_encoders;
 
 	drmModeFreeConnector(drm_conn);
 	wl_list_insert(&device->connectors, &conn->link);
@@ -303,12 +532,11 @@ static bool update_modes(struct glider_drm_connector *conn,
 	}
 
 	for (size_t i = 0; i < modes_len; i++) {
-		struct glider_drm_mode *mode = &conn->modes[i];
-
 		if (drm_modes[i].flags & DRM_MODE_FLAG_INTERLACE) {
 			continue;
 		}
 
+		struct glider_drm_mode *mode = &conn->modes[conn->modes_len];
 		mode->drm_mode = drm_modes[i];
 		mode->wlr_mode.width = mode->drm_mode.hdisplay;
 		mode->wlr_mode.height = mode->drm_mode.vdisplay;
@@ -316,31 +544,36 @@ static bool update_modes(struct glider_drm_connector *conn,
 		if (mode->drm_mode.type & DRM_MODE_TYPE_PREFERRED) {
 			mode->wlr_mode.preferred = true;
 		}
-
-		wl_list_insert(&conn->output.modes, &mode->wlr_mode.link);
 		conn->modes_len++;
 	}
 
+	for (size_t i = 0; i < conn->modes_len; i++) {
+		wl_list_insert(&conn->output.modes, &conn->modes[i].wlr_mode.link);
+	}
+
 	return true;
 }
 
-bool refresh_drm_connector(struct glider_drm_connector *conn) {
-	drmModeConnector *drm_conn =
-		drmModeGetConnector(conn->device->fd, conn->id);
-	if (drm_conn == NULL) {
-		wlr_log_errno(WLR_ERROR, "drmModeGetConnector failed");
-		return false;
-	}
-
+static bool update_drm_connector(struct glider_drm_connector *conn,
+		drmModeConnector *drm_conn) {
 	if (conn->connection == DRM_MODE_CONNECTED &&
 			drm_conn->connection != DRM_MODE_CONNECTED) {
 		wlr_log(WLR_DEBUG, "Connector %"PRIu32" disconnected", conn->id);
 		wlr_output_destroy(&conn->output);
+		conn->new_output_pending = false;
 	}
 
+	// Depends on the monitor, read it before the output is advertised
+	struct glider_drm_prop *vrr_capable =
+		&conn->props[GLIDER_DRM_CONNECTOR_VRR_CAPABLE];
+	vrr_capable->current = vrr_capable->pending =
+		get_drm_connector_prop_value(drm_conn, vrr_capable->id, 0);
+
 	if (conn->connection != DRM_MODE_CONNECTED &&
 			drm_conn->connection == DRM_MODE_CONNECTED) {
-		wlr_log(WLR_DEBUG, "Connector %"PRIu32" connected", conn->id);
+		wlr_log(WLR_DEBUG, "Connector %"PRIu32" connected%s", conn->id,
+			vrr_capable->current ? " (VRR capable)" : "");
+		memset(&conn->flip_intervals, 0, sizeof(conn->flip_intervals));
 
 		struct glider_drm_backend *backend = conn->device->backend;
 		wlr_output_init(&conn->output, &backend->base, &output_impl,
@@ -351,16 +584,148 @@ bool refresh_drm_connector(struct glider_drm_connector *conn) {
 			return false;
 		}
 
-		wl_signal_emit(&backend->base.events.new_output,
-			&conn->output);
+		// Emitted by announce_drm_connectors
+		conn->new_output_pending = true;
 	}
 
 	conn->connection = drm_conn->connection;
 
+	struct glider_drm_prop *edid = &conn->props[GLIDER_DRM_CONNECTOR_EDID];
+	edid->current = edid->pending = get_drm_connector_prop_value(drm_conn,
+		edid->id, edid->current);
+
+	return true;
+}
+
+/* Fully probe the connector, this can take a while (e.g. EDID read). */
+bool refresh_drm_connector(struct glider_drm_connector *conn) {
+	drmModeConnector *drm_conn =
+		drmModeGetConnector(conn->device->fd, conn->id);
+	if (drm_conn == NULL) {
+		wlr_log_errno(WLR_ERROR, "drmModeGetConnector failed");
+		return false;
+	}
+
+	bool ok = update_drm_connector(conn, drm_conn);
 	drmModeFreeConnector(drm_conn);
+	return ok;
+}
+
+/* Emit new_output for the connectors which got connected. This is done once
+ * all connectors have been refreshed, so that the CRTC assignment accounts
+ * for every connected connector when the compositor enables the first
+ * output. */
+void announce_drm_connectors(struct glider_drm_device *device) {
+	// Rebalance the CRTCs reserved for connectors which aren't enabled yet
+	assign_drm_crtcs(device, NULL);
+
+	struct glider_drm_connector *conn;
+	wl_list_for_each(conn, &device->connectors, link) {
+		if (!conn->new_output_pending) {
+			continue;
+		}
+		conn->new_output_pending = false;
+		wl_signal_emit(&device->backend->base.events.new_output,
+			&conn->output);
+	}
+}
+
+/* Re-train the link with a modeset, as requested by the kernel when the
+ * link-status property is set to BAD. */
+static bool retrain_drm_connector(struct glider_drm_connector *conn) {
+	struct glider_drm_prop *link_status =
+		&conn->props[GLIDER_DRM_CONNECTOR_LINK_STATUS];
+	link_status->current = link_status->pending = DRM_MODE_LINK_STATUS_GOOD;
+
+	if (conn->crtc == NULL) {
+		// The next modeset will reset the link status
+		return true;
+	}
+
+	wlr_log(WLR_INFO, "Link status of connector %"PRIu32" is bad, "
+		"retraining", conn->id);
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (req == NULL) {
+		wlr_log_errno(WLR_ERROR, "drmModeAtomicAlloc failed");
+		return false;
+	}
+
+	if (!restore_drm_props(conn->props, GLIDER_DRM_CONNECTOR_PROP_COUNT,
+			conn->id, req) ||
+			!restore_drm_props(conn->crtc->props,
+				GLIDER_DRM_CRTC_PROP_COUNT, conn->crtc->id, req) ||
+			!liftoff_output_apply(conn->crtc->liftoff_output, req)) {
+		drmModeAtomicFree(req);
+		return false;
+	}
+
+	int ret = drmModeAtomicCommit(conn->device->fd, req,
+		DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	drmModeAtomicFree(req);
+	if (ret != 0) {
+		wlr_log(WLR_ERROR, "Failed to retrain connector %"PRIu32": %s",
+			conn->id, strerror(-ret));
+		return false;
+	}
 	return true;
 }
 
+/* Refresh the connector from the state the kernel already knows about,
+ * without probing it. Only probe if the connector got connected or its EDID
+ * changed. */
+bool refresh_drm_connector_current(struct glider_drm_connector *conn,
+		uint32_t prop_id) {
+	struct glider_drm_prop *edid = &conn->props[GLIDER_DRM_CONNECTOR_EDID];
+	struct glider_drm_prop *link_status =
+		&conn->props[GLIDER_DRM_CONNECTOR_LINK_STATUS];
+
+	if (prop_id != 0 && prop_id != link_status->id) {
+		wlr_log(WLR_DEBUG, "Ignoring change of property %"PRIu32" "
+			"on connector %"PRIu32, prop_id, conn->id);
+		return true;
+	}
+
+	drmModeConnector *drm_conn =
+		drmModeGetConnectorCurrent(conn->device->fd, conn->id);
+	if (drm_conn == NULL) {
+		wlr_log_errno(WLR_ERROR, "drmModeGetConnectorCurrent failed");
+		return false;
+	}
+
+	bool connected = conn->connection != DRM_MODE_CONNECTED &&
+		drm_conn->connection == DRM_MODE_CONNECTED;
+	bool edid_changed = conn->connection == DRM_MODE_CONNECTED &&
+		drm_conn->connection == DRM_MODE_CONNECTED && edid->id != 0 &&
+		get_drm_connector_prop_value(drm_conn, edid->id, edid->current) !=
+			edid->current;
+	uint64_t link_status_value = get_drm_connector_prop_value(drm_conn,
+		link_status->id, DRM_MODE_LINK_STATUS_GOOD);
+
+	bool ok = true;
+	if (connected) {
+		// The kernel doesn't fill the modes without a probe
+		ok = refresh_drm_connector(conn);
+	} else if (edid_changed) {
+		// Another monitor has been plugged in, re-create the output
+		wlr_log(WLR_DEBUG, "EDID changed on connector %"PRIu32, conn->id);
+		wlr_output_destroy(&conn->output);
+		conn->connection = DRM_MODE_DISCONNECTED;
+		ok = refresh_drm_connector(conn);
+	} else {
+		ok = update_drm_connector(conn, drm_conn);
+	}
+
+	if (ok && link_status->id != 0 &&
+			link_status_value == DRM_MODE_LINK_STATUS_BAD &&
+			conn->connection == DRM_MODE_CONNECTED) {
+		ok = retrain_drm_connector(conn);
+	}
+
+	drmModeFreeConnector(drm_conn);
+	return ok;
+}
+
 const struct wlr_drm_format_set *glider_drm_connector_get_primary_formats(
 		struct wlr_output *output) {
 	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
@@ -379,51 +744,9 @@ struct liftoff_output *glider_drm_connector_get_liftoff_output(
 	return conn->crtc->liftoff_output;
 }
 
-static bool attach_drm_buffer(struct glider_drm_buffer *buf,
-		struct glider_drm_crtc *crtc, struct liftoff_layer *layer) {
-	struct glider_drm_attachment *free_att = NULL;
-	for (size_t i = 0; i < crtc->attachments_cap; i++) {
-		struct glider_drm_attachment *att = &crtc->attachments[i];
-		if (att->state == GLIDER_DRM_BUFFER_PENDING && att->buffer == buf &&
-				att->layer == layer) {
-			return true; // already locked
-		}
-		if (free_att == NULL && att->state == GLIDER_DRM_BUFFER_UNLOCKED) {
-			free_att = att;
-		}
-	}
-
-	if (free_att == NULL) {
-		size_t new_cap = crtc->attachments_cap * 2;
-		if (new_cap == 0) {
-			new_cap = 8;
-		}
-		struct glider_drm_attachment *atts = realloc(crtc->attachments,
-			new_cap * sizeof(struct glider_drm_attachment));
-		if (atts == NULL) {
-			wlr_log_errno(WLR_ERROR, "realloc failed");
-			return false;
-		}
-		free_att = &atts[crtc->attachments_cap];
-		crtc->attachments_cap = new_cap;
-		crtc->attachments = atts;
-	}
-
-	free_att->state = GLIDER_DRM_BUFFER_PENDING;
-	free_att->buffer = buf;
-	free_att->layer = layer;
-	wlr_buffer_lock(buf->buffer);
-	return true;
-}
-
-void unlock_drm_attachment(struct glider_drm_attachment *att) {
-	assert(att->state != GLIDER_DRM_BUFFER_UNLOCKED);
-
-	struct wlr_buffer *buf = att->buffer->buffer;
-	att->state = GLIDER_DRM_BUFFER_UNLOCKED;
-	att->buffer = NULL;
-	att->layer = NULL;
-	wlr_buffer_unlock(buf);
+size_t glider_drm_connector_get_device_index(struct wlr_output *output) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	return conn->device - conn->device->backend->devices;
 }
 
 bool glider_drm_connector_attach(struct wlr_output *output,
@@ -441,21 +764,30 @@ bool glider_drm_connector_attach(struct wlr_output *output,
 	if (drm_buffer == NULL) {
 		return false;
 	}
-
-	// Unlock any pending buffer we're going to replace
-	for (size_t i = 0; i < conn->crtc->attachments_cap; i++) {
-		struct glider_drm_attachment *att = &conn->crtc->attachments[i];
-		if (att->state == GLIDER_DRM_BUFFER_PENDING &&
-				att->layer == layer) {
-			unlock_drm_attachment(att);
-		}
+	const struct glider_drm_fb_key *key = &drm_buffer->fb->key;
+	if ((drm_buffer->planes & conn->crtc->planes) == 0 &&
+			!has_drm_format_untracked_plane(conn->device, conn->crtc,
+				key->format, key->modifier)) {
+		// Only planes of other CRTCs support the format/modifier
+		conn->device->stats.fb_rejects++;
+		return false;
 	}
 
-	if (!attach_drm_buffer(drm_buffer, conn->crtc, layer)) {
+	struct glider_drm_layer *drm_layer = get_drm_layer(conn->crtc, layer, true);
+	if (drm_layer == NULL) {
 		return false;
 	}
 
-	liftoff_layer_set_property(layer, "FB_ID", drm_buffer->id);
+	// Unlock any pending buffer we're going to replace
+	if (drm_layer->pending.buffer != drm_buffer) {
+		if (drm_layer->pending.buffer != NULL) {
+			unlock_drm_attachment(&drm_layer->pending);
+		}
+		lock_drm_attachment(&drm_layer->pending, drm_buffer);
+		reset_drm_layer_damage(drm_layer);
+	}
+
+	liftoff_layer_set_property(layer, "FB_ID", drm_buffer->fb->id);
 	return true;
 }
 
@@ -463,10 +795,33 @@ static int mhz_to_nsec(int mhz) {
 	return 1000000000000LL / mhz;
 }
 
+static void update_flip_intervals(struct glider_drm_flip_intervals *intervals,
+		const struct timespec *t) {
+	int64_t nsec = (int64_t)t->tv_sec * 1000000000 + t->tv_nsec;
+	if (intervals->last_nsec != 0 && nsec > intervals->last_nsec) {
+		int64_t interval = nsec - intervals->last_nsec;
+		if (intervals->count == 0 || interval < intervals->min_nsec) {
+			intervals->min_nsec = interval;
+		}
+		if (intervals->count == 0 || interval > intervals->max_nsec) {
+			intervals->max_nsec = interval;
+		}
+		intervals->sum_nsec += interval;
+		intervals->count++;
+	}
+	intervals->last_nsec = nsec;
+}
+
 void handle_drm_connector_page_flip(struct glider_drm_connector *conn,
 		unsigned seq, struct timespec *t) {
-	uint32_t present_flags = WLR_OUTPUT_PRESENT_VSYNC |
+	update_flip_intervals(&conn->flip_intervals, t);
+
+	uint32_t present_flags =
 		WLR_OUTPUT_PRESENT_HW_CLOCK | WLR_OUTPUT_PRESENT_HW_COMPLETION;
+	if (!conn->async_flip_pending) {
+		present_flags |= WLR_OUTPUT_PRESENT_VSYNC;
+	}
+	conn->async_flip_pending = false;
 	// TODO: WLR_OUTPUT_PRESENT_ZERO_COPY
 	struct wlr_output_event_present present_event = {
 		/* The DRM backend guarantees that the presentation event will be for
@@ -478,6 +833,255 @@ void handle_drm_connector_page_flip(struct glider_drm_connector *conn,
 		.flags = present_flags,
 	};
 	wlr_output_send_present(&conn->output, &present_event);
+	glider_trace_first_frame();
+
+	// Stop the frame loop while the session is inactive, it'll be resumed
+	// when the device state is restored
+	if (conn->device->backend->session->active) {
+		wlr_output_send_frame(&conn->output);
+	}
+}
+
+bool glider_drm_connector_set_in_fence(struct wlr_output *output,
+		struct liftoff_layer *layer, int fence_fd) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	if (conn->crtc == NULL) {
+		close(fence_fd);
+		return false;
+	}
+
+	struct glider_drm_layer *drm_layer =
+		get_drm_layer(conn->crtc, layer, false);
+	if (drm_layer == NULL || drm_layer->pending.buffer == NULL) {
+		close(fence_fd);
+		return false;
+	}
+
+	reset_drm_attachment_in_fence(&drm_layer->pending);
+	drm_layer->pending.in_fence_fd = fence_fd;
+	liftoff_layer_set_property(layer, "IN_FENCE_FD", fence_fd);
+	return true;
+}
+
+bool glider_drm_connector_is_active(struct wlr_output *output) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	return conn->device->backend->session->active;
+}
+
+void glider_drm_connector_set_tearing(struct wlr_output *output,
+		bool tearing) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	conn->tearing = tearing;
+}
+
+bool glider_drm_connector_get_vrr_capable(struct wlr_output *output) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	return conn->props[GLIDER_DRM_CONNECTOR_VRR_CAPABLE].current != 0;
+}
+
+bool glider_drm_connector_get_vrr(struct wlr_output *output) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	if (conn->crtc == NULL) {
+		return false;
+	}
+	return conn->crtc->props[GLIDER_DRM_CRTC_VRR_ENABLED].pending != 0;
+}
+
+bool glider_drm_connector_set_vrr(struct wlr_output *output, bool enabled) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	if (conn->crtc == NULL) {
+		return !enabled;
+	}
+
+	struct glider_drm_prop *vrr_enabled =
+		&conn->crtc->props[GLIDER_DRM_CRTC_VRR_ENABLED];
+	if (enabled && (vrr_enabled->id == 0 ||
+			!glider_drm_connector_get_vrr_capable(output))) {
+		return false;
+	}
+	if (vrr_enabled->id != 0) {
+		vrr_enabled->pending = enabled;
+	}
+	return true;
+}
+
+void glider_drm_connector_get_cursor_size(struct wlr_output *output,
+		int *width, int *height) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	*width = conn->device->cursor_width;
+	*height = conn->device->cursor_height;
+}
+
+/* Cursor motion doesn't change the plane allocation, so there is no need to
+ * test the commit nor to let libliftoff re-allocate planes. */
+bool glider_drm_connector_move_layer(struct wlr_output *output,
+		struct liftoff_layer *layer, int32_t x, int32_t y) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	struct glider_drm_device *device = conn->device;
+	if (conn->crtc == NULL || conn->commit_queued ||
+			!device->backend->session->active) {
+		return false;
+	}
+
+	uint32_t plane_id = liftoff_layer_get_plane_id(layer);
+	struct glider_drm_plane *plane = NULL;
+	for (size_t i = 0; i < device->planes_len; i++) {
+		if (plane_id != 0 && device->planes[i].id == plane_id) {
+			plane = &device->planes[i];
+			break;
+		}
+	}
+	if (plane == NULL) {
+		return false;
+	}
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (req == NULL) {
+		wlr_log_errno(WLR_ERROR, "drmModeAtomicAlloc failed");
+		return false;
+	}
+	bool ok = drmModeAtomicAddProperty(req, plane->id,
+			plane->props[GLIDER_DRM_PLANE_CRTC_X].id, (uint64_t)x) >= 0 &&
+		drmModeAtomicAddProperty(req, plane->id,
+			plane->props[GLIDER_DRM_PLANE_CRTC_Y].id, (uint64_t)y) >= 0;
+	if (ok) {
+		int ret = drmModeAtomicCommit(device->fd, req,
+			DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, device);
+		if (ret != 0) {
+			wlr_log(WLR_DEBUG, "Plane move failed: %s", strerror(-ret));
+			ok = false;
+		}
+	}
+	drmModeAtomicFree(req);
+	if (!ok) {
+		return false;
+	}
+	conn->crtc->move_flip_pending = true;
+
+	// The plane is still owned by libliftoff. Its next apply sets all the
+	// layer properties again instead of diffing against the hardware state,
+	// so with the layer updated it re-submits the same position: the move is
+	// neither undone nor applied twice.
+	liftoff_layer_set_property(layer, "CRTC_X", (uint64_t)x);
+	liftoff_layer_set_property(layer, "CRTC_Y", (uint64_t)y);
+	return true;
+}
+
+static uint32_t get_drm_rotation(enum wl_output_transform transform) {
+	// Both rotate counter-clockwise
+	uint32_t rotation = 0;
+	switch (transform & ~WL_OUTPUT_TRANSFORM_FLIPPED) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+		rotation = DRM_MODE_ROTATE_0;
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+		rotation = DRM_MODE_ROTATE_90;
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		rotation = DRM_MODE_ROTATE_180;
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		rotation = DRM_MODE_ROTATE_270;
+		break;
+	}
+	if (transform & WL_OUTPUT_TRANSFORM_FLIPPED) {
+		rotation |= DRM_MODE_REFLECT_X;
+	}
+	return rotation;
+}
+
+bool glider_drm_connector_set_layer_transform(struct wlr_output *output,
+		struct liftoff_layer *layer, enum wl_output_transform transform) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	if (conn->crtc == NULL) {
+		return false;
+	}
+
+	struct glider_drm_layer *drm_layer = get_drm_layer(conn->crtc, layer, true);
+	if (drm_layer == NULL) {
+		return false;
+	}
+
+	uint32_t rotation = get_drm_rotation(transform);
+	if (rotation == DRM_MODE_ROTATE_0 && drm_layer->rotation == 0) {
+		// Leave the property unset, so that planes without it stay usable
+		return true;
+	}
 
-	wlr_output_send_frame(&conn->output);
+	bool supported = false;
+	struct glider_drm_device *device = conn->device;
+	for (size_t i = 0; i < device->planes_len && i < 64; i++) {
+		if ((conn->crtc->planes & ((uint64_t)1 << i)) &&
+				(device->planes[i].rotations & rotation) == rotation) {
+			supported = true;
+			break;
+		}
+	}
+
+	drm_layer->rotation = rotation;
+	if (!supported) {
+		return false;
+	}
+	liftoff_layer_set_property(layer, "rotation", rotation);
+	return true;
+}
+
+void glider_drm_connector_set_layer_damage(struct wlr_output *output,
+		struct liftoff_layer *layer, const pixman_region32_t *damage) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	if (conn->crtc == NULL) {
+		return;
+	}
+
+	struct glider_drm_layer *drm_layer =
+		get_drm_layer(conn->crtc, layer, false);
+	if (drm_layer != NULL && drm_layer->pending.buffer != NULL) {
+		set_drm_layer_damage(drm_layer, damage);
+	}
+}
+
+uint64_t glider_drm_connector_get_layers_signature(struct wlr_output *output) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	if (conn->crtc == NULL) {
+		return 0;
+	}
+
+	uint64_t hash = 0;
+	struct glider_drm_layer *layer;
+	wl_list_for_each(layer, &conn->crtc->layers_list, link) {
+		struct glider_drm_buffer *buffer = layer->pending.buffer;
+		if (buffer == NULL) {
+			buffer = layer->queued.buffer;
+		}
+		if (buffer == NULL) {
+			buffer = layer->current.buffer;
+		}
+
+		hash = glider_hash_bytes(hash, &layer->layer, sizeof(layer->layer));
+		hash = glider_hash_bytes(hash, &layer->rotation,
+			sizeof(layer->rotation));
+		if (buffer == NULL || buffer->fb == NULL) {
+			continue;
+		}
+		const struct glider_drm_fb_key *key = &buffer->fb->key;
+		hash = glider_hash_bytes(hash, &key->width, sizeof(key->width));
+		hash = glider_hash_bytes(hash, &key->height, sizeof(key->height));
+		hash = glider_hash_bytes(hash, &key->format, sizeof(key->format));
+		hash = glider_hash_bytes(hash, &key->modifier, sizeof(key->modifier));
+	}
+	return hash;
+}
+
+void glider_drm_connector_destroy_layer(struct wlr_output *output,
+		struct liftoff_layer *layer) {
+	struct glider_drm_connector *conn = get_drm_connector_from_output(output);
+	if (conn->crtc == NULL) {
+		return;
+	}
+
+	struct glider_drm_layer *drm_layer =
+		get_drm_layer(conn->crtc, layer, false);
+	if (drm_layer != NULL) {
+		release_drm_layer(drm_layer);
+	}
 }
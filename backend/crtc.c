@@ -1,4 +1,8 @@
+#include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <wlr/util/log.h>
 #include "backend/backend.h"
 
@@ -6,64 +10,496 @@ bool init_drm_crtc(struct glider_drm_crtc *crtc,
 		struct glider_drm_device *device, uint32_t id) {
 	crtc->device = device;
 	crtc->id = id;
+	crtc->out_fence_fd = -1;
+	wl_list_init(&crtc->layers_list);
+	wl_list_init(&crtc->pending_layers);
+	wl_list_init(&crtc->queued_layers);
+	wl_list_init(&crtc->released_layers);
 
 	if (!init_drm_props(crtc->props, glider_drm_crtc_props,
 			GLIDER_DRM_CRTC_PROP_COUNT, device, id, DRM_MODE_OBJECT_CRTC)) {
 		return false;
 	}
 
+	if (!glider_hash_table_init(&crtc->layers)) {
+		return false;
+	}
+
+	device->stats.init_ioctls++;
 	crtc->crtc = drmModeGetCrtc(device->fd, id);
 	if (crtc->crtc == NULL) {
-		return false;
+		goto error_layers;
 	}
 
 	crtc->liftoff_output = liftoff_output_create(device->liftoff_device, id);
 	if (crtc->liftoff_output == NULL) {
-		drmModeFreeCrtc(crtc->crtc);
-		return false;
+		goto error_crtc;
 	}
 
+	glider_hash_table_insert(&device->crtc_ids, &crtc->id_entry,
+		glider_hash_u64(id));
 	return true;
+
+error_crtc:
+	drmModeFreeCrtc(crtc->crtc);
+error_layers:
+	glider_hash_table_finish(&crtc->layers);
+	return false;
+}
+
+static void finish_drm_crtc_out_fence(struct glider_drm_crtc *crtc) {
+	if (crtc->out_fence_source != NULL) {
+		wl_event_source_remove(crtc->out_fence_source);
+		crtc->out_fence_source = NULL;
+	}
+	if (crtc->out_fence_fd >= 0) {
+		close(crtc->out_fence_fd);
+		crtc->out_fence_fd = -1;
+	}
+}
+
+static void destroy_damage_blob(struct glider_drm_device *device,
+		uint32_t blob_id) {
+	if (blob_id != 0 && drmModeDestroyPropertyBlob(device->fd, blob_id) != 0) {
+		wlr_log_errno(WLR_ERROR, "drmModeDestroyPropertyBlob failed");
+	}
 }
 
 void finish_drm_crtc(struct glider_drm_crtc *crtc) {
+	finish_drm_crtc_out_fence(crtc);
+	struct glider_drm_layer *layer, *layer_tmp;
+	wl_list_for_each_safe(layer, layer_tmp, &crtc->layers_list, link) {
+		destroy_drm_layer(layer);
+	}
+	wl_list_for_each_safe(layer, layer_tmp, &crtc->released_layers, link) {
+		destroy_drm_layer(layer);
+	}
+	glider_hash_table_finish(&crtc->layers);
+	destroy_damage_blob(crtc->device, crtc->empty_damage_blob);
+	glider_hash_table_remove(&crtc->device->crtc_ids, &crtc->id_entry);
 	liftoff_output_destroy(crtc->liftoff_output);
-	free(crtc->attachments);
 	drmModeFreeCrtc(crtc->crtc);
 }
 
-static bool has_queued_buffer(struct glider_drm_crtc *crtc,
-		struct liftoff_layer *layer) {
-	for (size_t i = 0; i < crtc->attachments_cap; i++) {
-		struct glider_drm_attachment *att = &crtc->attachments[i];
-		if (att->state == GLIDER_DRM_BUFFER_QUEUED && att->layer == layer) {
+struct glider_drm_crtc *get_drm_crtc_from_id(struct glider_drm_device *device,
+		uint32_t id) {
+	uint64_t hash = glider_hash_u64(id);
+	struct wl_list *bucket = glider_hash_table_bucket(&device->crtc_ids, hash);
+	struct glider_drm_crtc *crtc;
+	wl_list_for_each(crtc, bucket, id_entry.link) {
+		if (crtc->id_entry.hash == hash && crtc->id == id) {
+			return crtc;
+		}
+	}
+	return NULL;
+}
+
+static void init_drm_attachment(struct glider_drm_attachment *att,
+		struct glider_drm_layer *layer) {
+	att->layer = layer;
+	att->in_fence_fd = -1;
+	wl_list_init(&att->buffer_link);
+}
+
+struct glider_drm_layer *get_drm_layer(struct glider_drm_crtc *crtc,
+		struct liftoff_layer *liftoff_layer, bool create) {
+	uint64_t hash = glider_hash_ptr(liftoff_layer);
+	struct wl_list *bucket = glider_hash_table_bucket(&crtc->layers, hash);
+	struct glider_drm_layer *layer;
+	wl_list_for_each(layer, bucket, entry.link) {
+		if (layer->entry.hash == hash && layer->layer == liftoff_layer) {
+			return layer;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	layer = calloc(1, sizeof(*layer));
+	if (layer == NULL) {
+		wlr_log_errno(WLR_ERROR, "calloc failed");
+		return NULL;
+	}
+	layer->crtc = crtc;
+	layer->layer = liftoff_layer;
+	wl_list_init(&layer->pending_link);
+	wl_list_init(&layer->queued_link);
+	init_drm_attachment(&layer->pending, layer);
+	init_drm_attachment(&layer->queued, layer);
+	init_drm_attachment(&layer->current, layer);
+	pixman_region32_init(&layer->damage);
+	pixman_region32_init(&layer->pending_damage);
+	// The first buffer is damaged whole
+	layer->damage_full = true;
+	glider_hash_table_insert(&crtc->layers, &layer->entry, hash);
+	wl_list_insert(&crtc->layers_list, &layer->link);
+	return layer;
+}
+
+void destroy_drm_layer(struct glider_drm_layer *layer) {
+	if (layer->pending.buffer != NULL) {
+		unlock_drm_attachment(&layer->pending);
+	}
+	if (layer->queued.buffer != NULL) {
+		unlock_drm_attachment(&layer->queued);
+	}
+	if (layer->current.buffer != NULL) {
+		unlock_drm_attachment(&layer->current);
+	}
+	destroy_damage_blob(layer->crtc->device, layer->damage_blob);
+	pixman_region32_fini(&layer->damage);
+	pixman_region32_fini(&layer->pending_damage);
+	if (layer->layer != NULL) {
+		glider_hash_table_remove(&layer->crtc->layers, &layer->entry);
+	}
+	wl_list_remove(&layer->link);
+	free(layer);
+}
+
+void release_drm_layer(struct glider_drm_layer *layer) {
+	// Never submitted to KMS
+	if (layer->pending.buffer != NULL) {
+		unlock_drm_attachment(&layer->pending);
+	}
+	if (layer->queued.buffer == NULL && layer->current.buffer == NULL) {
+		destroy_drm_layer(layer);
+		return;
+	}
+
+	// The next commit disables the plane, keep the buffers until then
+	struct glider_drm_crtc *crtc = layer->crtc;
+	glider_hash_table_remove(&crtc->layers, &layer->entry);
+	layer->layer = NULL;
+	layer->release_flip_seq = crtc->flip_seq;
+	wl_list_remove(&layer->link);
+	wl_list_insert(&crtc->released_layers, &layer->link);
+}
+
+/* FB_DAMAGE_CLIPS tells drivers which parts of a plane changed since the last
+ * page-flip, so that those which copy the buffers (virtual and USB displays)
+ * only transfer the damaged areas. Without it, the whole plane is damaged. */
+
+static bool crtc_has_damage_clips(struct glider_drm_crtc *crtc) {
+	struct glider_drm_device *device = crtc->device;
+	for (size_t i = 0; i < device->planes_len && i < 64; i++) {
+		if ((crtc->planes & ((uint64_t)1 << i)) && device->planes[i].props[
+				GLIDER_DRM_PLANE_FB_DAMAGE_CLIPS].id != 0) {
 			return true;
 		}
 	}
 	return false;
 }
 
-void handle_drm_crtc_page_flip(struct glider_drm_crtc *crtc,
-		unsigned seq, struct timespec *t) {
-	// Release buffers that the new front buffers replaced
-	// TODO: doesn't handle liftoff_layer destroy
-	for (size_t i = 0; i < crtc->attachments_cap; i++) {
-		struct glider_drm_attachment *att = &crtc->attachments[i];
-		if (att->state == GLIDER_DRM_BUFFER_CURRENT &&
-				has_queued_buffer(crtc, att->layer)) {
-			unlock_drm_attachment(att);
+static uint32_t create_damage_blob(struct glider_drm_device *device,
+		const pixman_box32_t *rects, size_t rects_len) {
+	struct drm_mode_rect clips[rects_len];
+	for (size_t i = 0; i < rects_len; i++) {
+		clips[i] = (struct drm_mode_rect){
+			.x1 = rects[i].x1,
+			.y1 = rects[i].y1,
+			.x2 = rects[i].x2,
+			.y2 = rects[i].y2,
+		};
+	}
+
+	uint32_t blob_id;
+	if (drmModeCreatePropertyBlob(device->fd, clips, sizeof(clips),
+			&blob_id) != 0) {
+		wlr_log_errno(WLR_ERROR, "drmModeCreatePropertyBlob failed");
+		return 0;
+	}
+	device->stats.damage_blobs++;
+	return blob_id;
+}
+
+static void set_drm_layer_damage_clips(struct glider_drm_layer *layer,
+		uint32_t blob_id) {
+	layer->damage_clips = blob_id;
+	liftoff_layer_set_property(layer->layer, "FB_DAMAGE_CLIPS", blob_id);
+}
+
+/* Set the FB_DAMAGE_CLIPS of the layer from its pending damage. */
+static void update_drm_layer_damage_clips(struct glider_drm_layer *layer) {
+	if (layer->damage_full || !crtc_has_damage_clips(layer->crtc)) {
+		return;
+	}
+
+	struct glider_drm_device *device = layer->crtc->device;
+	int rects_len;
+	const pixman_box32_t *rects =
+		pixman_region32_rectangles(&layer->pending_damage, &rects_len);
+	if (rects_len == 0) {
+		// An empty blob is rejected, use a single empty rectangle instead
+		if (layer->crtc->empty_damage_blob == 0) {
+			layer->crtc->empty_damage_blob = create_damage_blob(device,
+				&(pixman_box32_t){ 0 }, 1);
 		}
+		if (layer->crtc->empty_damage_blob != 0) {
+			set_drm_layer_damage_clips(layer, layer->crtc->empty_damage_blob);
+			layer->damage_pixels = 0;
+		}
+		return;
+	}
+
+	if (layer->damage_blob != 0 &&
+			pixman_region32_equal(&layer->damage, &layer->pending_damage)) {
+		device->stats.damage_blob_reuses++;
+	} else {
+		uint32_t blob_id = create_damage_blob(device, rects, rects_len);
+		if (blob_id == 0) {
+			return;
+		}
+		// Commits which already used the old blob hold their own reference
+		// to it
+		destroy_damage_blob(device, layer->damage_blob);
+		layer->damage_blob = blob_id;
+		pixman_region32_copy(&layer->damage, &layer->pending_damage);
+	}
+	set_drm_layer_damage_clips(layer, layer->damage_blob);
+
+	layer->damage_pixels = 0;
+	for (int i = 0; i < rects_len; i++) {
+		layer->damage_pixels += (uint64_t)(rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
 	}
+}
+
+void set_drm_layer_damage(struct glider_drm_layer *layer,
+		const pixman_region32_t *damage) {
+	// Buffers attached since the last page-flip accumulate their damage
+	layer->damage_unset = false;
+	pixman_region32_union(&layer->pending_damage, &layer->pending_damage,
+		damage);
+	update_drm_layer_damage_clips(layer);
+}
+
+void reset_drm_layer_damage(struct glider_drm_layer *layer) {
+	if (layer->damage_unset) {
+		// The damage of the previous buffer was never set
+		layer->damage_full = true;
+	}
+	layer->damage_unset = true;
+	layer->damage_pixels = UINT64_MAX;
+	if (layer->damage_clips != 0) {
+		set_drm_layer_damage_clips(layer, 0);
+	}
+}
 
-	// Mark queued buffers as current
-	for (size_t i = 0; i < crtc->attachments_cap; i++) {
-		struct glider_drm_attachment *att = &crtc->attachments[i];
-		if (att->state == GLIDER_DRM_BUFFER_QUEUED) {
-			att->state = GLIDER_DRM_BUFFER_CURRENT;
+static struct glider_drm_plane *get_drm_plane_from_id(
+		struct glider_drm_device *device, uint32_t id) {
+	for (size_t i = 0; i < device->planes_len; i++) {
+		if (device->planes[i].id == id) {
+			return &device->planes[i];
 		}
 	}
+	return NULL;
+}
+
+bool apply_drm_layers_damage(struct glider_drm_crtc *crtc,
+		drmModeAtomicReq *req) {
+	struct glider_drm_layer *layer;
+	wl_list_for_each(layer, &crtc->layers_list, link) {
+		uint32_t plane_id = liftoff_layer_get_plane_id(layer->layer);
+		if (layer->damage_clips == 0 || plane_id == 0 ||
+				plane_id == layer->plane_id) {
+			continue;
+		}
+		// The damage is relative to the previous buffer of the layer, not to
+		// the one on the new plane. libdrm keeps the last value set for a
+		// property.
+		struct glider_drm_plane *plane =
+			get_drm_plane_from_id(crtc->device, plane_id);
+		uint32_t prop_id = plane != NULL ?
+			plane->props[GLIDER_DRM_PLANE_FB_DAMAGE_CLIPS].id : 0;
+		if (prop_id != 0 &&
+				drmModeAtomicAddProperty(req, plane_id, prop_id, 0) < 0) {
+			wlr_log(WLR_ERROR, "drmModeAtomicAddProperty failed");
+			return false;
+		}
+	}
+	return true;
+}
+
+void finish_drm_layers_damage(struct glider_drm_crtc *crtc, bool flipped) {
+	struct glider_drm_device *device = crtc->device;
+	struct glider_drm_layer *layer;
+	if (!flipped) {
+		// The pending buffers will be submitted again along with the damage
+		// of the next frame
+		wl_list_for_each(layer, &crtc->pending_layers, pending_link) {
+			layer->damage_full = true;
+			reset_drm_layer_damage(layer);
+		}
+		return;
+	}
+
+	wl_list_for_each(layer, &crtc->pending_layers, pending_link) {
+		const struct glider_drm_fb *fb = layer->pending.buffer->fb;
+		if (liftoff_layer_get_plane_id(layer->layer) == 0 || fb == NULL) {
+			continue;
+		}
+		uint64_t pixels = (uint64_t)fb->key.width * fb->key.height;
+		device->stats.plane_pixels += pixels;
+		device->stats.damaged_pixels += layer->damage_pixels < pixels ?
+			layer->damage_pixels : pixels;
+	}
+
+	// Until a new buffer is attached, the layers don't change
+	wl_list_for_each(layer, &crtc->layers_list, link) {
+		layer->plane_id = liftoff_layer_get_plane_id(layer->layer);
+		layer->damage_full = false;
+		layer->damage_unset = false;
+		pixman_region32_clear(&layer->pending_damage);
+		update_drm_layer_damage_clips(layer);
+	}
+}
+
+static struct wl_list *get_drm_attachment_state_link(
+		struct glider_drm_attachment *att) {
+	if (att == &att->layer->pending) {
+		return &att->layer->pending_link;
+	} else if (att == &att->layer->queued) {
+		return &att->layer->queued_link;
+	}
+	return NULL;
+}
+
+void lock_drm_attachment(struct glider_drm_attachment *att,
+		struct glider_drm_buffer *buffer) {
+	assert(att->buffer == NULL);
+
+	struct glider_drm_crtc *crtc = att->layer->crtc;
+	att->buffer = buffer;
+	wl_list_insert(&buffer->attachments, &att->buffer_link);
+	if (att == &att->layer->pending) {
+		wl_list_insert(&crtc->pending_layers, &att->layer->pending_link);
+	} else if (att == &att->layer->queued) {
+		wl_list_insert(&crtc->queued_layers, &att->layer->queued_link);
+	}
+	wlr_buffer_lock(buffer->buffer);
+}
+
+void reset_drm_attachment_in_fence(struct glider_drm_attachment *att) {
+	if (att->in_fence_fd < 0) {
+		return;
+	}
+	close(att->in_fence_fd);
+	att->in_fence_fd = -1;
+	// The layer property would otherwise refer to a closed FD on the next
+	// commit
+	liftoff_layer_set_property(att->layer->layer, "IN_FENCE_FD",
+		(uint64_t)-1);
+}
 
+void unlock_drm_attachment(struct glider_drm_attachment *att) {
+	assert(att->buffer != NULL);
+
+	reset_drm_attachment_in_fence(att);
+
+	struct wlr_buffer *buf = att->buffer->buffer;
+	att->buffer = NULL;
+	wl_list_remove(&att->buffer_link);
+	wl_list_init(&att->buffer_link);
+	struct wl_list *state_link = get_drm_attachment_state_link(att);
+	if (state_link != NULL) {
+		wl_list_remove(state_link);
+		wl_list_init(state_link);
+	}
+	wlr_buffer_unlock(buf);
+}
+
+void move_drm_attachment(struct glider_drm_attachment *dst,
+		struct glider_drm_attachment *src) {
+	if (dst->buffer != NULL) {
+		unlock_drm_attachment(dst);
+	}
+	if (src->buffer == NULL) {
+		return;
+	}
+
+	// Transfer the lock from src to dst
+	struct glider_drm_buffer *buffer = src->buffer;
+	lock_drm_attachment(dst, buffer);
+	dst->in_fence_fd = src->in_fence_fd;
+	src->in_fence_fd = -1;
+	unlock_drm_attachment(src);
+}
+
+/* Release the buffers replaced by the last page-flip, and mark the buffers it
+ * submitted as current. KMS won't accept another page-flip until the last one
+ * has completed, so this is a no-op when called a second time for the same
+ * page-flip. */
+static size_t retire_drm_crtc_buffers(struct glider_drm_crtc *crtc) {
+	size_t released = 0;
+	struct glider_drm_layer *layer, *layer_tmp;
+	wl_list_for_each_safe(layer, layer_tmp, &crtc->queued_layers,
+			queued_link) {
+		if (layer->current.buffer != NULL) {
+			released++;
+		}
+		move_drm_attachment(&layer->current, &layer->queued);
+	}
+
+	// The page-flip which just completed is the last one submitted: if it
+	// came after a layer was released, its buffers are off-screen
+	wl_list_for_each_safe(layer, layer_tmp, &crtc->released_layers, link) {
+		if (layer->release_flip_seq == crtc->flip_seq) {
+			continue;
+		}
+		if (layer->current.buffer != NULL) {
+			released++;
+		}
+		destroy_drm_layer(layer);
+	}
+	return released;
+}
+
+static int handle_out_fence(int fd, uint32_t mask, void *data) {
+	struct glider_drm_crtc *crtc = data;
+	finish_drm_crtc_out_fence(crtc);
+	crtc->device->stats.out_fence_retires += retire_drm_crtc_buffers(crtc);
+	return 0;
+}
+
+void watch_drm_crtc_out_fence(struct glider_drm_crtc *crtc) {
+	if (crtc->out_fence_fd < 0) {
+		return;
+	}
+
+	struct wl_event_loop *event_loop =
+		wl_display_get_event_loop(crtc->device->backend->display);
+	crtc->out_fence_source = wl_event_loop_add_fd(event_loop,
+		crtc->out_fence_fd, WL_EVENT_READABLE, handle_out_fence, crtc);
+	if (crtc->out_fence_source == NULL) {
+		// Buffers will be released on page-flip instead
+		wlr_log(WLR_ERROR, "wl_event_loop_add_fd failed");
+		finish_drm_crtc_out_fence(crtc);
+	}
+}
+
+void handle_drm_crtc_page_flip(struct glider_drm_crtc *crtc,
+		unsigned seq, struct timespec *t) {
 	struct glider_drm_connector *conn;
+	if (crtc->move_flip_pending) {
+		// No buffer changed and no new frame was presented, only let the
+		// output render its next frame
+		crtc->move_flip_pending = false;
+		wl_list_for_each(conn, &crtc->device->connectors, link) {
+			if (conn->crtc == crtc && crtc->device->backend->session->active) {
+				wlr_output_send_frame(&conn->output);
+			}
+		}
+		return;
+	}
+
+	// The out-fence signals at the same time as the page-flip event is sent,
+	// so if we haven't dispatched it yet, do it now. If there is no out-fence,
+	// release buffers here.
+	finish_drm_crtc_out_fence(crtc);
+	retire_drm_crtc_buffers(crtc);
+
+	update_drm_flip_sync(crtc, t);
+
 	wl_list_for_each(conn, &crtc->device->connectors, link) {
 		if (conn->crtc == crtc) {
 			handle_drm_connector_page_flip(conn, seq, t);
@@ -71,28 +507,232 @@ void handle_drm_crtc_page_flip(struct glider_drm_crtc *crtc,
 	}
 }
 
+bool init_drm_mode_blob(struct glider_drm_device *device,
+		struct glider_drm_mode *mode) {
+	if (mode->blob_id != 0) {
+		return true;
+	}
+	if (drmModeCreatePropertyBlob(device->fd, &mode->drm_mode,
+			sizeof(drmModeModeInfo), &mode->blob_id) != 0) {
+		wlr_log_errno(WLR_ERROR, "drmModeCreatePropertyBlob failed");
+		mode->blob_id = 0;
+		return false;
+	}
+	return true;
+}
+
+void finish_drm_mode_blob(struct glider_drm_device *device,
+		struct glider_drm_mode *mode) {
+	if (mode->blob_id == 0) {
+		return;
+	}
+
+	// KMS keeps its own reference if the mode is in use, but forget about
+	// the blob ID so that we don't submit it again
+	for (size_t i = 0; i < device->crtcs_len; i++) {
+		struct glider_drm_prop *mode_id =
+			&device->crtcs[i].props[GLIDER_DRM_CRTC_MODE_ID];
+		if (mode_id->current == mode->blob_id) {
+			mode_id->current = 0;
+		}
+		if (mode_id->pending == mode->blob_id) {
+			mode_id->pending = 0;
+		}
+	}
+
+	if (drmModeDestroyPropertyBlob(device->fd, mode->blob_id) != 0) {
+		wlr_log_errno(WLR_ERROR, "drmModeDestroyPropertyBlob failed");
+	}
+	mode->blob_id = 0;
+}
+
+/* Mode blobs are cached per connector mode, so switching modes doesn't
+ * create and destroy blobs. */
 bool set_drm_crtc_mode(struct glider_drm_crtc *crtc,
-		const struct glider_drm_mode *mode) {
+		struct glider_drm_mode *mode) {
 	uint32_t mode_blob = 0;
 	if (mode != NULL) {
-		if (drmModeCreatePropertyBlob(crtc->device->fd, &mode->drm_mode,
-				sizeof(drmModeModeInfo), &mode_blob) != 0) {
-			wlr_log_errno(WLR_ERROR, "drmModeCreatePropertyBlob failed");
+		if (!init_drm_mode_blob(crtc->device, mode)) {
 			return false;
 		}
+		mode_blob = mode->blob_id;
 	}
 
 	crtc->props[GLIDER_DRM_CRTC_ACTIVE].pending = mode != NULL;
+	crtc->props[GLIDER_DRM_CRTC_MODE_ID].pending = mode_blob;
 
-	struct glider_drm_prop *mode_id = &crtc->props[GLIDER_DRM_CRTC_MODE_ID];
-	if (mode_id->pending != 0 && mode_id->pending != mode_id->initial) {
-		if (drmModeDestroyPropertyBlob(crtc->device->fd,
-				mode_id->pending) != 0) {
-			wlr_log_errno(WLR_ERROR, "drmModeDestroyPropertyBlob failed");
-			return false;
+	return true;
+}
+
+/* Bound on the number of partial assignments explored. The search reaches
+ * the greedy assignment first (each connector takes the first free CRTC), so
+ * when the bound is hit we still get at least that one. */
+#define CRTC_ASSIGNMENT_MAX_STEPS 100000
+
+/* An overlay plane usable by k of the assigned CRTCs counts as 1/k plane for
+ * each of them, in these fixed-point units */
+#define OVERLAY_PLANE_SHARE 5040
+
+struct crtc_assignment {
+	struct glider_drm_connector *conns[32];
+	uint32_t possible_crtcs[32];
+	size_t conns_len;
+	size_t steps;
+
+	ssize_t cur[32], best[32];
+	size_t best_assigned, best_min, best_sum, best_kept;
+};
+
+/* Assignments are ranked by number of connectors with a CRTC, then by the
+ * share of overlay planes of the worst-off output, then by the number of
+ * distinct overlay planes, then by the number of connectors keeping their
+ * previous assignment. */
+static void score_crtc_assignment(struct crtc_assignment *a,
+		struct glider_drm_device *device) {
+	// Number of assigned CRTCs each overlay plane is usable by
+	size_t plane_users[64] = {0};
+	for (size_t i = 0; i < a->conns_len; i++) {
+		if (a->cur[i] < 0) {
+			continue;
+		}
+		uint64_t overlays = device->crtcs[a->cur[i]].overlays;
+		for (size_t p = 0; p < 64; p++) {
+			if (overlays & ((uint64_t)1 << p)) {
+				plane_users[p]++;
+			}
 		}
 	}
-	mode_id->pending = mode_blob;
 
-	return true;
+	size_t assigned = 0, kept = 0, sum = 0, min = SIZE_MAX;
+	for (size_t i = 0; i < a->conns_len; i++) {
+		if (a->cur[i] < 0) {
+			continue;
+		}
+		struct glider_drm_crtc *crtc = &device->crtcs[a->cur[i]];
+		size_t share = 0;
+		for (size_t p = 0; p < 64; p++) {
+			if (crtc->overlays & ((uint64_t)1 << p)) {
+				share += OVERLAY_PLANE_SHARE / plane_users[p];
+			}
+		}
+		assigned++;
+		sum += share;
+		if (share < min) {
+			min = share;
+		}
+		if (a->conns[i]->assigned_crtc == crtc) {
+			kept++;
+		}
+	}
+	if (assigned == 0) {
+		min = 0;
+	}
+
+	if (assigned != a->best_assigned) {
+		if (assigned < a->best_assigned) {
+			return;
+		}
+	} else if (min != a->best_min) {
+		if (min < a->best_min) {
+			return;
+		}
+	} else if (sum != a->best_sum) {
+		if (sum < a->best_sum) {
+			return;
+		}
+	} else if (kept <= a->best_kept) {
+		return;
+	}
+
+	a->best_assigned = assigned;
+	a->best_min = min;
+	a->best_sum = sum;
+	a->best_kept = kept;
+	memcpy(a->best, a->cur, a->conns_len * sizeof(a->cur[0]));
+}
+
+static void solve_crtc_assignment(struct crtc_assignment *a,
+		struct glider_drm_device *device, size_t i, uint32_t used,
+		size_t assigned) {
+	if (assigned + (a->conns_len - i) < a->best_assigned) {
+		return; // can't beat the best assignment anymore
+	}
+	if (a->steps == CRTC_ASSIGNMENT_MAX_STEPS) {
+		return;
+	}
+	a->steps++;
+	if (i == a->conns_len) {
+		score_crtc_assignment(a, device);
+		return;
+	}
+
+	uint32_t possible_crtcs = a->possible_crtcs[i] & ~used;
+	// possible_crtcs can't reference CRTCs past the first 32
+	for (size_t j = 0; j < device->crtcs_len && j < 32; j++) {
+		if (possible_crtcs & (1u << j)) {
+			a->cur[i] = j;
+			solve_crtc_assignment(a, device, i + 1, used | (1u << j),
+				assigned + 1);
+		}
+	}
+
+	a->cur[i] = -1;
+	solve_crtc_assignment(a, device, i + 1, used, assigned);
+}
+
+void assign_drm_crtcs(struct glider_drm_device *device,
+		struct glider_drm_connector *probing) {
+	struct crtc_assignment a = {0};
+
+	// Some drivers set possible_crtcs to UINT32_MAX
+	uint32_t valid_crtcs = device->crtcs_len >= 32 ?
+		UINT32_MAX : (1u << device->crtcs_len) - 1;
+
+	struct glider_drm_connector *conn;
+	wl_list_for_each(conn, &device->connectors, link) {
+		if (conn != probing && conn->connection != DRM_MODE_CONNECTED) {
+			conn->assigned_crtc = NULL;
+			continue;
+		}
+		if (a.conns_len == sizeof(a.conns) / sizeof(a.conns[0])) {
+			wlr_log(WLR_ERROR, "Too many connectors, not assigning a CRTC "
+				"to connector %"PRIu32, conn->id);
+			conn->assigned_crtc = NULL;
+			continue;
+		}
+
+		uint32_t possible_crtcs = conn->possible_crtcs & valid_crtcs;
+		if (conn->crtc != NULL) {
+			// Moving an enabled connector would require a modeset
+			size_t crtc_index = conn->crtc - device->crtcs;
+			possible_crtcs = crtc_index < 32 ? 1u << crtc_index : 0;
+		}
+		a.conns[a.conns_len] = conn;
+		a.possible_crtcs[a.conns_len] = possible_crtcs;
+		a.cur[a.conns_len] = a.best[a.conns_len] = -1;
+		a.conns_len++;
+	}
+
+	solve_crtc_assignment(&a, device, 0, 0, 0);
+	if (a.steps == CRTC_ASSIGNMENT_MAX_STEPS) {
+		wlr_log(WLR_DEBUG, "CRTC assignment search bound reached, the "
+			"assignment may not be optimal");
+	}
+
+	for (size_t i = 0; i < a.conns_len; i++) {
+		conn = a.conns[i];
+		struct glider_drm_crtc *crtc =
+			a.best[i] >= 0 ? &device->crtcs[a.best[i]] : NULL;
+		if (crtc != conn->assigned_crtc) {
+			if (crtc != NULL) {
+				wlr_log(WLR_DEBUG, "Assigning CRTC %"PRIu32" to connector "
+					"%"PRIu32" (%zu overlay planes)", crtc->id, conn->id,
+					crtc->overlay_planes);
+			} else {
+				wlr_log(WLR_DEBUG, "No CRTC available for connector "
+					"%"PRIu32, conn->id);
+			}
+		}
+		conn->assigned_crtc = crtc;
+	}
 }
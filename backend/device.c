@@ -3,19 +3,28 @@
 #include <drm_fourcc.h>
 #include <gbm.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
 #include <wlr/util/log.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include "backend/backend.h"
+#include "trace.h"
 
 static bool get_drm_resources(struct glider_drm_device *device) {
+	device->stats.init_ioctls++;
 	drmModeRes *res = drmModeGetResources(device->fd);
 	if (res == NULL) {
 		wlr_log_errno(WLR_ERROR, "drmModeGetResources failed");
 		return false;
 	}
 
+	if (!glider_hash_table_init(&device->crtc_ids)) {
+		drmModeFreeResources(res);
+		return false;
+	}
+
 	device->crtcs = calloc(res->count_crtcs, sizeof(struct glider_drm_crtc));
 	if (device->crtcs == NULL) {
 		goto error_crtc;
@@ -28,6 +37,7 @@ static bool get_drm_resources(struct glider_drm_device *device) {
 		device->crtcs_len++;
 	}
 
+	device->stats.init_ioctls++;
 	drmModePlaneRes *plane_res = drmModeGetPlaneResources(device->fd);
 	if (plane_res == NULL) {
 		goto error_crtc;
@@ -54,9 +64,9 @@ static bool get_drm_resources(struct glider_drm_device *device) {
 			continue;
 		}
 
-		for (size_t j = 0; j < device->crtcs_len; j++) {
+		for (size_t j = 0; j < device->crtcs_len && j < 32; j++) {
 			struct glider_drm_crtc *crtc = &device->crtcs[j];
-			if (plane->plane->possible_crtcs & (1 << j) &&
+			if (plane->plane->possible_crtcs & (1u << j) &&
 					crtc->primary_plane == NULL) {
 				crtc->primary_plane = plane;
 				break;
@@ -67,6 +77,27 @@ static bool get_drm_resources(struct glider_drm_device *device) {
 		assert(device->crtcs[i].primary_plane != NULL);
 	}
 
+	// Used to balance overlay planes when assigning CRTCs to connectors
+	for (size_t i = 0; i < device->planes_len; i++) {
+		struct glider_drm_plane *plane = &device->planes[i];
+		bool overlay = plane->props[GLIDER_DRM_PLANE_TYPE].current ==
+			DRM_PLANE_TYPE_OVERLAY;
+		for (size_t j = 0; j < device->crtcs_len && j < 32; j++) {
+			if (!(plane->plane->possible_crtcs & (1u << j))) {
+				continue;
+			}
+			if (overlay) {
+				device->crtcs[j].overlay_planes++;
+			}
+			if (i < 64) {
+				device->crtcs[j].planes |= (uint64_t)1 << i;
+				if (overlay) {
+					device->crtcs[j].overlays |= (uint64_t)1 << i;
+				}
+			}
+		}
+	}
+
 	drmModeFreePlaneResources(plane_res);
 	drmModeFreeResources(res);
 	return true;
@@ -80,6 +111,7 @@ error_crtc:
 	for (size_t i = 0; i < device->crtcs_len; i++) {
 		finish_drm_crtc(&device->crtcs[i]);
 	}
+	glider_hash_table_finish(&device->crtc_ids);
 	return false;
 }
 
@@ -89,22 +121,37 @@ static void handle_invalidated(struct wl_listener *listener, void *data) {
 	refresh_drm_device(device);
 }
 
-static struct glider_drm_crtc *crtc_from_id(struct glider_drm_device *device,
-		uint32_t crtc_id) {
-	for (size_t i = 0; i < device->crtcs_len; i++) {
-		struct glider_drm_crtc *crtc = &device->crtcs[i];
-		if (crtc->id == crtc_id) {
-			return crtc;
+void handle_drm_device_hotplug(struct glider_drm_device *device,
+		uint32_t conn_id, uint32_t prop_id) {
+	if (conn_id == 0) {
+		refresh_drm_device(device);
+		return;
+	}
+
+	struct glider_drm_connector *conn;
+	wl_list_for_each(conn, &device->connectors, link) {
+		if (conn->id == conn_id) {
+			wlr_log(WLR_DEBUG, "Refreshing connector %"PRIu32, conn_id);
+			if (refresh_drm_connector_current(conn, prop_id)) {
+				announce_drm_connectors(device);
+			} else {
+				refresh_drm_device(device);
+			}
+			return;
 		}
 	}
-	return NULL;
+
+	// Probably a new DP-MST connector
+	wlr_log(WLR_DEBUG, "Hotplug event for unknown connector %"PRIu32,
+		conn_id);
+	refresh_drm_device(device);
 }
 
 static void handle_page_flip(int fd, unsigned seq,
 		unsigned tv_sec, unsigned tv_usec, unsigned crtc_id, void *data) {
 	struct glider_drm_device *device = data;
 
-	struct glider_drm_crtc *crtc = crtc_from_id(device, crtc_id);
+	struct glider_drm_crtc *crtc = get_drm_crtc_from_id(device, crtc_id);
 	if (crtc == NULL) {
 		wlr_log(WLR_ERROR, "Received page-flip for unknown CRTC %"PRIu32,
 			crtc_id);
@@ -129,27 +176,22 @@ static int handle_drm_event(int fd, uint32_t mask, void *data) {
 	return 1;
 }
 
-// TODO: move to wlroots
-static void format_set_union(struct wlr_drm_format_set *dst,
-		const struct wlr_drm_format_set *src) {
-	for (size_t i = 0; i < src->len; i++) {
-		const struct wlr_drm_format *fmt = src->formats[i];
-		wlr_drm_format_set_add(dst, fmt->format, DRM_FORMAT_MOD_INVALID);
-		for (size_t j = 0; j < fmt->len; j++) {
-			wlr_drm_format_set_add(dst, fmt->format, fmt->modifiers[j]);
-		}
-	}
-}
-
 bool init_drm_device(struct glider_drm_device *device,
 		struct glider_drm_backend *backend, int fd) {
 	device->backend = backend;
 	device->fd = fd;
 
 	wl_list_init(&device->connectors);
-	wl_list_init(&device->buffers);
 	wl_list_init(&device->invalidated.link);
 
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		wlr_log_errno(WLR_ERROR, "fstat failed");
+		return false;
+	}
+	device->devnum = st.st_rdev;
+
+	device->stats.init_ioctls += 4; // client caps and caps below
 	if (drmSetClientCap(device->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) != 0) {
 		wlr_log(WLR_ERROR, "DRM_CLIENT_CAP_UNIVERSAL_PLANES unsupported");
 		return false;
@@ -169,9 +211,41 @@ bool init_drm_device(struct glider_drm_device *device,
 	int ret = drmGetCap(device->fd, DRM_CAP_ADDFB2_MODIFIERS, &cap);
 	device->cap_addfb2_modifiers = ret == 0 && cap == 1;
 
+	device->stats.init_ioctls += 2;
+	device->cursor_width = device->cursor_height = 64;
+	if (drmGetCap(device->fd, DRM_CAP_CURSOR_WIDTH, &cap) == 0) {
+		device->cursor_width = cap;
+	}
+	if (drmGetCap(device->fd, DRM_CAP_CURSOR_HEIGHT, &cap) == 0) {
+		device->cursor_height = cap;
+	}
+
+#ifdef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+	device->stats.init_ioctls++;
+	ret = drmGetCap(device->fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap);
+	device->cap_atomic_async_page_flip = ret == 0 && cap == 1;
+#else
+	// Older libdrm: let the driver reject async page-flips
+	device->cap_atomic_async_page_flip = true;
+#endif
+
+	const char *env = getenv("GLIDER_DRM_DEVICE_COMMIT");
+	device->aggregate_commits = env != NULL && strcmp(env, "1") == 0;
+	if (device->aggregate_commits) {
+		wlr_log(WLR_DEBUG, "Using device-wide atomic page-flips");
+	}
+
+	if (!init_drm_prop_cache(device)) {
+		return false;
+	}
+
+	if (!init_drm_buffers(device)) {
+		goto error_prop_cache;
+	}
+
 	device->gbm = gbm_create_device(device->fd);
 	if (device->gbm == NULL) {
-		return false;
+		goto error_buffers;
 	}
 
 	device->liftoff_device = liftoff_device_create(device->fd);
@@ -179,13 +253,46 @@ bool init_drm_device(struct glider_drm_device *device,
 		goto error_gbm;
 	}
 
-	if (!get_drm_resources(device)) {
+	glider_trace_begin(GLIDER_TRACE_DRM_RESOURCES);
+	bool ok = get_drm_resources(device);
+	glider_trace_end(GLIDER_TRACE_DRM_RESOURCES);
+	if (!ok) {
 		goto error_liftoff;
 	}
 
+	if (!init_drm_format_tables(device)) {
+		goto error_resources;
+	}
+
+	wlr_log(WLR_DEBUG, "Initialized DRM device with %"PRIu64" ioctls "
+		"(%zu distinct properties)", device->stats.init_ioctls,
+		device->prop_infos.len);
+
+	return true;
+
+error_resources:
 	for (size_t i = 0; i < device->planes_len; i++) {
-		format_set_union(&device->formats, &device->planes[i].formats);
+		finish_drm_plane(&device->planes[i]);
 	}
+	free(device->planes);
+	for (size_t i = 0; i < device->crtcs_len; i++) {
+		finish_drm_crtc(&device->crtcs[i]);
+	}
+	free(device->crtcs);
+	glider_hash_table_finish(&device->crtc_ids);
+error_liftoff:
+	liftoff_device_destroy(device->liftoff_device);
+error_gbm:
+	gbm_device_destroy(device->gbm);
+error_buffers:
+	finish_drm_buffers(device);
+error_prop_cache:
+	finish_drm_prop_cache(device);
+	return false;
+}
+
+bool start_drm_device(struct glider_drm_device *device) {
+	struct glider_drm_backend *backend = device->backend;
 
 	struct wl_event_loop *event_loop =
 		wl_display_get_event_loop(backend->display);
@@ -193,30 +300,25 @@ bool init_drm_device(struct glider_drm_device *device,
 		WL_EVENT_READABLE, handle_drm_event, NULL);
 	if (device->event_source == NULL) {
 		wlr_log(WLR_ERROR, "wl_event_loop_add_fd failed");
-		finish_drm_device(device);
 		return false;
 	}
 
-	device->invalidated.notify = handle_invalidated;
-	wlr_session_signal_add(backend->session, fd, &device->invalidated);
+	if (backend->udev_monitor == NULL) {
+		device->invalidated.notify = handle_invalidated;
+		wlr_session_signal_add(backend->session, device->fd,
+			&device->invalidated);
+	}
 
 	return true;
-
-error_liftoff:
-	liftoff_device_destroy(device->liftoff_device);
-error_gbm:
-	gbm_device_destroy(device->gbm);
-	return false;
 }
 
-static void destroy_drm_buffer(struct glider_drm_buffer *drm_buffer);
-
 void finish_drm_device(struct glider_drm_device *device) {
-	struct glider_drm_buffer *buf, *buf_tmp;
-	wl_list_for_each_safe(buf, buf_tmp, &device->buffers, link) {
-		destroy_drm_buffer(buf);
+	if (device->commit_idle != NULL) {
+		wl_event_source_remove(device->commit_idle);
 	}
 
+	finish_drm_buffers(device);
+
 	struct glider_drm_connector *conn, *conn_tmp;
 	wl_list_for_each_safe(conn, conn_tmp, &device->connectors, link) {
 		destroy_drm_connector(conn);
@@ -235,8 +337,10 @@ void finish_drm_device(struct glider_drm_device *device) {
 		finish_drm_crtc(&device->crtcs[i]);
 	}
 	free(device->crtcs);
+	glider_hash_table_finish(&device->crtc_ids);
 	liftoff_device_destroy(device->liftoff_device);
-	wlr_drm_format_set_finish(&device->formats);
+	finish_drm_prop_cache(device);
+	finish_drm_format_tables(device);
 	gbm_device_destroy(device->gbm);
 	wlr_session_close_file(device->backend->session, device->fd);
 }
@@ -250,6 +354,82 @@ static ssize_t get_conn_index(drmModeRes *res, uint32_t id) {
 	return -1;
 }
 
+void pause_drm_device(struct glider_drm_device *device) {
+	// Drop the page-flips waiting for the next device-wide commit
+	if (device->commit_idle != NULL) {
+		wl_event_source_remove(device->commit_idle);
+		device->commit_idle = NULL;
+	}
+
+	struct glider_drm_connector *conn;
+	wl_list_for_each(conn, &device->connectors, link) {
+		if (conn->commit_queued) {
+			conn->commit_queued = false;
+			finish_drm_connector_commit(conn, 0, false);
+		}
+	}
+}
+
+static bool restore_drm_crtc(struct glider_drm_crtc *crtc,
+		drmModeAtomicReq *req) {
+	if (!restore_drm_props(crtc->props, GLIDER_DRM_CRTC_PROP_COUNT,
+			crtc->id, req)) {
+		return false;
+	}
+	if (crtc->props[GLIDER_DRM_CRTC_ACTIVE].current) {
+		return liftoff_output_apply(crtc->liftoff_output, req);
+	}
+	return true;
+}
+
+/* Re-apply our cached KMS state with a single modeset, without re-probing
+ * connectors. */
+bool restore_drm_device(struct glider_drm_device *device) {
+	wlr_log(WLR_DEBUG, "Restoring DRM device state");
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	if (req == NULL) {
+		wlr_log_errno(WLR_ERROR, "drmModeAtomicAlloc failed");
+		return false;
+	}
+
+	struct glider_drm_connector *conn;
+	wl_list_for_each(conn, &device->connectors, link) {
+		if (!restore_drm_props(conn->props, GLIDER_DRM_CONNECTOR_PROP_COUNT,
+				conn->id, req)) {
+			goto error;
+		}
+	}
+	for (size_t i = 0; i < device->crtcs_len; i++) {
+		if (!restore_drm_crtc(&device->crtcs[i], req)) {
+			goto error;
+		}
+	}
+
+	int ret = drmModeAtomicCommit(device->fd, req,
+		DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	drmModeAtomicFree(req);
+	if (ret != 0) {
+		wlr_log(WLR_ERROR, "Failed to restore DRM device state: %s",
+			strerror(-ret));
+		return false;
+	}
+
+	// The restore commit doesn't generate page-flip events, kick the frame
+	// loops manually
+	wl_list_for_each(conn, &device->connectors, link) {
+		if (conn->crtc != NULL && conn->output.enabled) {
+			wlr_output_send_frame(&conn->output);
+		}
+	}
+
+	return true;
+
+error:
+	drmModeAtomicFree(req);
+	return false;
+}
+
 bool refresh_drm_device(struct glider_drm_device *device) {
 	wlr_log(WLR_DEBUG, "Refreshing DRM device");
 
@@ -294,174 +474,13 @@ bool refresh_drm_device(struct glider_drm_device *device) {
 		}
 	}
 
+	announce_drm_connectors(device);
 	drmModeFreeResources(res);
 	return true;
 
 error:
+	// Don't lose the connectors refreshed so far
+	announce_drm_connectors(device);
 	drmModeFreeResources(res);
 	return false;
 }
-
-static struct gbm_bo *import_dmabuf(struct glider_drm_device *device,
-		struct wlr_dmabuf_attributes *dmabuf) {
-	uint32_t usage = GBM_BO_USE_SCANOUT;
-
-	if (dmabuf->n_planes > GBM_MAX_PLANES) {
-		wlr_log(WLR_ERROR, "DMA-BUF contains too many planes (%d)",
-			dmabuf->n_planes);
-		return NULL;
-	}
-
-	struct gbm_bo *bo;
-	if (dmabuf->modifier != DRM_FORMAT_MOD_INVALID || dmabuf->n_planes > 1 ||
-			dmabuf->offset[0] > 0) {
-		struct gbm_import_fd_modifier_data import_mod = {
-			.width = dmabuf->width,
-			.height = dmabuf->height,
-			.format = dmabuf->format,
-			.modifier = dmabuf->modifier,
-			.num_fds = dmabuf->n_planes,
-		};
-		memcpy(import_mod.fds, dmabuf->fd,
-			sizeof(dmabuf->fd[0]) * dmabuf->n_planes);
-		memcpy(import_mod.strides, dmabuf->stride,
-			sizeof(dmabuf->stride[0]) * dmabuf->n_planes);
-		memcpy(import_mod.offsets, dmabuf->offset,
-			sizeof(dmabuf->offset[0]) * dmabuf->n_planes);
-		bo = gbm_bo_import(device->gbm, GBM_BO_IMPORT_FD_MODIFIER, &import_mod,
-			usage);
-	} else {
-		struct gbm_import_fd_data import = {
-			.width = dmabuf->width,
-			.height = dmabuf->height,
-			.stride = dmabuf->stride[0],
-			.format = dmabuf->format,
-			.fd = dmabuf->fd[0],
-		};
-		bo = gbm_bo_import(device->gbm, GBM_BO_IMPORT_FD, &import, usage);
-	}
-	if (bo == NULL) {
-		wlr_log(WLR_ERROR, "gbm_bo_import failed");
-	}
-	return bo;
-}
-
-static uint32_t add_gbm_bo(struct glider_drm_device *device,
-		struct gbm_bo *bo) {
-	uint32_t width = gbm_bo_get_width(bo);
-	uint32_t height = gbm_bo_get_height(bo);
-	uint32_t format = gbm_bo_get_format(bo);
-	uint64_t modifier = gbm_bo_get_modifier(bo);
-
-	uint32_t handles[4] = {0};
-	uint64_t modifiers[4] = {0};
-	uint32_t strides[4] = {0};
-	uint32_t offsets[4] = {0};
-	for (int i = 0; i < gbm_bo_get_plane_count(bo); i++) {
-		handles[i] = gbm_bo_get_handle_for_plane(bo, i).u32;
-		// KMS requires all BO planes to have the same modifier
-		modifiers[i] = modifier;
-		strides[i] = gbm_bo_get_stride_for_plane(bo, i);
-		offsets[i] = gbm_bo_get_offset(bo, i);
-	}
-
-	uint32_t fb_id = 0;
-	if (device->cap_addfb2_modifiers && modifier != DRM_FORMAT_MOD_INVALID) {
-		if (drmModeAddFB2WithModifiers(device->fd, width, height, format,
-				handles, strides, offsets, modifiers, &fb_id,
-				DRM_MODE_FB_MODIFIERS) != 0) {
-			wlr_log_errno(WLR_ERROR, "drmModeAddFB2WithModifiers failed");
-			return 0;
-		}
-	} else {
-		if (drmModeAddFB2(device->fd, width, height, format, handles, strides,
-				offsets, &fb_id, 0) != 0) {
-			wlr_log_errno(WLR_ERROR, "drmModeAddFB2 failed");
-			return 0;
-		}
-	}
-
-	return fb_id;
-}
-
-static void handle_buffer_destroy(struct wl_listener *listener, void *data) {
-	struct glider_drm_buffer *drm_buffer =
-		wl_container_of(listener, drm_buffer, destroy);
-	destroy_drm_buffer(drm_buffer);
-}
-
-struct glider_drm_buffer *get_or_create_drm_buffer(
-		struct glider_drm_device *device, struct wlr_buffer *buffer) {
-	struct glider_drm_buffer *drm_buffer;
-	wl_list_for_each(drm_buffer, &device->buffers, link) {
-		if (drm_buffer->buffer == buffer) {
-			return drm_buffer;
-		}
-	}
-
-	struct wlr_dmabuf_attributes dmabuf;
-	if (!wlr_buffer_get_dmabuf(buffer, &dmabuf)) {
-		return NULL;
-	}
-
-	if (!wlr_drm_format_set_has(&device->formats,
-			dmabuf.format, dmabuf.modifier)) {
-		wlr_log(WLR_DEBUG, "No plane can scan-out format 0x%"PRIX32", "
-			"modifier 0x%"PRIX64, dmabuf.format, dmabuf.modifier);
-		return NULL;
-	}
-
-	drm_buffer = calloc(1, sizeof(*drm_buffer));
-	if (drm_buffer == NULL) {
-		return NULL;
-	}
-
-	drm_buffer->buffer = buffer;
-	drm_buffer->device = device;
-
-	// In theory we could bypass GBM and directly add the FB via some
-	// drmPrimeFDToHandle calls, however this leads to various issues regarding
-	// GEM handles and usage
-	drm_buffer->gbm = import_dmabuf(device, &dmabuf);
-	if (drm_buffer->gbm == NULL) {
-		goto error_drm_buffer;
-	}
-
-	drm_buffer->id = add_gbm_bo(device, drm_buffer->gbm);
-	if (drm_buffer->id == 0) {
-		goto error_gbm;
-	}
-
-	drm_buffer->destroy.notify = handle_buffer_destroy;
-	wl_signal_add(&buffer->events.destroy, &drm_buffer->destroy);
-
-	wl_list_insert(&device->buffers, &drm_buffer->link);
-
-	return drm_buffer;
-
-error_gbm:
-	gbm_bo_destroy(drm_buffer->gbm);
-error_drm_buffer:
-	free(drm_buffer);
-	return NULL;
-}
-
-static void destroy_drm_buffer(struct glider_drm_buffer *buffer) {
-	if (drmModeRmFB(buffer->device->fd, buffer->id) != 0) {
-		wlr_log_errno(WLR_ERROR, "drmModeRmFB failed");
-	}
-	gbm_bo_destroy(buffer->gbm);
-	for (size_t i = 0; i < buffer->device->crtcs_len; i++) {
-		struct glider_drm_crtc *crtc = &buffer->device->crtcs[i];
-		for (size_t j = 0; j < crtc->attachments_cap; j++) {
-			struct glider_drm_attachment *att = &crtc->attachments[j];
-			if (att->state != GLIDER_DRM_BUFFER_UNLOCKED &&
-					att->buffer == buffer) {
-				unlock_drm_attachment(att);
-			}
-		}
-	}
-	wl_list_remove(&buffer->destroy.link);
-	wl_list_remove(&buffer->link);
-	free(buffer);
-}
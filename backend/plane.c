@@ -1,3 +1,5 @@
+#include <stdlib.h>
+#include <sys/types.h>
 #include <drm_fourcc.h>
 #include <wlr/util/log.h>
 #include "backend/backend.h"
@@ -7,6 +9,7 @@ bool init_drm_plane(struct glider_drm_plane *plane,
 	plane->device = device;
 	plane->id = id;
 
+	device->stats.init_ioctls++;
 	plane->plane = drmModeGetPlane(device->fd, id);
 	if (plane->plane == NULL) {
 		wlr_log_errno(WLR_ERROR, "drmModeGetPlane failed");
@@ -19,12 +22,24 @@ bool init_drm_plane(struct glider_drm_plane *plane,
 		return false;
 	}
 
+	// Planes without the property can only scan-out unrotated buffers
+	plane->rotations = DRM_MODE_ROTATE_0;
+	uint32_t rotation_id = plane->props[GLIDER_DRM_PLANE_ROTATION].id;
+	if (rotation_id != 0) {
+		const struct glider_drm_prop_info *info =
+			get_drm_prop_info(device, rotation_id);
+		if (info != NULL) {
+			plane->rotations = info->bitmask;
+		}
+	}
+
 	for (size_t i = 0; i < plane->plane->count_formats; i++) {
 		wlr_drm_format_set_add(&plane->formats, plane->plane->formats[i],
 			DRM_FORMAT_MOD_INVALID);
 	}
 
 	if (plane->props[GLIDER_DRM_PLANE_IN_FORMATS].current != 0) {
+		device->stats.init_ioctls++;
 		drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(device->fd,
 			plane->props[GLIDER_DRM_PLANE_IN_FORMATS].current);
 		if (blob == NULL) {
@@ -56,3 +71,190 @@ void finish_drm_plane(struct glider_drm_plane *plane) {
 	wlr_drm_format_set_finish(&plane->formats);
 	drmModeFreePlane(plane->plane);
 }
+
+static struct glider_drm_format_planes *find_drm_format_planes(
+		struct glider_drm_device *device, uint32_t format, uint64_t modifier,
+		uint64_t hash) {
+	struct wl_list *bucket =
+		glider_hash_table_bucket(&device->format_planes, hash);
+	struct glider_drm_format_planes *fp;
+	wl_list_for_each(fp, bucket, entry.link) {
+		if (fp->entry.hash == hash && fp->format == format &&
+				fp->modifier == modifier) {
+			return fp;
+		}
+	}
+	return NULL;
+}
+
+static struct glider_drm_format_modifiers *find_drm_format_modifiers(
+		struct glider_drm_device *device, uint32_t format, uint64_t hash) {
+	struct wl_list *bucket =
+		glider_hash_table_bucket(&device->format_modifiers, hash);
+	struct glider_drm_format_modifiers *fm;
+	wl_list_for_each(fm, bucket, entry.link) {
+		if (fm->entry.hash == hash && fm->format == format) {
+			return fm;
+		}
+	}
+	return NULL;
+}
+
+static uint64_t hash_format_modifier(uint32_t format, uint64_t modifier) {
+	uint64_t hash = glider_hash_bytes(0, &format, sizeof(format));
+	return glider_hash_bytes(hash, &modifier, sizeof(modifier));
+}
+
+static ssize_t get_drm_modifier_index(struct glider_drm_device *device,
+		uint64_t modifier) {
+	for (size_t i = 0; i < device->modifiers_len; i++) {
+		if (device->modifiers[i] == modifier) {
+			return i;
+		}
+	}
+	if (device->modifiers_len == GLIDER_DRM_MODIFIERS_CAP) {
+		return -1;
+	}
+	device->modifiers[device->modifiers_len] = modifier;
+	return device->modifiers_len++;
+}
+
+static bool add_drm_format_plane(struct glider_drm_device *device,
+		uint32_t format, uint64_t modifier, size_t plane_index) {
+	uint64_t hash = hash_format_modifier(format, modifier);
+	struct glider_drm_format_planes *fp =
+		find_drm_format_planes(device, format, modifier, hash);
+	if (fp == NULL) {
+		fp = calloc(1, sizeof(*fp));
+		if (fp == NULL) {
+			wlr_log_errno(WLR_ERROR, "calloc failed");
+			return false;
+		}
+		fp->format = format;
+		fp->modifier = modifier;
+		glider_hash_table_insert(&device->format_planes, &fp->entry, hash);
+	}
+	fp->planes |= (uint64_t)1 << plane_index;
+
+	hash = glider_hash_u64(format);
+	struct glider_drm_format_modifiers *fm =
+		find_drm_format_modifiers(device, format, hash);
+	if (fm == NULL) {
+		fm = calloc(1, sizeof(*fm));
+		if (fm == NULL) {
+			wlr_log_errno(WLR_ERROR, "calloc failed");
+			return false;
+		}
+		fm->format = format;
+		glider_hash_table_insert(&device->format_modifiers, &fm->entry, hash);
+	}
+	// The (format, modifier) table stays authoritative if we run out of bits
+	ssize_t mod_index = get_drm_modifier_index(device, modifier);
+	if (mod_index >= 0) {
+		fm->modifiers |= (uint64_t)1 << mod_index;
+	}
+
+	return true;
+}
+
+bool init_drm_format_tables(struct glider_drm_device *device) {
+	if (!glider_hash_table_init(&device->format_planes)) {
+		return false;
+	}
+	if (!glider_hash_table_init(&device->format_modifiers)) {
+		glider_hash_table_finish(&device->format_planes);
+		return false;
+	}
+
+	size_t planes_len = device->planes_len;
+	if (planes_len > 64) {
+		wlr_log(WLR_INFO, "More than 64 planes, the formats of the last %zu "
+			"are checked one plane at a time", planes_len - 64);
+		planes_len = 64;
+	}
+
+	for (size_t i = 0; i < planes_len; i++) {
+		const struct wlr_drm_format_set *set = &device->planes[i].formats;
+		for (size_t j = 0; j < set->len; j++) {
+			const struct wlr_drm_format *fmt = set->formats[j];
+			if (!add_drm_format_plane(device, fmt->format,
+					DRM_FORMAT_MOD_INVALID, i)) {
+				goto error;
+			}
+			for (size_t k = 0; k < fmt->len; k++) {
+				if (!add_drm_format_plane(device, fmt->format,
+						fmt->modifiers[k], i)) {
+					goto error;
+				}
+			}
+		}
+	}
+
+	if (device->modifiers_len == GLIDER_DRM_MODIFIERS_CAP) {
+		wlr_log(WLR_DEBUG, "Modifier bitsets are full, some modifiers are "
+			"only listed in the (format, modifier) table");
+	}
+	wlr_log(WLR_DEBUG, "Scan-out format tables: %zu formats, %zu modifiers, "
+		"%zu format/modifier pairs", device->format_modifiers.len,
+		device->modifiers_len, device->format_planes.len);
+	device->formats_seq++;
+	return true;
+
+error:
+	finish_drm_format_tables(device);
+	return false;
+}
+
+void finish_drm_format_tables(struct glider_drm_device *device) {
+	for (size_t i = 0; i < device->format_planes.buckets_len; i++) {
+		struct glider_drm_format_planes *fp, *fp_tmp;
+		wl_list_for_each_safe(fp, fp_tmp, &device->format_planes.buckets[i],
+				entry.link) {
+			glider_hash_table_remove(&device->format_planes, &fp->entry);
+			free(fp);
+		}
+	}
+	for (size_t i = 0; i < device->format_modifiers.buckets_len; i++) {
+		struct glider_drm_format_modifiers *fm, *fm_tmp;
+		wl_list_for_each_safe(fm, fm_tmp,
+				&device->format_modifiers.buckets[i], entry.link) {
+			glider_hash_table_remove(&device->format_modifiers, &fm->entry);
+			free(fm);
+		}
+	}
+	glider_hash_table_finish(&device->format_planes);
+	glider_hash_table_finish(&device->format_modifiers);
+	device->modifiers_len = 0;
+}
+
+uint64_t get_drm_format_planes(struct glider_drm_device *device,
+		uint32_t format, uint64_t modifier) {
+	struct glider_drm_format_planes *fp = find_drm_format_planes(device,
+		format, modifier, hash_format_modifier(format, modifier));
+	return fp != NULL ? fp->planes : 0;
+}
+
+bool has_drm_format_untracked_plane(struct glider_drm_device *device,
+		struct glider_drm_crtc *crtc, uint32_t format, uint64_t modifier) {
+	for (size_t i = 64; i < device->planes_len; i++) {
+		struct glider_drm_plane *plane = &device->planes[i];
+		if (crtc != NULL) {
+			size_t crtc_index = crtc - device->crtcs;
+			if (crtc_index >= 32 ||
+					!(plane->plane->possible_crtcs & (1u << crtc_index))) {
+				continue;
+			}
+		}
+		if (wlr_drm_format_set_has(&plane->formats, format, modifier)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+uint64_t get_drm_format_modifiers(struct glider_drm_device *device,
+		uint32_t format) {
+	struct glider_drm_format_modifiers *fm =
+		find_drm_format_modifiers(device, format, glider_hash_u64(format));
+	return fm != NULL ? fm->modifiers : 0;
+}
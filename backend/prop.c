@@ -1,33 +1,159 @@
+#include <assert.h>
+#include <stdlib.h>
 #include <string.h>
-#include <search.h>
 #include <wlr/util/log.h>
 #include "backend/backend.h"
 
 const struct glider_drm_prop_spec
 		glider_drm_connector_props[GLIDER_DRM_CONNECTOR_PROP_COUNT] = {
 	[GLIDER_DRM_CONNECTOR_CRTC_ID] = { "CRTC_ID", true },
+	[GLIDER_DRM_CONNECTOR_EDID] = { "EDID", false },
+	[GLIDER_DRM_CONNECTOR_LINK_STATUS] = { "link-status", false },
+	[GLIDER_DRM_CONNECTOR_VRR_CAPABLE] = { "vrr_capable", false },
 };
 
 const struct glider_drm_prop_spec
 		glider_drm_crtc_props[GLIDER_DRM_CRTC_PROP_COUNT] = {
 	[GLIDER_DRM_CRTC_MODE_ID] = { "MODE_ID", true },
 	[GLIDER_DRM_CRTC_ACTIVE] = { "ACTIVE", true },
+	[GLIDER_DRM_CRTC_OUT_FENCE_PTR] = { "OUT_FENCE_PTR", false },
+	[GLIDER_DRM_CRTC_VRR_ENABLED] = { "VRR_ENABLED", false },
 };
 
 const struct glider_drm_prop_spec
 		glider_drm_plane_props[GLIDER_DRM_PLANE_PROP_COUNT] = {
 	[GLIDER_DRM_PLANE_TYPE] = { "type", true },
 	[GLIDER_DRM_PLANE_IN_FORMATS] = { "IN_FORMATS", false },
+	[GLIDER_DRM_PLANE_ROTATION] = { "rotation", false },
+	[GLIDER_DRM_PLANE_FB_ID] = { "FB_ID", true },
+	[GLIDER_DRM_PLANE_CRTC_ID] = { "CRTC_ID", true },
+	[GLIDER_DRM_PLANE_SRC_X] = { "SRC_X", true },
+	[GLIDER_DRM_PLANE_SRC_Y] = { "SRC_Y", true },
+	[GLIDER_DRM_PLANE_SRC_W] = { "SRC_W", true },
+	[GLIDER_DRM_PLANE_SRC_H] = { "SRC_H", true },
+	[GLIDER_DRM_PLANE_CRTC_X] = { "CRTC_X", true },
+	[GLIDER_DRM_PLANE_CRTC_Y] = { "CRTC_Y", true },
+	[GLIDER_DRM_PLANE_CRTC_W] = { "CRTC_W", true },
+	[GLIDER_DRM_PLANE_CRTC_H] = { "CRTC_H", true },
+	[GLIDER_DRM_PLANE_FB_DAMAGE_CLIPS] = { "FB_DAMAGE_CLIPS", false },
 };
 
-int prop_cmp(const void *_a, const void *_b) {
-	const struct glider_drm_prop_spec *a = _a, *b = _b;
-	return strcmp(a->name, b->name);
+#define PROP_SPECS_CAP 32
+
+/* Spec tables sorted by name, for binary search */
+struct prop_spec_index {
+	const struct glider_drm_prop_spec *specs;
+	size_t len;
+	const struct glider_drm_prop_spec *sorted[PROP_SPECS_CAP];
+};
+
+static struct prop_spec_index prop_spec_indices[] = {
+	{ glider_drm_connector_props, GLIDER_DRM_CONNECTOR_PROP_COUNT },
+	{ glider_drm_crtc_props, GLIDER_DRM_CRTC_PROP_COUNT },
+	{ glider_drm_plane_props, GLIDER_DRM_PLANE_PROP_COUNT },
+};
+
+static int prop_spec_ptr_cmp(const void *_a, const void *_b) {
+	const struct glider_drm_prop_spec *const *a = _a, *const *b = _b;
+	return strcmp((*a)->name, (*b)->name);
+}
+
+void init_drm_prop_specs(void) {
+	size_t n = sizeof(prop_spec_indices) / sizeof(prop_spec_indices[0]);
+	for (size_t i = 0; i < n; i++) {
+		struct prop_spec_index *index = &prop_spec_indices[i];
+		assert(index->len <= PROP_SPECS_CAP);
+		for (size_t j = 0; j < index->len; j++) {
+			index->sorted[j] = &index->specs[j];
+		}
+		qsort(index->sorted, index->len, sizeof(index->sorted[0]),
+			prop_spec_ptr_cmp);
+	}
+}
+
+static const struct glider_drm_prop_spec *find_prop_spec(
+		const struct glider_drm_prop_spec *prop_specs, const char *name) {
+	size_t n = sizeof(prop_spec_indices) / sizeof(prop_spec_indices[0]);
+	const struct prop_spec_index *index = NULL;
+	for (size_t i = 0; i < n; i++) {
+		if (prop_spec_indices[i].specs == prop_specs) {
+			index = &prop_spec_indices[i];
+			break;
+		}
+	}
+	assert(index != NULL);
+
+	struct glider_drm_prop_spec ref_spec = { .name = name };
+	const struct glider_drm_prop_spec *ref = &ref_spec;
+	const struct glider_drm_prop_spec *const *found = bsearch(&ref,
+		index->sorted, index->len, sizeof(index->sorted[0]),
+		prop_spec_ptr_cmp);
+	return found != NULL ? *found : NULL;
+}
+
+bool init_drm_prop_cache(struct glider_drm_device *device) {
+	return glider_hash_table_init(&device->prop_infos);
+}
+
+void finish_drm_prop_cache(struct glider_drm_device *device) {
+	for (size_t i = 0; i < device->prop_infos.buckets_len; i++) {
+		struct glider_drm_prop_info *info, *tmp;
+		wl_list_for_each_safe(info, tmp, &device->prop_infos.buckets[i],
+				entry.link) {
+			glider_hash_table_remove(&device->prop_infos, &info->entry);
+			free(info);
+		}
+	}
+	glider_hash_table_finish(&device->prop_infos);
+}
+
+/* Property metadata is looked up once per device: most properties (e.g.
+ * "type", "CRTC_ID") are shared by all objects of the same kind. */
+const struct glider_drm_prop_info *get_drm_prop_info(
+		struct glider_drm_device *device, uint32_t id) {
+	uint64_t hash = glider_hash_u64(id);
+	struct wl_list *bucket = glider_hash_table_bucket(&device->prop_infos,
+		hash);
+	struct glider_drm_prop_info *info;
+	wl_list_for_each(info, bucket, entry.link) {
+		if (info->id == id) {
+			return info;
+		}
+	}
+
+	device->stats.init_ioctls++;
+	drmModePropertyRes *drm_prop = drmModeGetProperty(device->fd, id);
+	if (drm_prop == NULL) {
+		wlr_log_errno(WLR_ERROR, "drmModeGetProperty failed");
+		return NULL;
+	}
+
+	info = calloc(1, sizeof(*info));
+	if (info == NULL) {
+		drmModeFreeProperty(drm_prop);
+		return NULL;
+	}
+	info->id = id;
+	info->flags = drm_prop->flags;
+	memcpy(info->name, drm_prop->name, sizeof(info->name));
+	info->name[sizeof(info->name) - 1] = '\0';
+	if (drm_prop->flags & DRM_MODE_PROP_BITMASK) {
+		for (int i = 0; i < drm_prop->count_enums; i++) {
+			if (drm_prop->enums[i].value < 64) {
+				info->bitmask |= (uint64_t)1 << drm_prop->enums[i].value;
+			}
+		}
+	}
+	drmModeFreeProperty(drm_prop);
+
+	glider_hash_table_insert(&device->prop_infos, &info->entry, hash);
+	return info;
 }
 
 bool init_drm_props(struct glider_drm_prop *props,
 		const struct glider_drm_prop_spec *prop_specs, size_t props_len,
 		struct glider_drm_device *device, uint32_t obj_id, uint32_t obj_type) {
+	device->stats.init_ioctls++;
 	drmModeObjectProperties *obj_props =
 		drmModeObjectGetProperties(device->fd, obj_id, obj_type);
 	if (obj_props == NULL) {
@@ -39,23 +165,20 @@ bool init_drm_props(struct glider_drm_prop *props,
 		uint32_t id = obj_props->props[i];
 		uint64_t value = obj_props->prop_values[i];
 
-		drmModePropertyRes *drm_prop = drmModeGetProperty(device->fd, id);
-		if (drm_prop == NULL) {
-			wlr_log_errno(WLR_ERROR, "drmModeGetProperty failed");
+		const struct glider_drm_prop_info *info = get_drm_prop_info(device, id);
+		if (info == NULL) {
 			drmModeFreeObjectProperties(obj_props);
 			return false;
 		}
 
-		struct glider_drm_prop_spec ref_spec = { .name = drm_prop->name };
-		const struct glider_drm_prop_spec *spec = lfind(&ref_spec,
-			prop_specs, &props_len, sizeof(prop_specs[0]), prop_cmp);
+		const struct glider_drm_prop_spec *spec =
+			find_prop_spec(prop_specs, info->name);
 		if (spec != NULL) {
 			struct glider_drm_prop *prop = &props[spec - prop_specs];
 			prop->id = id;
+			prop->immutable = info->flags & DRM_MODE_PROP_IMMUTABLE;
 			prop->current = prop->pending = prop->initial = value;
 		}
-
-		drmModeFreeProperty(drm_prop);
 	}
 
 	drmModeFreeObjectProperties(obj_props);
@@ -89,6 +212,23 @@ bool apply_drm_props(struct glider_drm_prop *props, size_t props_len,
 	return true;
 }
 
+bool restore_drm_props(struct glider_drm_prop *props, size_t props_len,
+		uint32_t obj_id, drmModeAtomicReq *req) {
+	for (size_t i = 0; i < props_len; i++) {
+		struct glider_drm_prop *prop = &props[i];
+		if (prop->id == 0 || prop->immutable) {
+			continue;
+		}
+		int ret = drmModeAtomicAddProperty(req, obj_id,
+			prop->id, prop->current);
+		if (ret < 0) {
+			wlr_log(WLR_ERROR, "drmModeAtomicAddProperty failed");
+			return false;
+		}
+	}
+	return true;
+}
+
 void move_drm_prop_values(struct glider_drm_prop *props, size_t props_len,
 		bool commit) {
 	for (size_t i = 0; i < props_len; i++) {
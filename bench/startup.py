@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+# Measure glider's time-to-first-frame on vkms.
+#
+# Usage: startup.py <glider> [runs]
+#
+# Launches glider several times against the vkms devices, reads the startup
+# trace written via GLIDER_STARTUP_TRACE and reports p50/p99 of the first
+# page-flip time. Needs the vkms module loaded and permission to become DRM
+# master (e.g. run from a free VT, or as root with seatd/logind).
+
+import json
+import os
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+SKIP = 77 # meson's "test skipped" exit code
+TIMEOUT = 10
+
+def find_vkms_cards():
+	cards = []
+	for name in sorted(os.listdir("/sys/class/drm")):
+		if not name.startswith("card") or "-" in name:
+			continue
+		driver = os.path.join("/sys/class/drm", name, "device", "driver")
+		if os.path.basename(os.path.realpath(driver)) == "vkms":
+			cards.append(os.path.join("/dev/dri", name))
+	return cards
+
+def run_once(glider, cards, trace_path):
+	env = dict(os.environ)
+	env["WLR_DRM_DEVICES"] = ":".join(cards)
+	env["WLR_LIBINPUT_NO_DEVICES"] = "1"
+	env["GLIDER_STARTUP_TRACE"] = trace_path
+
+	proc = subprocess.Popen([glider], env=env,
+		stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+	try:
+		deadline = time.monotonic() + TIMEOUT
+		while not os.path.exists(trace_path):
+			if proc.poll() is not None:
+				raise RuntimeError("glider exited with status %d" % proc.returncode)
+			if time.monotonic() > deadline:
+				raise RuntimeError("timed out waiting for the first frame")
+			time.sleep(0.01)
+	finally:
+		proc.send_signal(signal.SIGTERM)
+		try:
+			proc.wait(timeout=TIMEOUT)
+		except subprocess.TimeoutExpired:
+			proc.kill()
+			proc.wait()
+
+	with open(trace_path) as f:
+		trace = json.load(f)
+	os.unlink(trace_path)
+	return trace["first_frame_ms"]
+
+def percentile(values, p):
+	values = sorted(values)
+	index = min(len(values) - 1, int(round(p / 100 * (len(values) - 1))))
+	return values[index]
+
+def main():
+	if len(sys.argv) < 2:
+		print("usage: %s <glider> [runs]" % sys.argv[0], file=sys.stderr)
+		return 1
+	glider = sys.argv[1]
+	runs = int(sys.argv[2]) if len(sys.argv) > 2 else 20
+
+	cards = find_vkms_cards()
+	if len(cards) == 0:
+		print("No vkms device found, skipping", file=sys.stderr)
+		return SKIP
+
+	results = []
+	with tempfile.TemporaryDirectory() as tmp_dir:
+		trace_path = os.path.join(tmp_dir, "trace.json")
+		for i in range(runs):
+			try:
+				results.append(run_once(glider, cards, trace_path))
+			except RuntimeError as err:
+				print("Run %d failed: %s" % (i, err), file=sys.stderr)
+				return 1
+
+	print("time-to-first-frame over %d runs on %s: p50 %.1fms, p99 %.1fms" %
+		(runs, ", ".join(cards), percentile(results, 50),
+		percentile(results, 99)))
+	return 0
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -1,10 +1,25 @@
 #include <assert.h>
 #include <gbm.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/util/log.h>
 #include "allocator.h"
 #include "gl_renderer.h"
+#include "trace.h"
+
+static bool has_egl_extension(const char *exts, const char *ext) {
+	size_t ext_len = strlen(ext);
+	while (exts != NULL && *exts != '\0') {
+		size_t len = strcspn(exts, " ");
+		if (len == ext_len && strncmp(exts, ext, len) == 0) {
+			return true;
+		}
+		exts += len;
+		exts += strspn(exts, " ");
+	}
+	return false;
+}
 
 struct glider_gl_renderer *glider_gl_gbm_renderer_create(struct gbm_device *device) {
 	struct glider_gl_renderer *renderer = calloc(1, sizeof(*renderer));
@@ -13,6 +28,7 @@ struct glider_gl_renderer *glider_gl_gbm_renderer_create(struct gbm_device *devi
 	}
 
 	wl_list_init(&renderer->buffers);
+	wl_list_init(&renderer->textures);
 
 	static EGLint config_attribs[] = {
 		EGL_RED_SIZE, 1,
@@ -24,14 +40,32 @@ struct glider_gl_renderer *glider_gl_gbm_renderer_create(struct gbm_device *devi
 
 	// We're not going to allocate buffers with OpenGL, so the format doesn't
 	// matter.
+	glider_trace_begin(GLIDER_TRACE_RENDERER);
 	renderer->renderer = wlr_renderer_autocreate(&renderer->egl,
 		EGL_PLATFORM_GBM_MESA, device,
 		config_attribs, GBM_FORMAT_ARGB8888);
+	glider_trace_end(GLIDER_TRACE_RENDERER);
 	if (renderer->renderer == NULL) {
 		free(renderer);
 		return NULL;
 	}
 
+	const char *exts = eglQueryString(renderer->egl.display, EGL_EXTENSIONS);
+	if (has_egl_extension(exts, "EGL_ANDROID_native_fence_sync")) {
+		renderer->create_sync = (PFNEGLCREATESYNCKHRPROC)
+			eglGetProcAddress("eglCreateSyncKHR");
+		renderer->destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)
+			eglGetProcAddress("eglDestroySyncKHR");
+		renderer->dup_native_fence_fd = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC)
+			eglGetProcAddress("eglDupNativeFenceFDANDROID");
+	}
+	if (renderer->create_sync == NULL || renderer->destroy_sync == NULL ||
+			renderer->dup_native_fence_fd == NULL) {
+		wlr_log(WLR_INFO, "EGL_ANDROID_native_fence_sync not supported, "
+			"falling back to implicit synchronization");
+		renderer->dup_native_fence_fd = NULL;
+	}
+
 	return renderer;
 }
 
@@ -44,12 +78,23 @@ static void renderer_buffer_destroy(struct glider_gl_renderer_buffer *buf) {
 	free(buf);
 }
 
+static void renderer_texture_destroy(struct glider_gl_renderer_texture *tex) {
+	wl_list_remove(&tex->link);
+	wl_list_remove(&tex->destroy.link);
+	wlr_texture_destroy(tex->texture);
+	free(tex);
+}
+
 void glider_gl_renderer_destroy(struct glider_gl_renderer *renderer) {
 	wlr_egl_make_current(&renderer->egl, EGL_NO_SURFACE, NULL);
 	struct glider_gl_renderer_buffer *buf, *buf_tmp;
 	wl_list_for_each_safe(buf, buf_tmp, &renderer->buffers, link) {
 		renderer_buffer_destroy(buf);
 	}
+	struct glider_gl_renderer_texture *tex, *tex_tmp;
+	wl_list_for_each_safe(tex, tex_tmp, &renderer->textures, link) {
+		renderer_texture_destroy(tex);
+	}
 	wlr_renderer_destroy(renderer->renderer);
 	wlr_egl_finish(&renderer->egl);
 	free(renderer);
@@ -164,11 +209,91 @@ bool glider_gl_renderer_begin(struct glider_gl_renderer *renderer,
 	return true;
 }
 
-void glider_gl_renderer_end(struct glider_gl_renderer *renderer) {
-	assert(renderer->current_buffer != NULL);
-	glFlush();
+static void renderer_finish(struct glider_gl_renderer *renderer) {
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	wlr_renderer_end(renderer->renderer);
 	wlr_buffer_unlock(renderer->current_buffer->buffer);
 	renderer->current_buffer = NULL;
 }
+
+void glider_gl_renderer_end(struct glider_gl_renderer *renderer) {
+	assert(renderer->current_buffer != NULL);
+	glFlush();
+	renderer_finish(renderer);
+}
+
+int glider_gl_renderer_end_with_fence(struct glider_gl_renderer *renderer) {
+	assert(renderer->current_buffer != NULL);
+
+	int fence_fd = -1;
+	if (renderer->dup_native_fence_fd != NULL) {
+		EGLDisplay display = renderer->egl.display;
+		EGLSyncKHR sync = renderer->create_sync(display,
+			EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+		if (sync != EGL_NO_SYNC_KHR) {
+			// The fence FD is only available once the fence is flushed
+			glFlush();
+			fence_fd = renderer->dup_native_fence_fd(display, sync);
+			renderer->destroy_sync(display, sync);
+		}
+		if (fence_fd == EGL_NO_NATIVE_FENCE_FD_ANDROID) {
+			wlr_log(WLR_ERROR, "Failed to create EGL native fence");
+			fence_fd = -1;
+		}
+	}
+	if (fence_fd < 0) {
+		glFlush();
+	}
+
+	renderer_finish(renderer);
+	return fence_fd;
+}
+
+static void handle_texture_buffer_destroy(struct wl_listener *listener,
+		void *data) {
+	struct glider_gl_renderer_texture *tex =
+		wl_container_of(listener, tex, destroy);
+	renderer_texture_destroy(tex);
+}
+
+struct glider_gl_renderer_texture *glider_gl_renderer_get_texture(
+		struct glider_gl_renderer *renderer, struct wlr_buffer *buffer) {
+	struct glider_gl_renderer_texture *tex;
+	wl_list_for_each(tex, &renderer->textures, link) {
+		if (tex->buffer == buffer) {
+			return tex;
+		}
+	}
+
+	tex = calloc(1, sizeof(*tex));
+	if (tex == NULL) {
+		return NULL;
+	}
+
+	struct wlr_dmabuf_attributes dmabuf;
+	if (!wlr_buffer_get_dmabuf(buffer, &dmabuf)) {
+		free(tex);
+		return NULL;
+	}
+
+	tex->texture = wlr_texture_from_dmabuf(renderer->renderer, &dmabuf);
+	tex->stride = dmabuf.stride[0];
+	wlr_dmabuf_attributes_finish(&dmabuf);
+	if (tex->texture == NULL) {
+		free(tex);
+		return NULL;
+	}
+
+	tex->buffer = buffer;
+	tex->renderer = renderer;
+
+	tex->destroy.notify = handle_texture_buffer_destroy;
+	wl_signal_add(&buffer->events.destroy, &tex->destroy);
+
+	wl_list_insert(&renderer->textures, &tex->link);
+
+	wlr_log(WLR_DEBUG, "Imported texture for buffer %dx%d",
+		buffer->width, buffer->height);
+
+	return tex;
+}
@@ -0,0 +1,103 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "hash.h"
+
+#define INITIAL_BUCKETS_LEN 16
+
+static struct wl_list *alloc_buckets(size_t len) {
+	struct wl_list *buckets = calloc(len, sizeof(struct wl_list));
+	if (buckets == NULL) {
+		return NULL;
+	}
+	for (size_t i = 0; i < len; i++) {
+		wl_list_init(&buckets[i]);
+	}
+	return buckets;
+}
+
+bool glider_hash_table_init(struct glider_hash_table *table) {
+	table->buckets = alloc_buckets(INITIAL_BUCKETS_LEN);
+	if (table->buckets == NULL) {
+		return false;
+	}
+	table->buckets_len = INITIAL_BUCKETS_LEN;
+	table->len = 0;
+	return true;
+}
+
+void glider_hash_table_finish(struct glider_hash_table *table) {
+	assert(table->len == 0);
+	free(table->buckets);
+	table->buckets = NULL;
+	table->buckets_len = 0;
+}
+
+static void grow(struct glider_hash_table *table) {
+	size_t new_len = table->buckets_len * 2;
+	struct wl_list *new_buckets = alloc_buckets(new_len);
+	if (new_buckets == NULL) {
+		// Not fatal: the table is still correct, chains just get longer
+		return;
+	}
+
+	for (size_t i = 0; i < table->buckets_len; i++) {
+		struct glider_hash_entry *entry, *tmp;
+		wl_list_for_each_safe(entry, tmp, &table->buckets[i], link) {
+			wl_list_remove(&entry->link);
+			wl_list_insert(&new_buckets[entry->hash & (new_len - 1)],
+				&entry->link);
+		}
+	}
+
+	free(table->buckets);
+	table->buckets = new_buckets;
+	table->buckets_len = new_len;
+}
+
+void glider_hash_table_insert(struct glider_hash_table *table,
+		struct glider_hash_entry *entry, uint64_t hash) {
+	if (table->len >= 2 * table->buckets_len) {
+		grow(table);
+	}
+	entry->hash = hash;
+	wl_list_insert(glider_hash_table_bucket(table, hash), &entry->link);
+	table->len++;
+}
+
+void glider_hash_table_remove(struct glider_hash_table *table,
+		struct glider_hash_entry *entry) {
+	assert(table->len > 0);
+	wl_list_remove(&entry->link);
+	table->len--;
+}
+
+struct wl_list *glider_hash_table_bucket(struct glider_hash_table *table,
+		uint64_t hash) {
+	return &table->buckets[hash & (table->buckets_len - 1)];
+}
+
+uint64_t glider_hash_u64(uint64_t value) {
+	// splitmix64 finalizer
+	value ^= value >> 30;
+	value *= 0xBF58476D1CE4E5B9ULL;
+	value ^= value >> 27;
+	value *= 0x94D049BB133111EBULL;
+	value ^= value >> 31;
+	return value;
+}
+
+uint64_t glider_hash_ptr(const void *ptr) {
+	return glider_hash_u64((uintptr_t)ptr);
+}
+
+uint64_t glider_hash_bytes(uint64_t hash, const void *data, size_t size) {
+	if (hash == 0) {
+		hash = 0xCBF29CE484222325ULL;
+	}
+	const uint8_t *bytes = data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
@@ -2,30 +2,51 @@
 #define GLIDER_BACKEND_BACKEND_H
 
 #include <libliftoff.h>
+#include <pixman.h>
+#include <pthread.h>
+#include <sys/types.h>
 #include <time.h>
 #include <wlr/backend/interface.h>
 #include <wlr/interfaces/wlr_output.h>
 #include <wlr/render/drm_format_set.h>
 #include <xf86drmMode.h>
 #include "allocator.h"
+#include "hash.h"
 
 struct glider_drm_backend;
 struct glider_drm_device;
 
 enum glider_drm_connector_prop {
 	GLIDER_DRM_CONNECTOR_CRTC_ID,
+	GLIDER_DRM_CONNECTOR_EDID,
+	GLIDER_DRM_CONNECTOR_LINK_STATUS,
+	GLIDER_DRM_CONNECTOR_VRR_CAPABLE,
 	GLIDER_DRM_CONNECTOR_PROP_COUNT, // keep last
 };
 
 enum glider_drm_crtc_prop {
 	GLIDER_DRM_CRTC_MODE_ID,
 	GLIDER_DRM_CRTC_ACTIVE,
+	GLIDER_DRM_CRTC_OUT_FENCE_PTR,
+	GLIDER_DRM_CRTC_VRR_ENABLED,
 	GLIDER_DRM_CRTC_PROP_COUNT, // keep last
 };
 
 enum glider_drm_plane_prop {
 	GLIDER_DRM_PLANE_TYPE,
 	GLIDER_DRM_PLANE_IN_FORMATS,
+	GLIDER_DRM_PLANE_ROTATION,
+	GLIDER_DRM_PLANE_FB_ID,
+	GLIDER_DRM_PLANE_CRTC_ID,
+	GLIDER_DRM_PLANE_SRC_X,
+	GLIDER_DRM_PLANE_SRC_Y,
+	GLIDER_DRM_PLANE_SRC_W,
+	GLIDER_DRM_PLANE_SRC_H,
+	GLIDER_DRM_PLANE_CRTC_X,
+	GLIDER_DRM_PLANE_CRTC_Y,
+	GLIDER_DRM_PLANE_CRTC_W,
+	GLIDER_DRM_PLANE_CRTC_H,
+	GLIDER_DRM_PLANE_FB_DAMAGE_CLIPS,
 	GLIDER_DRM_PLANE_PROP_COUNT, // keep last
 };
 
@@ -41,36 +62,126 @@ extern const struct glider_drm_prop_spec
 extern const struct glider_drm_prop_spec
 	glider_drm_plane_props[GLIDER_DRM_PLANE_PROP_COUNT];
 
+/* Metadata of a KMS property, cached per device */
+struct glider_drm_prop_info {
+	struct glider_hash_entry entry; // glider_drm_device.prop_infos
+	uint32_t id;
+	uint32_t flags;
+	char name[DRM_PROP_NAME_LEN];
+	uint64_t bitmask; // supported bits, for bitmask properties
+};
+
 struct glider_drm_prop {
 	uint32_t id;
+	bool immutable;
 	uint64_t current, pending, initial;
 };
 
-enum glider_drm_buffer_state {
-	GLIDER_DRM_BUFFER_UNLOCKED,
-	GLIDER_DRM_BUFFER_PENDING, // next commit will submit this buffer
-	GLIDER_DRM_BUFFER_QUEUED, // queued to KMS for display
-	GLIDER_DRM_BUFFER_CURRENT, // current front buffer
+/* Identifies the memory backing a DMA-BUF, regardless of the wlr_buffer
+ * wrapping it. */
+struct glider_drm_fb_key {
+	int32_t width, height;
+	uint32_t format;
+	uint64_t modifier;
+	int n_planes;
+	dev_t dev[WLR_DMABUF_MAX_PLANES];
+	ino_t ino[WLR_DMABUF_MAX_PLANES];
+	uint32_t offset[WLR_DMABUF_MAX_PLANES];
+	uint32_t stride[WLR_DMABUF_MAX_PLANES];
+};
+
+/* Maximum number of unused FBs kept around for re-use, and how long they're
+ * kept: they pin client memory */
+#define GLIDER_DRM_IDLE_FBS_CAP 16
+#define GLIDER_DRM_IDLE_FB_TIMEOUT_MS 1000
+
+/* A KMS framebuffer, shared by all wlr_buffers wrapping the same DMA-BUF. */
+struct glider_drm_fb {
+	struct glider_drm_device *device;
+	struct glider_hash_entry entry; // glider_drm_device.fbs
+	struct glider_drm_fb_key key;
+
+	size_t n_refs;
+	struct wl_list idle_link; // glider_drm_device.idle_fbs, if unreferenced
+	int64_t idle_since_msec; // CLOCK_MONOTONIC
+
+	struct gbm_bo *gbm; // GLIDER_DRM_IMPORT_GBM only
+	uint32_t handles[WLR_DMABUF_MAX_PLANES]; // GLIDER_DRM_IMPORT_PRIME only
+	uint32_t id;
+};
+
+/* A GEM handle imported on the device FD, with the number of FB planes
+ * referencing it. */
+struct glider_drm_gem_handle {
+	struct glider_hash_entry entry; // glider_drm_device.gem_handles
+	uint32_t handle;
+	size_t n_refs;
+};
+
+enum glider_drm_import_mode {
+	GLIDER_DRM_IMPORT_PRIME, // drmPrimeFDToHandle and GEM handle tracking
+	GLIDER_DRM_IMPORT_GBM, // gbm_bo_import
 };
 
 struct glider_drm_buffer {
 	struct glider_drm_device *device;
 	struct wlr_buffer *buffer;
-	struct wl_list link;
+	struct glider_hash_entry entry; // glider_drm_device.buffers
 
-	struct gbm_bo *gbm;
-	uint32_t id;
+	/* Buffers which can't be scanned out are kept in the cache too with a
+	 * NULL FB, so that we don't try to import them again on each commit. A
+	 * rejection is valid until the device formats change. */
+	struct glider_drm_fb *fb;
+	uint32_t formats_seq;
+	uint64_t planes; // planes which can scan-out the buffer
+
+	struct wl_list attachments; // glider_drm_attachment.buffer_link
 
 	struct wl_listener destroy;
 };
 
-/* Each time a buffer is attached to a CRTC, an attachment is created. We need
- * to track where the buffer is attached to properly release it when
- * page-flipping or attaching another buffer. */
+/* A buffer locked in one of the slots of a glider_drm_layer. The slot is free
+ * if buffer is NULL. */
 struct glider_drm_attachment {
-	enum glider_drm_buffer_state state;
+	struct glider_drm_layer *layer;
 	struct glider_drm_buffer *buffer;
-	struct liftoff_layer *layer;
+	struct wl_list buffer_link; // glider_drm_buffer.attachments
+	int in_fence_fd; // signals when the buffer is ready, -1 if implicit sync
+};
+
+/* Buffers attached to a liftoff_layer on a CRTC. A buffer moves from the
+ * pending slot to the queued slot when submitted to KMS, and from the queued
+ * slot to the current slot when the page-flip completes. */
+struct glider_drm_layer {
+	struct glider_drm_crtc *crtc;
+	struct liftoff_layer *layer; // NULL once released
+	struct glider_hash_entry entry; // glider_drm_crtc.layers
+	// glider_drm_crtc.layers_list, or glider_drm_crtc.released_layers
+	struct wl_list link;
+	struct wl_list pending_link; // glider_drm_crtc.pending_layers
+	struct wl_list queued_link; // glider_drm_crtc.queued_layers
+
+	struct glider_drm_attachment pending; // submitted by the next commit
+	struct glider_drm_attachment queued; // queued to KMS for display
+	struct glider_drm_attachment current; // current front buffer
+
+	// DRM_MODE_ROTATE_* and DRM_MODE_REFLECT_* bits, 0 if never set
+	uint32_t rotation;
+
+	// Damage accumulated by the buffers attached since the last page-flip
+	pixman_region32_t pending_damage;
+	bool damage_full; // the whole layer is damaged
+	bool damage_unset; // the damage of the pending buffer isn't set yet
+	uint64_t damage_pixels; // area of pending_damage, UINT64_MAX if full
+	// FB_DAMAGE_CLIPS blob set on the layer, 0 for full damage
+	uint32_t damage_clips;
+	// Last damage blob created for the layer, re-used while the pending
+	// damage is unchanged
+	uint32_t damage_blob;
+	pixman_region32_t damage; // damage of damage_blob
+	uint32_t plane_id; // plane of the last page-flip, 0 if composited
+	// Value of glider_drm_crtc.flip_seq when the layer was released
+	uint64_t release_flip_seq;
 };
 
 struct glider_drm_plane {
@@ -79,25 +190,76 @@ struct glider_drm_plane {
 	drmModePlane *plane;
 	struct glider_drm_prop props[GLIDER_DRM_PLANE_PROP_COUNT];
 	struct wlr_drm_format_set formats;
+	uint64_t rotations; // supported DRM_MODE_ROTATE_* and DRM_MODE_REFLECT_*
+};
+
+/* Maximum number of distinct modifiers in the per-format bitsets */
+#define GLIDER_DRM_MODIFIERS_CAP 64
+
+/* Planes which can scan-out a format/modifier pair. DRM_FORMAT_MOD_INVALID
+ * stands for implicit modifiers. */
+struct glider_drm_format_planes {
+	struct glider_hash_entry entry; // glider_drm_device.format_planes
+	uint32_t format;
+	uint64_t modifier;
+	uint64_t planes; // bitmask of glider_drm_device.planes indices
+};
+
+/* Modifiers a format can be scanned out with, on any plane */
+struct glider_drm_format_modifiers {
+	struct glider_hash_entry entry; // glider_drm_device.format_modifiers
+	uint32_t format;
+	uint64_t modifiers; // bitmask of glider_drm_device.modifiers indices
 };
 
 struct glider_drm_crtc {
 	struct glider_drm_device *device;
 	uint32_t id;
+	struct glider_hash_entry id_entry; // glider_drm_device.crtc_ids
 	drmModeCrtc *crtc;
 	struct glider_drm_prop props[GLIDER_DRM_CRTC_PROP_COUNT];
 
 	struct glider_drm_plane *primary_plane;
-
-	struct glider_drm_attachment *attachments;
-	size_t attachments_cap;
+	size_t overlay_planes; // number of overlay planes usable by this CRTC
+	uint64_t overlays; // bitmask of the overlay planes in planes
+	uint64_t planes; // bitmask of glider_drm_device.planes indices
+
+	struct glider_hash_table layers; // glider_drm_layer.entry
+	struct wl_list layers_list; // glider_drm_layer.link
+	struct wl_list pending_layers; // glider_drm_layer.pending_link
+	struct wl_list queued_layers; // glider_drm_layer.queued_link
+	// Layers whose buffers may still be scanned out, destroyed once a
+	// page-flip submitted after their release completes
+	struct wl_list released_layers; // glider_drm_layer.link
+	uint64_t flip_seq; // number of page-flips submitted
 
 	struct liftoff_output *liftoff_output;
+
+	// FB_DAMAGE_CLIPS blob for layers which didn't change since the last
+	// page-flip, 0 if not created yet
+	uint32_t empty_damage_blob;
+
+	// Signals when the last page-flip is latched, -1 if none was requested
+	int out_fence_fd;
+	struct wl_event_source *out_fence_source;
+
+	bool flip_sync_pending; // part of the last device-wide page-flip
+	// The in-flight page-flip only moves a plane, it doesn't present a frame
+	bool move_flip_pending;
 };
 
 struct glider_drm_mode {
 	struct wlr_output_mode wlr_mode;
 	drmModeModeInfo drm_mode;
+	uint32_t blob_id; // MODE_ID blob, 0 if not created yet
+};
+
+/* Intervals between consecutive page-flips, i.e. the achieved refresh
+ * period */
+struct glider_drm_flip_intervals {
+	uint64_t count;
+	int64_t last_nsec; // timestamp of the last page-flip, 0 if none
+	int64_t sum_nsec, min_nsec, max_nsec;
 };
 
 struct glider_drm_connector {
@@ -111,32 +273,97 @@ struct glider_drm_connector {
 	drmModeConnection connection;
 	uint32_t possible_crtcs;
 	struct glider_drm_crtc *crtc; // NULL if disabled
+	// CRTC reserved by the device-wide assignment, NULL if none
+	struct glider_drm_crtc *assigned_crtc;
 
 	struct glider_drm_mode *modes;
 	size_t modes_len;
+	bool modes_validated; // test-only modesets ran on the first enable
+	bool new_output_pending; // connected, new_output not emitted yet
+
+	bool commit_queued; // waiting for the next device-wide commit
+	bool tearing; // use async page-flips when possible
+	bool async_flip_pending; // the last page-flip didn't wait for vblank
+
+	struct glider_drm_flip_intervals flip_intervals;
+};
+
+struct glider_drm_device_stats {
+	uint64_t fb_hits; // FB found in the cache
+	uint64_t fb_misses; // FB not found in the cache
+	uint64_t fb_rejects; // buffer can't be scanned out
+	uint64_t fb_reuses; // FB shared with another buffer for the same DMA-BUF
+	uint64_t fb_imports; // DMA-BUF imported into KMS
+	uint64_t synced_flips; // device-wide page-flips completed together
+	uint64_t unsynced_flips; // device-wide page-flips which drifted apart
+	uint64_t init_ioctls; // KMS ioctls issued to initialize the device
+	uint64_t in_fences; // buffers submitted with an explicit in-fence
+	uint64_t out_fence_retires; // buffers released by a CRTC out-fence
+	uint64_t async_flips; // page-flips which didn't wait for vblank
+	uint64_t async_fallbacks; // async page-flips rejected by the driver
+	uint64_t damage_blobs; // FB_DAMAGE_CLIPS blobs created
+	uint64_t damage_blob_reuses; // blobs re-used for unchanged damage
+	uint64_t plane_pixels; // pixels of the buffers flipped onto planes
+	uint64_t damaged_pixels; // damaged pixels of those buffers
+};
+
+/* Completion tracking for the last device-wide page-flip. Vblank sequence
+ * numbers are per-CRTC, so timestamps are compared instead. */
+struct glider_drm_flip_sync {
+	size_t expected, received;
+	int64_t min_nsec, max_nsec;
+	int64_t threshold_nsec;
 };
 
 struct glider_drm_device {
 	struct glider_drm_backend *backend;
 	int fd;
+	dev_t devnum;
+
+	pthread_t probe_thread;
+	bool probe_threaded; // probe_thread needs to be joined
+	bool probe_ok;
 	struct wl_event_source *event_source;
 
 	bool cap_addfb2_modifiers;
+	uint64_t cursor_width, cursor_height; // DRM_CAP_CURSOR_{WIDTH,HEIGHT}
+	bool cap_atomic_async_page_flip;
+	enum glider_drm_import_mode import_mode;
 
 	struct gbm_device *gbm;
-	struct wlr_drm_format_set formats; // union of all planes formats
-
-	struct wl_list buffers;
+	// Scan-out format tables, built from the planes IN_FORMATS:
+	// glider_drm_format_planes.entry and glider_drm_format_modifiers.entry
+	struct glider_hash_table format_planes, format_modifiers;
+	uint64_t modifiers[GLIDER_DRM_MODIFIERS_CAP];
+	size_t modifiers_len;
+	uint32_t formats_seq; // incremented each time formats change
+
+	struct glider_hash_table buffers; // glider_drm_buffer.entry
+	// DMA-BUF inodes are unique, FBs can be shared between buffers
+	bool share_fbs;
+	struct glider_hash_table fbs; // glider_drm_fb.entry, if share_fbs
+	struct wl_list idle_fbs; // glider_drm_fb.idle_link, most recent first
+	size_t idle_fbs_len;
+	struct wl_event_source *idle_fbs_timer; // NULL until an FB goes idle
+	struct glider_hash_table gem_handles; // glider_drm_gem_handle.entry
+	struct glider_hash_table prop_infos; // glider_drm_prop_info.entry
 	struct wl_list connectors;
 
 	struct glider_drm_crtc *crtcs;
 	size_t crtcs_len;
+	struct glider_hash_table crtc_ids; // glider_drm_crtc.id_entry
 
 	struct glider_drm_plane *planes;
 	size_t planes_len;
 
 	struct liftoff_device *liftoff_device;
 
+	bool aggregate_commits; // GLIDER_DRM_DEVICE_COMMIT
+	struct wl_event_source *commit_idle;
+	struct glider_drm_flip_sync flip_sync;
+
+	struct glider_drm_device_stats stats;
+
 	struct wl_listener invalidated;
 };
 
@@ -147,6 +374,12 @@ struct glider_drm_backend {
 	struct wlr_session *session;
 	struct glider_drm_device devices[8];
 	size_t devices_len;
+	bool probed; // all devices have been probed successfully
+
+	// Hotplug uevents, NULL if we rely on the session to tell us about them
+	struct udev *udev;
+	struct udev_monitor *udev_monitor;
+	struct wl_event_source *udev_event;
 
 	struct wl_listener display_destroy;
 	struct wl_listener session_destroy;
@@ -156,47 +389,278 @@ struct glider_drm_backend {
 struct wlr_backend *glider_drm_backend_create(struct wl_display *display,
 	struct wlr_session *session);
 int glider_drm_backend_get_render_fd(struct wlr_backend *backend);
+size_t glider_drm_backend_get_devices_len(struct wlr_backend *backend);
+/**
+ * Open a render FD for the device at the given index. The primary device
+ * (index 0) is the one used for rendering.
+ */
+int glider_drm_backend_get_device_render_fd(struct wlr_backend *backend,
+	size_t index);
+/**
+ * Dump the backend statistics counters to the log.
+ */
+void glider_drm_backend_log_stats(struct wlr_backend *backend);
 
 const struct wlr_drm_format_set *glider_drm_connector_get_primary_formats(
 	struct wlr_output *output);
 struct liftoff_output *glider_drm_connector_get_liftoff_output(
 	struct wlr_output *output);
+/**
+ * Check whether the session is active, i.e. whether commits on the output can
+ * succeed. The output gets a frame event when the session is restored.
+ */
+bool glider_drm_connector_is_active(struct wlr_output *output);
+/**
+ * Get the index of the device driving the output.
+ */
+size_t glider_drm_connector_get_device_index(struct wlr_output *output);
 bool glider_drm_connector_attach(struct wlr_output *output,
 	struct wlr_buffer *buffer, struct liftoff_layer *layer);
-
+/**
+ * Set the fence KMS waits on before scanning out the buffer pending on the
+ * layer. Takes ownership of the sync_file FD.
+ */
+bool glider_drm_connector_set_in_fence(struct wlr_output *output,
+	struct liftoff_layer *layer, int fence_fd);
+/**
+ * Allow tearing: when only the FB_ID of the primary plane changes, page-flip
+ * without waiting for vblank. Falls back to vsync if the driver rejects it.
+ */
+void glider_drm_connector_set_tearing(struct wlr_output *output,
+	bool tearing);
+/**
+ * Check whether the output supports variable refresh rate.
+ */
+bool glider_drm_connector_get_vrr_capable(struct wlr_output *output);
+/**
+ * Check whether variable refresh rate is enabled for the next commit: this is
+ * the state of the last successful commit, unless it has been changed since.
+ */
+bool glider_drm_connector_get_vrr(struct wlr_output *output);
+/**
+ * Enable or disable variable refresh rate on the next commit. Returns false
+ * if VRR can't be enabled.
+ */
+bool glider_drm_connector_set_vrr(struct wlr_output *output, bool enabled);
+/**
+ * Get the size of the buffers supported by the cursor planes.
+ */
+void glider_drm_connector_get_cursor_size(struct wlr_output *output,
+	int *width, int *height);
+/**
+ * Move a layer without going through a full commit: only the position of the
+ * plane the layer is displayed on is updated. Returns false if the layer isn't
+ * on a plane or if the commit fails, in which case a full commit is needed.
+ */
+bool glider_drm_connector_move_layer(struct wlr_output *output,
+	struct liftoff_layer *layer, int32_t x, int32_t y);
+/**
+ * Rotate and reflect the buffer displayed on the layer. Returns false if no
+ * plane of the output supports the transform: the layer must be composited
+ * then.
+ */
+bool glider_drm_connector_set_layer_transform(struct wlr_output *output,
+	struct liftoff_layer *layer, enum wl_output_transform transform);
+/**
+ * Set the damage of the buffer pending on the layer, i.e. the region which
+ * changed since the previous buffer, in buffer coordinates. KMS drivers which
+ * copy the buffers use it to transfer only the damaged areas. Must be called
+ * after glider_drm_connector_attach, otherwise a new buffer is damaged whole.
+ */
+void glider_drm_connector_set_layer_damage(struct wlr_output *output,
+	struct liftoff_layer *layer, const pixman_region32_t *damage);
+/**
+ * Compute a signature of the buffers which the next commit will display on
+ * the output layers: size, format, modifier and transform. Returns 0 if the
+ * output is disabled.
+ */
+uint64_t glider_drm_connector_get_layers_signature(struct wlr_output *output);
+/**
+ * Release the buffers attached to a layer. Must be called before the layer is
+ * destroyed.
+ */
+void glider_drm_connector_destroy_layer(struct wlr_output *output,
+	struct liftoff_layer *layer);
+
+/**
+ * Probe the device resources. This doesn't touch the event loop, so that
+ * devices can be probed in parallel on worker threads.
+ */
 bool init_drm_device(struct glider_drm_device *device,
 	struct glider_drm_backend *backend, int fd);
+/**
+ * Start listening to the device events. Must be called from the main thread.
+ */
+bool start_drm_device(struct glider_drm_device *device);
 void finish_drm_device(struct glider_drm_device *device);
 bool refresh_drm_device(struct glider_drm_device *device);
+/**
+ * Handle a hotplug uevent. The connector and property IDs are zero if the
+ * event doesn't carry them.
+ */
+void handle_drm_device_hotplug(struct glider_drm_device *device,
+	uint32_t conn_id, uint32_t prop_id);
+void pause_drm_device(struct glider_drm_device *device);
+bool restore_drm_device(struct glider_drm_device *device);
 
 struct glider_drm_connector *create_drm_connector(
 	struct glider_drm_device *device, uint32_t id);
 void destroy_drm_connector(struct glider_drm_connector *conn);
 bool refresh_drm_connector(struct glider_drm_connector *conn);
+bool refresh_drm_connector_current(struct glider_drm_connector *conn,
+	uint32_t prop_id);
+void announce_drm_connectors(struct glider_drm_device *device);
 void handle_drm_connector_page_flip(struct glider_drm_connector *conn,
 	unsigned seq, struct timespec *t);
+bool apply_drm_connector_props(struct glider_drm_connector *conn,
+	drmModeAtomicReq *req, uint32_t flags);
+/**
+ * Apply or roll back the connector state after an atomic commit.
+ */
+void finish_drm_connector_commit(struct glider_drm_connector *conn,
+	uint32_t flags, bool ok);
+
+void queue_drm_connector_commit(struct glider_drm_connector *conn);
+void flush_drm_device_commit(struct glider_drm_device *device);
+void update_drm_flip_sync(struct glider_drm_crtc *crtc,
+	const struct timespec *t);
 
 bool init_drm_crtc(struct glider_drm_crtc *crtc,
 	struct glider_drm_device *device, uint32_t id);
 void finish_drm_crtc(struct glider_drm_crtc *crtc);
 void handle_drm_crtc_page_flip(struct glider_drm_crtc *crtc,
 	unsigned seq, struct timespec *t);
+/**
+ * Release the replaced buffers as soon as the out-fence of the last page-flip
+ * signals, instead of waiting for the page-flip event.
+ */
+void watch_drm_crtc_out_fence(struct glider_drm_crtc *crtc);
+struct glider_drm_crtc *get_drm_crtc_from_id(struct glider_drm_device *device,
+	uint32_t id);
+/**
+ * Compute the device-wide CRTC assignment of connected connectors, updating
+ * their assigned_crtc. Connectors with an active CRTC keep it. If probing is
+ * not NULL, it's considered connected.
+ */
+void assign_drm_crtcs(struct glider_drm_device *device,
+	struct glider_drm_connector *probing);
+/**
+ * Get the buffers attached to a layer. If create is true, the record is
+ * created if it doesn't exist yet.
+ */
+struct glider_drm_layer *get_drm_layer(struct glider_drm_crtc *crtc,
+	struct liftoff_layer *layer, bool create);
+void destroy_drm_layer(struct glider_drm_layer *layer);
+/**
+ * Detach the layer from its liftoff_layer, which is about to be destroyed.
+ * The buffers KMS may still be scanning out stay locked until the next
+ * page-flip completes.
+ */
+void release_drm_layer(struct glider_drm_layer *layer);
+/**
+ * Add the damage of the buffer pending on the layer. Sets FB_DAMAGE_CLIPS if
+ * a plane of the CRTC supports it.
+ */
+void set_drm_layer_damage(struct glider_drm_layer *layer,
+	const pixman_region32_t *damage);
+/**
+ * Damage the whole buffer pending on the layer, until its damage is set.
+ */
+void reset_drm_layer_damage(struct glider_drm_layer *layer);
+/**
+ * Override the damage of the layers which moved to another plane since the
+ * last page-flip. Must be called after liftoff_output_apply.
+ */
+bool apply_drm_layers_damage(struct glider_drm_crtc *crtc,
+	drmModeAtomicReq *req);
+/**
+ * Update the layers damage after a commit: on a successful page-flip, layers
+ * are marked as unchanged until a new buffer is attached.
+ */
+void finish_drm_layers_damage(struct glider_drm_crtc *crtc, bool flipped);
+void lock_drm_attachment(struct glider_drm_attachment *att,
+	struct glider_drm_buffer *buffer);
+/**
+ * Move the buffer in src to the dst slot, releasing the buffer in dst.
+ */
+void move_drm_attachment(struct glider_drm_attachment *dst,
+	struct glider_drm_attachment *src);
 bool set_drm_crtc_mode(struct glider_drm_crtc *crtc,
-	const struct glider_drm_mode *mode);
+	struct glider_drm_mode *mode);
+/**
+ * Create the MODE_ID blob of the mode if it doesn't exist yet. The blob is
+ * kept until finish_drm_mode_blob is called.
+ */
+bool init_drm_mode_blob(struct glider_drm_device *device,
+	struct glider_drm_mode *mode);
+void finish_drm_mode_blob(struct glider_drm_device *device,
+	struct glider_drm_mode *mode);
 
 bool init_drm_plane(struct glider_drm_plane *plane,
 	struct glider_drm_device *device, uint32_t id);
 void finish_drm_plane(struct glider_drm_plane *plane);
+/**
+ * Build the device scan-out format tables from the formats of its planes.
+ */
+bool init_drm_format_tables(struct glider_drm_device *device);
+void finish_drm_format_tables(struct glider_drm_device *device);
+/**
+ * Get the bitmask of planes which can scan-out a format/modifier pair, 0 if
+ * none can.
+ */
+uint64_t get_drm_format_planes(struct glider_drm_device *device,
+	uint32_t format, uint64_t modifier);
+/**
+ * Check whether a plane past the first 64, which the bitmasks don't cover,
+ * can scan-out a format/modifier pair. If crtc isn't NULL, only its planes
+ * are considered.
+ */
+bool has_drm_format_untracked_plane(struct glider_drm_device *device,
+	struct glider_drm_crtc *crtc, uint32_t format, uint64_t modifier);
+/**
+ * Get the bitmask of indices into glider_drm_device.modifiers which the
+ * format can be scanned out with.
+ */
+uint64_t get_drm_format_modifiers(struct glider_drm_device *device,
+	uint32_t format);
 
 struct glider_drm_buffer *get_or_create_drm_buffer(
 	struct glider_drm_device *device, struct wlr_buffer *buffer);
+void destroy_drm_buffer(struct glider_drm_buffer *buffer);
+/**
+ * Create an XRGB8888 FB backed by a dumb buffer, for test-only commits.
+ * Returns 0 on error.
+ */
+uint32_t create_drm_dumb_fb(struct glider_drm_device *device,
+	uint32_t width, uint32_t height, uint32_t *handle);
+void destroy_drm_dumb_fb(struct glider_drm_device *device, uint32_t fb_id,
+	uint32_t handle);
+bool init_drm_buffers(struct glider_drm_device *device);
+void finish_drm_buffers(struct glider_drm_device *device);
 void unlock_drm_attachment(struct glider_drm_attachment *att);
-
+void reset_drm_attachment_in_fence(struct glider_drm_attachment *att);
+
+/**
+ * Sort the property spec tables. Must be called once before any device is
+ * initialized.
+ */
+void init_drm_prop_specs(void);
+bool init_drm_prop_cache(struct glider_drm_device *device);
+void finish_drm_prop_cache(struct glider_drm_device *device);
+const struct glider_drm_prop_info *get_drm_prop_info(
+	struct glider_drm_device *device, uint32_t id);
 bool init_drm_props(struct glider_drm_prop *props,
 	const struct glider_drm_prop_spec *prop_specs, size_t props_len,
 	struct glider_drm_device *device, uint32_t obj_id, uint32_t obj_type);
 bool apply_drm_props(struct glider_drm_prop *props, size_t props_len,
 	uint32_t obj_id, drmModeAtomicReq *req);
+/**
+ * Add all properties with their current value to the request, regardless of
+ * whether they've changed. Used to restore the state after another DRM master
+ * has messed with it.
+ */
+bool restore_drm_props(struct glider_drm_prop *props, size_t props_len,
+	uint32_t obj_id, drmModeAtomicReq *req);
 void move_drm_prop_values(struct glider_drm_prop *props, size_t props_len,
 	bool commit);
 
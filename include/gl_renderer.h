@@ -22,12 +22,29 @@ struct glider_gl_renderer_buffer {
 	struct wl_listener destroy;
 };
 
+struct glider_gl_renderer_texture {
+	struct wlr_buffer *buffer;
+	struct glider_gl_renderer *renderer;
+	struct wl_list link;
+
+	struct wlr_texture *texture;
+	uint32_t stride;
+
+	struct wl_listener destroy;
+};
+
 struct glider_gl_renderer {
 	struct wlr_renderer *renderer;
 	struct wlr_egl egl;
 
 	struct wl_list buffers;
+	struct wl_list textures;
 	struct glider_gl_renderer_buffer *current_buffer;
+
+	// EGL_ANDROID_native_fence_sync, NULL if unsupported
+	PFNEGLCREATESYNCKHRPROC create_sync;
+	PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+	PFNEGLDUPNATIVEFENCEFDANDROIDPROC dup_native_fence_fd;
 };
 
 struct glider_gl_renderer *glider_gl_gbm_renderer_create(struct gbm_device *device);
@@ -35,5 +52,17 @@ void glider_gl_renderer_destroy(struct glider_gl_renderer *renderer);
 bool glider_gl_renderer_begin(struct glider_gl_renderer *renderer,
 	struct wlr_buffer *buffer);
 void glider_gl_renderer_end(struct glider_gl_renderer *renderer);
+/**
+ * Same as glider_gl_renderer_end, but returns a sync_file FD which signals
+ * when rendering has completed, or -1 if explicit fencing isn't supported.
+ */
+int glider_gl_renderer_end_with_fence(struct glider_gl_renderer *renderer);
+/**
+ * Get a texture sampling from a DMA-BUF buffer. The texture is cached until
+ * the buffer or the renderer is destroyed, so it must not be destroyed by the
+ * caller.
+ */
+struct glider_gl_renderer_texture *glider_gl_renderer_get_texture(
+	struct glider_gl_renderer *renderer, struct wlr_buffer *buffer);
 
 #endif
@@ -0,0 +1,42 @@
+#ifndef GLIDER_HASH_H
+#define GLIDER_HASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wayland-server-core.h>
+
+/* Intrusive chained hash table. Entries embed a struct glider_hash_entry and
+ * are looked up by iterating over the bucket returned by
+ * glider_hash_table_bucket and comparing keys. */
+struct glider_hash_entry {
+	uint64_t hash;
+	struct wl_list link;
+};
+
+struct glider_hash_table {
+	struct wl_list *buckets;
+	size_t buckets_len; // always a power of two
+	size_t len;
+};
+
+bool glider_hash_table_init(struct glider_hash_table *table);
+/**
+ * Release the table. The table must be empty.
+ */
+void glider_hash_table_finish(struct glider_hash_table *table);
+void glider_hash_table_insert(struct glider_hash_table *table,
+	struct glider_hash_entry *entry, uint64_t hash);
+void glider_hash_table_remove(struct glider_hash_table *table,
+	struct glider_hash_entry *entry);
+struct wl_list *glider_hash_table_bucket(struct glider_hash_table *table,
+	uint64_t hash);
+
+uint64_t glider_hash_ptr(const void *ptr);
+uint64_t glider_hash_u64(uint64_t value);
+/**
+ * Feed data into a running FNV-1a hash. Start with seed 0.
+ */
+uint64_t glider_hash_bytes(uint64_t hash, const void *data, size_t size);
+
+#endif
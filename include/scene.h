@@ -0,0 +1,76 @@
+#ifndef GLIDER_SCENE_H
+#define GLIDER_SCENE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <wlr/types/wlr_box.h>
+#include "hash.h"
+
+/* Size of the spatial index grid cells, in pixels */
+#define GLIDER_SCENE_CELL_SIZE 256
+
+/* Stacked rectangles in the output-local coordinate space shared by all
+ * outputs. Nodes are indexed by the grid cells they cover, so that point and
+ * box queries only look at the nodes around them. */
+struct glider_scene {
+	struct glider_hash_table cells; // glider_scene_cell.entry
+	size_t nodes_len;
+	int64_t top_order, bottom_order;
+	uint64_t query_seq;
+};
+
+struct glider_scene_cell;
+
+/* Entry of a node in a grid cell */
+struct glider_scene_node_ref {
+	struct glider_scene_node *node;
+	struct glider_scene_cell *cell;
+	struct wl_list link; // glider_scene_cell.refs
+};
+
+struct glider_scene_node {
+	struct glider_scene *scene;
+	struct wlr_box box; // not indexed if empty
+	int64_t order; // stacking order, higher is above
+	void *data;
+
+	struct glider_scene_node_ref *refs; // one per covered cell
+	size_t refs_len;
+	uint64_t query_seq; // last query which reported the node
+};
+
+bool glider_scene_init(struct glider_scene *scene);
+/**
+ * Release the scene. All nodes must have been finished.
+ */
+void glider_scene_finish(struct glider_scene *scene);
+
+/**
+ * Add a node on top of the scene, with an empty box.
+ */
+void glider_scene_node_init(struct glider_scene_node *node,
+	struct glider_scene *scene, void *data);
+void glider_scene_node_finish(struct glider_scene_node *node);
+/**
+ * Move and resize the node. On failure, the node keeps its previous box.
+ */
+bool glider_scene_node_set_box(struct glider_scene_node *node,
+	const struct wlr_box *box);
+void glider_scene_node_raise_to_top(struct glider_scene_node *node);
+void glider_scene_node_lower_to_bottom(struct glider_scene_node *node);
+
+/**
+ * Get the top-most node containing the point, or NULL.
+ */
+struct glider_scene_node *glider_scene_node_at(struct glider_scene *scene,
+	double x, double y);
+/**
+ * Get the nodes intersecting the box, sorted from bottom to top. The array
+ * must be freed by the caller. Returns the number of nodes, or -1 on error.
+ */
+ssize_t glider_scene_get_nodes_in_box(struct glider_scene *scene,
+	const struct wlr_box *box, struct glider_scene_node ***nodes_ptr);
+
+#endif
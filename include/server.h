@@ -1,27 +1,173 @@
 #ifndef GLIDER_SERVER_H
 #define GLIDER_SERVER_H
 
+#include <pixman.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <wayland-server-core.h>
+#include <wayland-server-protocol.h>
+#include <wlr/types/wlr_box.h>
+#include "scene.h"
+
+#define GLIDER_GPUS_CAP 8
+
+/* Per-device allocator and renderer. Only the primary GPU (index 0) renders
+ * the scene, secondary GPUs are used for scan-out. */
+struct glider_gpu {
+	struct glider_allocator *allocator;
+	struct glider_gl_renderer *renderer;
+};
+
+enum glider_output_render_mode {
+	// Rendered and scanned out on the same GPU
+	GLIDER_OUTPUT_RENDER_DIRECT,
+	// Rendered on the primary GPU into a linear buffer imported by the
+	// secondary GPU for scan-out
+	GLIDER_OUTPUT_RENDER_SHARED,
+	// Rendered on the primary GPU, then copied by the secondary GPU into its
+	// own scan-out buffer
+	GLIDER_OUTPUT_RENDER_COPY,
+};
+
+enum glider_output_vrr_policy {
+	GLIDER_OUTPUT_VRR_OFF,
+	GLIDER_OUTPUT_VRR_ALWAYS,
+	// Only while a fullscreen surface is scanned out directly
+	GLIDER_OUTPUT_VRR_FULLSCREEN,
+};
+
+/* Default time between the end of the composition and the vblank deadline, to
+ * absorb the KMS commit latency and the timer jitter */
+#define GLIDER_OUTPUT_DEFAULT_RENDER_SLACK_NSEC 1000000
+
+/* Number of plane configurations whose test result is remembered */
+#define GLIDER_OUTPUT_TEST_CACHE_CAP 8
+
+/* Number of past compositions whose damage is remembered, for buffer ages up
+ * to GLIDER_OUTPUT_DAMAGE_HISTORY + 1. Must be at least the swap chain
+ * length. */
+#define GLIDER_OUTPUT_DAMAGE_HISTORY 4
+
+/* zpos of the output layers. Surfaces are stacked in-between the background
+ * and the cursor, from GLIDER_OUTPUT_ZPOS_SURFACES upwards. */
+#define GLIDER_OUTPUT_ZPOS_BG 1
+#define GLIDER_OUTPUT_ZPOS_SURFACES 2
+#define GLIDER_OUTPUT_ZPOS_CURSOR INT32_MAX
+
+struct glider_output_stats {
+	uint64_t tests; // test-only commits
+	uint64_t cursor_moves; // frames which only moved the cursor plane
+	uint64_t test_cache_hits; // test-only commits skipped
+	uint64_t scheduled_frames;
+	uint64_t active_vblanks; // vblanks which presented a new frame
+	uint64_t idle_vblanks; // vblanks elapsed while the frame loop was idle
+	uint64_t missed_deadlines; // scheduled frames which missed their vblank
+	uint64_t compositions;
+	uint64_t redrawn_pixels; // pixels redrawn by compositions
+	uint64_t composited_pixels; // pixels covered by compositions
+	uint64_t copies;
+	uint64_t copy_bytes;
+	uint64_t copy_submit_nsec; // CPU time spent submitting copies, not GPU time
+};
 
 struct glider_output {
 	struct glider_server *server;
 	struct wlr_output *output;
 	struct wl_list link; // glider_server.outputs
 
+	struct glider_gpu *gpu; // scan-out GPU
+	enum glider_output_render_mode render_mode;
+
 	struct liftoff_output *liftoff_output;
 
 	struct wlr_buffer *bg_buffer;
 	struct liftoff_layer *bg_layer;
 
-	struct glider_swapchain *swapchain;
+	struct wlr_buffer *cursor_buffer; // NULL if the cursor can't be displayed
+	struct liftoff_layer *cursor_layer;
+
+	struct glider_swapchain *swapchain; // scan-out buffers
+	struct glider_swapchain *render_swapchain; // GLIDER_OUTPUT_RENDER_COPY only
 	struct liftoff_layer *composition_layer;
 
+	// Changes since the last frame. If only the cursor moved, the frame just
+	// updates the cursor plane position.
+	bool content_dirty;
+	bool cursor_dirty;
+
+	// The frame loop stops when nothing changes, frames are requested with
+	// glider_output_request_frame
+	bool needs_frame;
+	// A frame is delayed by the frame timer or its page-flip is in flight
+	bool frame_pending;
+	struct wl_event_source *idle_frame; // wakes up an idle frame loop
+
+	// Damage in buffer coordinates accumulated since the last composition,
+	// and damage of the previous compositions, most recent first
+	pixman_region32_t damage;
+	pixman_region32_t damage_history[GLIDER_OUTPUT_DAMAGE_HISTORY];
+	// Surfaces intersecting the output at the last frame, from bottom to top
+	struct wl_list visible_surfaces; // glider_surface_output.visible_link
+
+	// Layers composited by the last composition
+	uint64_t composited_signature;
+	struct wlr_box composited_cursor; // empty if not composited
+
+	// Signatures of the layer configurations which passed a test-only commit,
+	// most recently used first
+	uint64_t test_cache[GLIDER_OUTPUT_TEST_CACHE_CAP];
+	size_t test_cache_len;
+
+	// Frames are delayed until a deadline before the next vblank, predicted
+	// from the last presentation time and the measured submit time
+	int frame_timer_fd;
+	struct wl_event_source *frame_timer; // NULL if unavailable
+	int64_t last_present_nsec; // 0 if unknown
+	int64_t refresh_nsec;
+	int64_t target_present_nsec; // vblank aimed by the pending frame, or 0
+	int64_t submit_time_nsec; // moving average of the CPU submit time
+	int64_t render_slack_nsec;
+
+	enum glider_output_vrr_policy vrr_policy; // GLIDER_VRR
+	bool vrr_enabled;
+
+	struct glider_output_stats stats;
+
 	struct {
 		struct wl_signal destroy;
 	} events;
 
 	struct wl_listener destroy;
 	struct wl_listener frame;
+	struct wl_listener present;
+};
+
+/* ARGB8888 cursor image, premultiplied */
+struct glider_cursor_image {
+	uint32_t width, height;
+	int32_t hotspot_x, hotspot_y;
+	const uint8_t *pixels;
+};
+
+/* Cursor shared by all pointers. Like surfaces, it's displayed at the same
+ * position on all outputs. */
+struct glider_cursor {
+	double x, y; // output-local coordinates
+	size_t pointers_len; // the cursor is hidden if zero
+
+	struct wlr_xcursor_manager *xcursor_manager;
+	struct glider_cursor_image image;
+	struct wlr_texture *texture; // primary GPU, to composite the cursor
+};
+
+struct glider_pointer {
+	struct glider_server *server;
+	struct wlr_input_device *device;
+
+	struct wl_listener destroy;
+	struct wl_listener motion;
+	struct wl_listener motion_absolute;
+	struct wl_listener button;
 };
 
 struct glider_keyboard {
@@ -35,9 +181,15 @@ struct glider_keyboard {
 struct glider_server {
 	struct wl_display *display;
 	struct wlr_backend *backend;
-	struct glider_allocator *allocator;
-	struct glider_gl_renderer *renderer;
+	struct wlr_backend *drm_backend;
+	struct glider_gpu gpus[GLIDER_GPUS_CAP];
+	size_t gpus_len;
+	struct glider_allocator *allocator; // primary GPU allocator
+	struct glider_gl_renderer *renderer; // primary GPU renderer
 	struct wlr_xdg_shell *xdg_shell;
+	struct glider_tearing_control_manager *tearing_control;
+	struct glider_cursor cursor;
+	struct glider_scene scene; // glider_surface.node
 
 	struct wl_list outputs; // glider_output.link
 	struct wl_list surfaces; // glider_surface.link
@@ -49,11 +201,37 @@ struct glider_server {
 
 void handle_new_output(struct wl_listener *listener, void *data);
 void handle_new_input(struct wl_listener *listener, void *data);
+bool glider_cursor_init(struct glider_server *server);
+void glider_cursor_finish(struct glider_server *server);
 void handle_new_xdg_surface(struct wl_listener *listener, void *data);
+/**
+ * Dump the per-output statistics counters to the log.
+ */
+void glider_output_log_stats(struct glider_server *server);
+/**
+ * Request a new frame on the output. If the frame loop is idle, it's woken
+ * up. Requests are coalesced until the frame is rendered.
+ */
+void glider_output_request_frame(struct glider_output *output);
 
 struct wlr_buffer;
 
 bool glider_output_attach_buffer(struct glider_output *output,
 	struct wlr_buffer *buf, struct liftoff_layer *layer);
+/**
+ * Add damage to the output, in output-local coordinates.
+ */
+void glider_output_add_damage(struct glider_output *output,
+	pixman_region32_t *damage);
+void glider_output_add_damage_box(struct glider_output *output,
+	const struct wlr_box *box);
+struct glider_surface_output;
+/**
+ * Attach the current buffer of a surface at its scene position, applying the
+ * inverse of its buffer transform and the output transform. Does nothing if
+ * the surface isn't visible on the output. The layer is composited if no
+ * plane can apply the transform.
+ */
+void glider_output_attach_surface(struct glider_surface_output *so);
 
 #endif
@@ -2,6 +2,7 @@
 #define GLIDER_SURFACE_H
 
 #include <wlr/types/wlr_surface.h>
+#include "scene.h"
 
 struct glider_surface_output {
 	struct glider_output *output;
@@ -9,6 +10,10 @@ struct glider_surface_output {
 	struct liftoff_layer *layer;
 	struct wl_list link; // glider_surface.outputs
 
+	bool visible; // intersects the output, the layer is enabled
+	struct wl_list visible_link; // glider_output.visible_surfaces
+	int32_t zpos;
+
 	struct wl_listener destroy;
 };
 
@@ -20,6 +25,8 @@ struct glider_surface {
 	// frame callbacks are sync'ed to this output
 	struct glider_output *primary_output;
 	struct wl_list outputs; // glider_surface_output.link
+	// Position and size at the last commit, in output-local coordinates
+	struct glider_scene_node node;
 
 	struct wl_listener destroy;
 	struct wl_listener commit;
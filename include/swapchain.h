@@ -10,6 +10,9 @@
 struct glider_swapchain_slot {
 	struct wlr_buffer *buffer;
 	bool acquired; // waiting for release
+	// Number of frames since the buffer contents were last updated, 0 if
+	// unknown
+	int age;
 
 	struct wl_listener release;
 };
@@ -33,10 +36,17 @@ void glider_swapchain_destroy(struct glider_swapchain *swapchain);
  * Acquire a buffer from the swap chain.
  *
  * The returned buffer is locked. When the caller is done with it, they must
- * unlock it.
+ * unlock it. If age isn't NULL, it's set to the buffer age: the contents
+ * are those of age frames ago, or undefined if the age is zero.
  */
 struct wlr_buffer *glider_swapchain_acquire(
-	struct glider_swapchain *swapchain);
+	struct glider_swapchain *swapchain, int *age);
+/**
+ * Mark the buffer as holding the latest frame. The age of the other buffers
+ * of the swap chain is incremented.
+ */
+void glider_swapchain_set_buffer_submitted(struct glider_swapchain *swapchain,
+	struct wlr_buffer *buffer);
 bool glider_swapchain_resize(struct glider_swapchain *swapchain,
 	int width, int height);
 
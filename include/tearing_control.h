@@ -0,0 +1,38 @@
+#ifndef GLIDER_TEARING_CONTROL_H
+#define GLIDER_TEARING_CONTROL_H
+
+#include <stdbool.h>
+#include <wayland-server-core.h>
+
+struct wlr_surface;
+
+/* wp_tearing_control_v1: lets clients ask for their surface to be presented
+ * without waiting for vblank. */
+struct glider_tearing_control_manager {
+	struct wl_global *global;
+	struct wl_list controls; // glider_tearing_control.link
+
+	struct wl_listener display_destroy;
+};
+
+struct glider_tearing_control {
+	struct wl_resource *resource;
+	struct wlr_surface *surface;
+	struct wl_list link; // glider_tearing_control_manager.controls
+
+	bool pending_async, current_async;
+
+	struct wl_listener surface_commit;
+	struct wl_listener surface_destroy;
+};
+
+struct glider_tearing_control_manager *glider_tearing_control_manager_create(
+	struct wl_display *display);
+/**
+ * Check whether the client asked for async presentation of the surface.
+ */
+bool glider_tearing_control_manager_wants_async(
+	struct glider_tearing_control_manager *manager,
+	struct wlr_surface *surface);
+
+#endif
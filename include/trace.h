@@ -0,0 +1,31 @@
+#ifndef GLIDER_TRACE_H
+#define GLIDER_TRACE_H
+
+/* Startup phases. Phases may run several times (e.g. once per device, maybe
+ * in parallel): the recorded span goes from the earliest begin to the latest
+ * end. Recording stops at the first page-flip. */
+enum glider_trace_phase {
+	GLIDER_TRACE_SESSION,
+	GLIDER_TRACE_DRM_PROBE,
+	GLIDER_TRACE_DRM_RESOURCES,
+	GLIDER_TRACE_RENDERER,
+	GLIDER_TRACE_DRM_WAIT,
+	GLIDER_TRACE_MODESET,
+	GLIDER_TRACE_OUTPUT_TEST,
+	GLIDER_TRACE_FIRST_FRAME,
+	GLIDER_TRACE_PHASE_COUNT, // keep last
+};
+
+/**
+ * Start the trace clock. Should be called as early as possible.
+ */
+void glider_trace_init(void);
+void glider_trace_begin(enum glider_trace_phase phase);
+void glider_trace_end(enum glider_trace_phase phase);
+/**
+ * Record the first page-flip, then log the trace and write it as JSON to the
+ * path in the GLIDER_STARTUP_TRACE environment variable, if set.
+ */
+void glider_trace_first_frame(void);
+
+#endif
@@ -1,8 +1,184 @@
 #include <stdlib.h>
+#include <wlr/render/wlr_renderer.h>
+#include <wlr/render/wlr_texture.h>
 #include <wlr/types/wlr_input_device.h>
+#include <wlr/types/wlr_output.h>
+#include <wlr/types/wlr_pointer.h>
+#include <wlr/types/wlr_xcursor_manager.h>
 #include <wlr/util/log.h>
+#include "gl_renderer.h"
 #include "server.h"
 
+#define FALLBACK_CURSOR_SIZE 16
+
+static uint32_t fallback_cursor_pixels[
+	FALLBACK_CURSOR_SIZE * FALLBACK_CURSOR_SIZE];
+
+/* Used when no cursor theme is installed: a white square with a black
+ * border. */
+static void init_fallback_cursor_image(struct glider_cursor_image *image) {
+	for (size_t y = 0; y < FALLBACK_CURSOR_SIZE; y++) {
+		for (size_t x = 0; x < FALLBACK_CURSOR_SIZE; x++) {
+			bool border = x == 0 || y == 0 ||
+				x == FALLBACK_CURSOR_SIZE - 1 || y == FALLBACK_CURSOR_SIZE - 1;
+			fallback_cursor_pixels[y * FALLBACK_CURSOR_SIZE + x] =
+				border ? 0xFF000000 : 0xFFFFFFFF;
+		}
+	}
+	*image = (struct glider_cursor_image){
+		.width = FALLBACK_CURSOR_SIZE,
+		.height = FALLBACK_CURSOR_SIZE,
+		.pixels = (const uint8_t *)fallback_cursor_pixels,
+	};
+}
+
+bool glider_cursor_init(struct glider_server *server) {
+	struct glider_cursor *cursor = &server->cursor;
+
+	cursor->xcursor_manager = wlr_xcursor_manager_create(NULL, 24);
+	struct wlr_xcursor *xcursor = NULL;
+	if (cursor->xcursor_manager != NULL &&
+			wlr_xcursor_manager_load(cursor->xcursor_manager, 1)) {
+		xcursor = wlr_xcursor_manager_get_xcursor(cursor->xcursor_manager,
+			"left_ptr", 1);
+	}
+	if (xcursor != NULL) {
+		struct wlr_xcursor_image *image = xcursor->images[0];
+		cursor->image = (struct glider_cursor_image){
+			.width = image->width,
+			.height = image->height,
+			.hotspot_x = image->hotspot_x,
+			.hotspot_y = image->hotspot_y,
+			.pixels = image->buffer,
+		};
+	} else {
+		wlr_log(WLR_INFO, "Failed to load cursor theme, using fallback "
+			"cursor image");
+		init_fallback_cursor_image(&cursor->image);
+	}
+
+	cursor->texture = wlr_texture_from_pixels(server->renderer->renderer,
+		WL_SHM_FORMAT_ARGB8888, cursor->image.width * 4, cursor->image.width,
+		cursor->image.height, cursor->image.pixels);
+	if (cursor->texture == NULL) {
+		wlr_log(WLR_ERROR, "Failed to create cursor texture");
+		glider_cursor_finish(server);
+		return false;
+	}
+	return true;
+}
+
+void glider_cursor_finish(struct glider_server *server) {
+	struct glider_cursor *cursor = &server->cursor;
+	if (cursor->texture != NULL) {
+		wlr_texture_destroy(cursor->texture);
+		cursor->texture = NULL;
+	}
+	if (cursor->xcursor_manager != NULL) {
+		wlr_xcursor_manager_destroy(cursor->xcursor_manager);
+		cursor->xcursor_manager = NULL;
+	}
+}
+
+/* Mark the cursor as moved on all outputs. Updates are coalesced until the
+ * next frame, so at most one plane update is committed per vblank. */
+static void cursor_update(struct glider_server *server, bool visibility) {
+	struct glider_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		output->cursor_dirty = true;
+		if (visibility) {
+			// The cursor layer appears or disappears, the plane allocation
+			// needs to be updated
+			output->content_dirty = true;
+		}
+		glider_output_request_frame(output);
+	}
+}
+
+static void cursor_get_bounds(struct glider_server *server,
+		int *width, int *height) {
+	*width = *height = 0;
+	struct glider_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		int w, h;
+		wlr_output_transformed_resolution(output->output, &w, &h);
+		if (w > *width) {
+			*width = w;
+		}
+		if (h > *height) {
+			*height = h;
+		}
+	}
+}
+
+static void cursor_warp(struct glider_server *server, double x, double y) {
+	int width, height;
+	cursor_get_bounds(server, &width, &height);
+	if (x > width - 1) {
+		x = width - 1;
+	}
+	if (y > height - 1) {
+		y = height - 1;
+	}
+	server->cursor.x = x < 0 ? 0 : x;
+	server->cursor.y = y < 0 ? 0 : y;
+	cursor_update(server, false);
+}
+
+static void pointer_handle_destroy(struct wl_listener *listener, void *data) {
+	struct glider_pointer *pointer =
+		wl_container_of(listener, pointer, destroy);
+	pointer->server->cursor.pointers_len--;
+	cursor_update(pointer->server, true);
+	wl_list_remove(&pointer->destroy.link);
+	wl_list_remove(&pointer->motion.link);
+	wl_list_remove(&pointer->motion_absolute.link);
+	wl_list_remove(&pointer->button.link);
+	free(pointer);
+}
+
+static void pointer_handle_motion(struct wl_listener *listener, void *data) {
+	struct glider_pointer *pointer = wl_container_of(listener, pointer, motion);
+	struct wlr_event_pointer_motion *event = data;
+	struct glider_cursor *cursor = &pointer->server->cursor;
+	cursor_warp(pointer->server, cursor->x + event->delta_x,
+		cursor->y + event->delta_y);
+}
+
+static void pointer_handle_motion_absolute(struct wl_listener *listener,
+		void *data) {
+	struct glider_pointer *pointer =
+		wl_container_of(listener, pointer, motion_absolute);
+	struct wlr_event_pointer_motion_absolute *event = data;
+	int width, height;
+	cursor_get_bounds(pointer->server, &width, &height);
+	cursor_warp(pointer->server, event->x * width, event->y * height);
+}
+
+/* Raise the surface under the cursor when a button is pressed. */
+static void pointer_handle_button(struct wl_listener *listener, void *data) {
+	struct glider_pointer *pointer = wl_container_of(listener, pointer, button);
+	struct wlr_event_pointer_button *event = data;
+	struct glider_server *server = pointer->server;
+	if (event->state != WLR_BUTTON_PRESSED) {
+		return;
+	}
+
+	struct glider_scene_node *node = glider_scene_node_at(&server->scene,
+		server->cursor.x, server->cursor.y);
+	if (node == NULL || node->order == server->scene.top_order) {
+		return;
+	}
+	glider_scene_node_raise_to_top(node);
+
+	struct glider_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		output->content_dirty = true;
+		glider_output_add_damage_box(output, &node->box);
+		glider_output_request_frame(output);
+	}
+}
+
 static void keyboard_handle_destroy(struct wl_listener *listener, void *data) {
 	struct glider_keyboard *keyboard =
 		wl_container_of(listener, keyboard, destroy);
@@ -36,6 +212,29 @@ void handle_new_input(struct wl_listener *listener, void *data) {
 		keyboard->key.notify = keyboard_handle_key;
 		wl_signal_add(&keyboard->keyboard->events.key, &keyboard->key);
 		break;
+	case WLR_INPUT_DEVICE_POINTER:;
+		wlr_log(WLR_DEBUG, "New pointer '%s'", dev->name);
+
+		struct glider_pointer *pointer = calloc(1, sizeof(*pointer));
+		pointer->device = dev;
+		pointer->server = server;
+
+		pointer->destroy.notify = pointer_handle_destroy;
+		wl_signal_add(&dev->events.destroy, &pointer->destroy);
+
+		pointer->motion.notify = pointer_handle_motion;
+		wl_signal_add(&dev->pointer->events.motion, &pointer->motion);
+
+		pointer->motion_absolute.notify = pointer_handle_motion_absolute;
+		wl_signal_add(&dev->pointer->events.motion_absolute,
+			&pointer->motion_absolute);
+
+		pointer->button.notify = pointer_handle_button;
+		wl_signal_add(&dev->pointer->events.button, &pointer->button);
+
+		server->cursor.pointers_len++;
+		cursor_update(server, true);
+		break;
 	default:
 		wlr_log(WLR_DEBUG, "Unhandled input device '%s'", dev->name);
 		break;
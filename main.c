@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <signal.h>
 #include <unistd.h>
 #include <wlr/util/log.h>
 #include <wlr/backend/multi.h>
@@ -9,6 +10,8 @@
 #include "backend/backend.h"
 #include "gl_renderer.h"
 #include "server.h"
+#include "tearing_control.h"
+#include "trace.h"
 
 static enum wlr_log_importance log_importance_liftoff_to_wlr(
 		enum liftoff_log_importance importance) {
@@ -32,11 +35,45 @@ static void handle_liftoff_log(enum liftoff_log_importance importance,
 	_wlr_vlog(log_importance_liftoff_to_wlr(importance), wlr_fmt, args);
 }
 
+static int handle_sigusr1(int signal, void *data) {
+	struct glider_server *server = data;
+	glider_drm_backend_log_stats(server->drm_backend);
+	glider_output_log_stats(server);
+	return 0;
+}
+
+static bool init_gpu(struct glider_gpu *gpu, struct wlr_backend *drm_backend,
+		size_t index) {
+	int fd = glider_drm_backend_get_device_render_fd(drm_backend, index);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct glider_gbm_allocator *gbm_allocator =
+		glider_gbm_allocator_create(fd);
+	if (gbm_allocator == NULL) {
+		close(fd);
+		return false;
+	}
+	gpu->allocator = &gbm_allocator->base;
+
+	gpu->renderer = glider_gl_gbm_renderer_create(gbm_allocator->gbm_device);
+	if (gpu->renderer == NULL) {
+		wlr_log(WLR_ERROR, "Failed to create renderer for DRM device %zu",
+			index);
+		return false;
+	}
+
+	return true;
+}
+
 int main(int argc, char *argv[]) {
 	struct glider_server server = {0};
 	wl_list_init(&server.outputs);
 	wl_list_init(&server.surfaces);
 
+	glider_trace_init();
+
 	wlr_log_init(WLR_DEBUG, NULL);
 	liftoff_log_init(LIFTOFF_DEBUG, handle_liftoff_log);
 
@@ -53,13 +90,31 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if (!glider_scene_init(&server.scene)) {
+		wlr_log(WLR_ERROR, "Failed to create scene");
+		return 1;
+	}
+
 	server.display = wl_display_create();
 	if (server.display == NULL) {
 		wlr_log(WLR_ERROR, "wl_display_create failed");
 		return 1;
 	}
 
+	// Publish the socket early: clients can connect while the GPUs are being
+	// probed, they'll be served once the event loop runs
+	const char *socket = wl_display_add_socket_auto(server.display);
+	if (socket == NULL) {
+		wlr_log(WLR_ERROR, "wl_display_add_socket_auto failed");
+		return 1;
+	}
+	setenv("WAYLAND_DISPLAY", socket, true);
+	wlr_log(WLR_INFO, "Running Wayland compositor on WAYLAND_DISPLAY=%s",
+		socket);
+
+	glider_trace_begin(GLIDER_TRACE_SESSION);
 	struct wlr_session *session = wlr_session_create(server.display);
+	glider_trace_end(GLIDER_TRACE_SESSION);
 	if (session == NULL) {
 		return 1;
 	}
@@ -72,6 +127,7 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 	wlr_multi_backend_add(server.backend, drm_backend);
+	server.drm_backend = drm_backend;
 
 	struct wlr_backend *libinput_backend =
 		wlr_libinput_backend_create(server.display, session);
@@ -80,24 +136,22 @@ int main(int argc, char *argv[]) {
 	}
 	wlr_multi_backend_add(server.backend, libinput_backend);
 
-	// TODO: multi-GPU
-	int fd = glider_drm_backend_get_render_fd(drm_backend);
-	if (fd < 0) {
-		return 1;
-	}
-
-	struct glider_gbm_allocator *gbm_allocator =
-		glider_gbm_allocator_create(fd);
-	if (gbm_allocator == NULL) {
-		return 1;
+	// The DRM devices are being probed on worker threads, initialize the
+	// renderers in the meantime. The first device renders, the others only
+	// get an allocator and a renderer to copy the composited frames into
+	// their scan-out buffers.
+	size_t devices_len = glider_drm_backend_get_devices_len(drm_backend);
+	if (devices_len > GLIDER_GPUS_CAP) {
+		devices_len = GLIDER_GPUS_CAP;
 	}
-	server.allocator = &gbm_allocator->base;
-
-	server.renderer =
-		glider_gl_gbm_renderer_create(gbm_allocator->gbm_device);
-	if (server.renderer == NULL) {
-		return 1;
+	for (size_t i = 0; i < devices_len; i++) {
+		if (!init_gpu(&server.gpus[i], drm_backend, i) && i == 0) {
+			return 1;
+		}
+		server.gpus_len++;
 	}
+	server.allocator = server.gpus[0].allocator;
+	server.renderer = server.gpus[0].renderer;
 
 	wlr_renderer_init_wl_display(server.renderer->renderer, server.display);
 
@@ -105,6 +159,18 @@ int main(int argc, char *argv[]) {
 
 	server.xdg_shell = wlr_xdg_shell_create(server.display);
 
+	server.tearing_control =
+		glider_tearing_control_manager_create(server.display);
+	if (server.tearing_control == NULL) {
+		wlr_log(WLR_ERROR, "Failed to create tearing control manager");
+		return 1;
+	}
+
+	if (!glider_cursor_init(&server)) {
+		wlr_log(WLR_ERROR, "Failed to initialize cursor, it won't be "
+			"displayed");
+	}
+
 	server.new_output.notify = handle_new_output;
 	wl_signal_add(&server.backend->events.new_output, &server.new_output);
 
@@ -115,31 +181,53 @@ int main(int argc, char *argv[]) {
 	wl_signal_add(&server.xdg_shell->events.new_surface,
 		&server.new_xdg_surface);
 
-	if (!wlr_backend_start(server.backend)) {
-		return 1;
-	}
-
-	const char *socket = wl_display_add_socket_auto(server.display);
-	setenv("WAYLAND_DISPLAY", socket, true);
-	wlr_log(WLR_INFO, "Running Wayland compositor on WAYLAND_DISPLAY=%s",
-		socket);
-
 	if (startup_cmd) {
 		wlr_log(WLR_DEBUG, "Running startup command: %s", startup_cmd);
 		pid_t pid = fork();
 		if (pid < 0) {
 			wlr_log_errno(WLR_ERROR, "fork failed");
 		} else if (pid == 0) {
+			// The event loop blocks the signals it handles
+			sigset_t set;
+			sigemptyset(&set);
+			sigprocmask(SIG_SETMASK, &set, NULL);
 			execl("/bin/sh", "/bin/sh", "-c", startup_cmd, (void *)NULL);
 			wlr_log_errno(WLR_ERROR, "execl failed");
 		}
 	}
 
+	// Waits for the DRM devices to be probed, then brings up the outputs
+	if (!wlr_backend_start(server.backend)) {
+		return 1;
+	}
+
+	// Statistics counters can be dumped to the log with SIGUSR1
+	struct wl_event_loop *event_loop =
+		wl_display_get_event_loop(server.display);
+	struct wl_event_source *sigusr1_source = wl_event_loop_add_signal(
+		event_loop, SIGUSR1, handle_sigusr1, &server);
+	if (sigusr1_source == NULL) {
+		wlr_log(WLR_ERROR, "Failed to install SIGUSR1 handler");
+	}
+
 	wl_display_run(server.display);
 
-	glider_gl_renderer_destroy(server.renderer);
+	if (sigusr1_source != NULL) {
+		wl_event_source_remove(sigusr1_source);
+	}
+	glider_cursor_finish(&server);
+	for (size_t i = 0; i < server.gpus_len; i++) {
+		if (server.gpus[i].renderer != NULL) {
+			glider_gl_renderer_destroy(server.gpus[i].renderer);
+		}
+	}
 	wl_display_destroy_clients(server.display);
 	wl_display_destroy(server.display);
-	glider_allocator_destroy(server.allocator);
+	glider_scene_finish(&server.scene);
+	for (size_t i = 0; i < server.gpus_len; i++) {
+		if (server.gpus[i].allocator != NULL) {
+			glider_allocator_destroy(server.gpus[i].allocator);
+		}
+	}
 	return 0;
 }
@@ -1,41 +1,69 @@
 #include <assert.h>
 #include <drm_fourcc.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
 #include <wlr/render/wlr_renderer.h>
+#include <wlr/render/wlr_texture.h>
 #include <wlr/types/wlr_output.h>
+#include <wlr/types/wlr_box.h>
 #include <wlr/types/wlr_buffer.h>
+#include <wlr/types/wlr_matrix.h>
 #include <wlr/util/log.h>
+#include <wlr/util/region.h>
 #include "allocator.h"
 #include "backend/backend.h"
 #include "gl_renderer.h"
 #include "server.h"
 #include "swapchain.h"
 #include "surface.h"
+#include "tearing_control.h"
+#include "trace.h"
+
+static struct glider_gpu *output_get_scanout_render_gpu(
+		struct glider_output *output) {
+	if (output->render_mode == GLIDER_OUTPUT_RENDER_COPY) {
+		return output->gpu;
+	}
+	return &output->server->gpus[0];
+}
 
 static bool output_render_bg(struct glider_output *output,
 		struct wlr_buffer *buf) {
-	struct glider_server *server = output->server;
+	struct glider_gl_renderer *renderer =
+		output_get_scanout_render_gpu(output)->renderer;
 
-	if (!glider_gl_renderer_begin(server->renderer, buf)) {
+	if (!glider_gl_renderer_begin(renderer, buf)) {
 		wlr_log(WLR_ERROR, "Failed to start rendering on buffer");
 		return false;
 	}
-	wlr_renderer_clear(server->renderer->renderer,
+	wlr_renderer_clear(renderer->renderer,
 		(float[4]){ 1.0, 0.0, 0.0, 1.0 });
-	glider_gl_renderer_end(server->renderer);
+	glider_gl_renderer_end(renderer);
 	return true;
 }
 
+static bool output_cursor_visible(struct glider_output *output) {
+	return output->cursor_buffer != NULL &&
+		output->server->cursor.pointers_len > 0;
+}
+
 static bool output_needs_render(struct glider_output *output) {
 	if (liftoff_layer_get_plane_id(output->bg_layer) == 0) {
 		return true;
 	}
+	if (output_cursor_visible(output) &&
+			liftoff_layer_get_plane_id(output->cursor_layer) == 0) {
+		return true;
+	}
 
-	struct glider_surface *surface;
-	wl_list_for_each(surface, &output->server->surfaces, link) {
-		struct glider_surface_output *so =
-			glider_surface_get_output(surface, output);
-		if (so != NULL && liftoff_layer_get_plane_id(so->layer) == 0) {
+	struct glider_surface_output *so;
+	wl_list_for_each(so, &output->visible_surfaces, visible_link) {
+		if (liftoff_layer_get_plane_id(so->layer) == 0) {
 			return true;
 		}
 	}
@@ -43,48 +71,285 @@ static bool output_needs_render(struct glider_output *output) {
 	return false;
 }
 
-static bool output_render(struct glider_output *output,
-		struct wlr_buffer *buf) {
-	struct glider_server *server = output->server;
+static struct wlr_box output_get_cursor_box(struct glider_output *output) {
+	struct glider_cursor *cursor = &output->server->cursor;
+	return (struct wlr_box){
+		.x = cursor->x - cursor->image.hotspot_x,
+		.y = cursor->y - cursor->image.hotspot_y,
+		.width = cursor->image.width,
+		.height = cursor->image.height,
+	};
+}
 
-	wlr_log(WLR_DEBUG, "Rendering output");
+void glider_output_add_damage(struct glider_output *output,
+		pixman_region32_t *damage) {
+	int width, height;
+	wlr_output_transformed_resolution(output->output, &width, &height);
 
-	if (!glider_gl_renderer_begin(server->renderer, buf)) {
-		wlr_log(WLR_ERROR, "Failed to start rendering on buffer");
-		return false;
+	pixman_region32_t buffer_damage;
+	pixman_region32_init(&buffer_damage);
+	wlr_region_transform(&buffer_damage, damage,
+		wlr_output_transform_invert(output->output->transform),
+		width, height);
+	pixman_region32_intersect_rect(&buffer_damage, &buffer_damage, 0, 0,
+		output->output->width, output->output->height);
+	pixman_region32_union(&output->damage, &output->damage, &buffer_damage);
+	pixman_region32_fini(&buffer_damage);
+}
+
+void glider_output_add_damage_box(struct glider_output *output,
+		const struct wlr_box *box) {
+	if (box->width <= 0 || box->height <= 0) {
+		return;
+	}
+	pixman_region32_t damage;
+	pixman_region32_init_rect(&damage, box->x, box->y,
+		box->width, box->height);
+	glider_output_add_damage(output, &damage);
+	pixman_region32_fini(&damage);
+}
+
+static void output_damage_whole(struct glider_output *output) {
+	pixman_region32_union_rect(&output->damage, &output->damage, 0, 0,
+		output->output->width, output->output->height);
+}
+
+/* Layers moving between planes and the composition buffer need to be redrawn
+ * or uncovered. Uses the plane allocation of the last commit. */
+static uint64_t output_get_composited_signature(struct glider_output *output) {
+	bool bg_composited = liftoff_layer_get_plane_id(output->bg_layer) == 0;
+	uint64_t hash = glider_hash_bytes(0, &bg_composited, sizeof(bg_composited));
+	struct glider_surface_output *so;
+	wl_list_for_each(so, &output->visible_surfaces, visible_link) {
+		if (liftoff_layer_get_plane_id(so->layer) == 0) {
+			hash = glider_hash_bytes(hash, &so, sizeof(so));
+		}
+	}
+	return hash;
+}
+
+/* Get the region to redraw on a buffer of the given age: the damage
+ * accumulated since the buffer was last drawn. */
+static void output_get_redraw_region(struct glider_output *output, int age,
+		pixman_region32_t *region) {
+	uint64_t composited = output_get_composited_signature(output);
+	if (composited != output->composited_signature) {
+		output->composited_signature = composited;
+		output_damage_whole(output);
+	}
+
+	// Composited cursor motion
+	struct wlr_box cursor_box = { 0 };
+	if (output_cursor_visible(output) &&
+			liftoff_layer_get_plane_id(output->cursor_layer) == 0) {
+		cursor_box = output_get_cursor_box(output);
+	}
+	if (memcmp(&cursor_box, &output->composited_cursor,
+			sizeof(cursor_box)) != 0) {
+		glider_output_add_damage_box(output, &output->composited_cursor);
+		glider_output_add_damage_box(output, &cursor_box);
+		output->composited_cursor = cursor_box;
 	}
 
+	pixman_region32_copy(region, &output->damage);
+	if (age <= 0 || age > GLIDER_OUTPUT_DAMAGE_HISTORY + 1) {
+		pixman_region32_union_rect(region, region, 0, 0,
+			output->output->width, output->output->height);
+		return;
+	}
+	for (int i = 0; i < age - 1; i++) {
+		pixman_region32_union(region, region, &output->damage_history[i]);
+	}
+}
+
+/* The damage accumulated so far has been drawn by the last composition. */
+static void output_rotate_damage(struct glider_output *output) {
+	pixman_region32_t last =
+		output->damage_history[GLIDER_OUTPUT_DAMAGE_HISTORY - 1];
+	memmove(&output->damage_history[1], &output->damage_history[0],
+		(GLIDER_OUTPUT_DAMAGE_HISTORY - 1) * sizeof(output->damage_history[0]));
+	output->damage_history[0] = output->damage;
+	output->damage = last;
+	pixman_region32_clear(&output->damage);
+}
+
+static void output_render_scene(struct glider_output *output) {
+	struct glider_server *server = output->server;
+
 	wlr_renderer_clear(server->renderer->renderer,
 		(float[4]){ 0.0, 1.0, 0.0, 1.0 });
 
-	struct glider_surface *surface;
-	wl_list_for_each(surface, &output->server->surfaces, link) {
-		struct glider_surface_output *so =
-			glider_surface_get_output(surface, output);
-		if (so == NULL || liftoff_layer_get_plane_id(so->layer) != 0) {
+	// From bottom to top
+	struct glider_surface_output *so;
+	wl_list_for_each(so, &output->visible_surfaces, visible_link) {
+		if (liftoff_layer_get_plane_id(so->layer) != 0) {
 			continue;
 		}
 
+		struct glider_surface *surface = so->surface;
 		struct wlr_texture *texture =
 			wlr_surface_get_texture(surface->wlr_surface);
 		if (texture == NULL) {
 			continue;
 		}
 
-		wlr_render_texture(server->renderer->renderer, texture,
-			output->output->transform_matrix, 0, 0, 1.0);
+		struct wlr_surface_state *state = &surface->wlr_surface->current;
+		struct wlr_box box = surface->node.box;
+		float matrix[9];
+		wlr_matrix_project_box(matrix, &box,
+			wlr_output_transform_invert(state->transform), 0,
+			output->output->transform_matrix);
+		wlr_render_texture_with_matrix(server->renderer->renderer, texture,
+			matrix, 1.0);
+	}
+
+	if (output->composited_cursor.width > 0) {
+		float matrix[9];
+		wlr_matrix_project_box(matrix, &output->composited_cursor,
+			WL_OUTPUT_TRANSFORM_NORMAL, 0, output->output->transform_matrix);
+		wlr_render_texture_with_matrix(server->renderer->renderer,
+			server->cursor.texture, matrix, 1.0);
+	}
+}
+
+/* Render the damaged parts of the output. age is the age of the buffer. If
+ * fence_fd isn't NULL, it's set to a fence signalling when rendering has
+ * completed, or -1. */
+static bool output_render(struct glider_output *output,
+		struct wlr_buffer *buf, int age, int *fence_fd) {
+	struct glider_server *server = output->server;
+
+	pixman_region32_t redraw;
+	pixman_region32_init(&redraw);
+	output_get_redraw_region(output, age, &redraw);
+
+	int rects_len;
+	pixman_box32_t *rects = pixman_region32_rectangles(&redraw, &rects_len);
+	uint64_t redrawn = 0;
+	for (int i = 0; i < rects_len; i++) {
+		redrawn += (uint64_t)(rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+	}
+	uint64_t total = (uint64_t)output->output->width * output->output->height;
+
+	if (!glider_gl_renderer_begin(server->renderer, buf)) {
+		wlr_log(WLR_ERROR, "Failed to start rendering on buffer");
+		pixman_region32_fini(&redraw);
+		return false;
+	}
+
+	// Each rectangle is drawn separately, so that scattered damage doesn't
+	// redraw the area in-between
+	for (int i = 0; i < rects_len; i++) {
+		struct wlr_box scissor = {
+			.x = rects[i].x1,
+			.y = rects[i].y1,
+			.width = rects[i].x2 - rects[i].x1,
+			.height = rects[i].y2 - rects[i].y1,
+		};
+		wlr_renderer_scissor(server->renderer->renderer, &scissor);
+		output_render_scene(output);
+	}
+	wlr_renderer_scissor(server->renderer->renderer, NULL);
+	pixman_region32_fini(&redraw);
+
+	if (fence_fd != NULL) {
+		*fence_fd = glider_gl_renderer_end_with_fence(server->renderer);
+	} else {
+		glider_gl_renderer_end(server->renderer);
 	}
 
-	glider_gl_renderer_end(server->renderer);
+	output_rotate_damage(output);
+	output->stats.compositions++;
+	output->stats.redrawn_pixels += redrawn;
+	output->stats.composited_pixels += total;
 	return true;
 }
 
-bool glider_output_attach_buffer(struct glider_output *output,
-		struct wlr_buffer *buf, struct liftoff_layer *layer) {
-	liftoff_layer_set_property(layer, "CRTC_X", 0);
-	liftoff_layer_set_property(layer, "CRTC_Y", 0);
-	liftoff_layer_set_property(layer, "CRTC_W", buf->width);
-	liftoff_layer_set_property(layer, "CRTC_H", buf->height);
+static int64_t timespec_to_nsec(const struct timespec *t) {
+	return (int64_t)t->tv_sec * 1000000000 + t->tv_nsec;
+}
+
+/* Copy a frame rendered on the primary GPU into a scan-out buffer of the
+ * secondary GPU. */
+static bool output_copy(struct glider_output *output,
+		struct wlr_buffer *src, struct wlr_buffer *dst, int *fence_fd) {
+	struct glider_gl_renderer *renderer = output->gpu->renderer;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct glider_gl_renderer_texture *tex =
+		glider_gl_renderer_get_texture(renderer, src);
+	if (tex == NULL) {
+		wlr_log(WLR_ERROR, "Failed to import render buffer on "
+			"secondary GPU");
+		return false;
+	}
+
+	if (!glider_gl_renderer_begin(renderer, dst)) {
+		wlr_log(WLR_ERROR, "Failed to start rendering on buffer");
+		return false;
+	}
+
+	float projection[9];
+	wlr_matrix_projection(projection, dst->width, dst->height,
+		WL_OUTPUT_TRANSFORM_NORMAL);
+	wlr_render_texture(renderer->renderer, tex->texture, projection,
+		0, 0, 1.0);
+
+	*fence_fd = glider_gl_renderer_end_with_fence(renderer);
+
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	output->stats.copies++;
+	output->stats.copy_bytes += (uint64_t)tex->stride * src->height;
+	output->stats.copy_submit_nsec +=
+		timespec_to_nsec(&end) - timespec_to_nsec(&start);
+	return true;
+}
+
+/* Render the output into a scan-out buffer, going through the render
+ * swapchain if the scan-out GPU can't use the primary GPU buffers. age is the
+ * age of the scan-out buffer. On success, fence_fd is set to a fence
+ * signalling when the scan-out buffer is ready, or -1. */
+static bool output_render_scanout(struct glider_output *output,
+		struct wlr_buffer *buf, int age, int *fence_fd) {
+	*fence_fd = -1;
+	if (output->render_mode != GLIDER_OUTPUT_RENDER_COPY) {
+		if (!output_render(output, buf, age, fence_fd)) {
+			return false;
+		}
+		glider_swapchain_set_buffer_submitted(output->swapchain, buf);
+		return true;
+	}
+
+	// Damage is tracked on the render buffers, the copy is always full
+	struct wlr_buffer *render_buf =
+		glider_swapchain_acquire(output->render_swapchain, &age);
+	if (render_buf == NULL) {
+		wlr_log(WLR_ERROR, "Failed to get next render buffer");
+		return false;
+	}
+	// The copy is synchronized with the render buffer implicitly
+	bool ok = output_render(output, render_buf, age, NULL);
+	if (ok) {
+		glider_swapchain_set_buffer_submitted(output->render_swapchain,
+			render_buf);
+		ok = output_copy(output, render_buf, buf, fence_fd);
+	}
+	wlr_buffer_unlock(render_buf);
+	return ok;
+}
+
+static bool output_attach_buffer(struct glider_output *output,
+		struct wlr_buffer *buf, struct liftoff_layer *layer,
+		const struct wlr_box *box) {
+	liftoff_layer_set_property(layer, "CRTC_X", box->x);
+	liftoff_layer_set_property(layer, "CRTC_Y", box->y);
+	liftoff_layer_set_property(layer, "CRTC_W", box->width);
+	liftoff_layer_set_property(layer, "CRTC_H", box->height);
 	liftoff_layer_set_property(layer, "SRC_X", 0);
 	liftoff_layer_set_property(layer, "SRC_Y", 0);
 	liftoff_layer_set_property(layer, "SRC_W", buf->width << 16);
@@ -96,73 +361,496 @@ bool glider_output_attach_buffer(struct glider_output *output,
 	return true;
 }
 
+/* Get the destination rectangle of a buffer on the CRTC, from its position in
+ * output-local coordinates. */
+static struct wlr_box output_get_layer_box(struct glider_output *output,
+		struct wlr_buffer *buf, int x, int y,
+		enum wl_output_transform buffer_transform) {
+	struct wlr_box box = {
+		.x = x,
+		.y = y,
+		.width = buf->width,
+		.height = buf->height,
+	};
+	if (buffer_transform & WL_OUTPUT_TRANSFORM_90) {
+		box.width = buf->height;
+		box.height = buf->width;
+	}
+	int width, height;
+	wlr_output_transformed_resolution(output->output, &width, &height);
+	wlr_box_transform(&box, &box,
+		wlr_output_transform_invert(output->output->transform),
+		width, height);
+	return box;
+}
+
+bool glider_output_attach_buffer(struct glider_output *output,
+		struct wlr_buffer *buf, struct liftoff_layer *layer) {
+	struct wlr_box box = { .width = buf->width, .height = buf->height };
+	return output_attach_buffer(output, buf, layer, &box);
+}
+
+/* Let the plane rotate the buffer instead of compositing it with GL. x and y
+ * are output-local coordinates. */
+static bool output_attach_transformed_buffer(struct glider_output *output,
+		struct wlr_buffer *buf, struct liftoff_layer *layer, int x, int y,
+		enum wl_output_transform buffer_transform) {
+	enum wl_output_transform transform = wlr_output_transform_compose(
+		wlr_output_transform_invert(buffer_transform),
+		output->output->transform);
+	if (!glider_drm_connector_set_layer_transform(output->output, layer,
+			transform)) {
+		liftoff_layer_set_fb_composited(layer);
+		return true;
+	}
+
+	struct wlr_box box = output_get_layer_box(output, buf, x, y,
+		buffer_transform);
+	return output_attach_buffer(output, buf, layer, &box);
+}
+
+void glider_output_attach_surface(struct glider_surface_output *so) {
+	struct wlr_surface *wlr_surface = so->surface->wlr_surface;
+	if (!so->visible || wlr_surface->buffer == NULL) {
+		return;
+	}
+
+	liftoff_layer_set_fb_composited(so->layer);
+	const struct wlr_box *box = &so->surface->node.box;
+	output_attach_transformed_buffer(so->output, &wlr_surface->buffer->base,
+		so->layer, box->x, box->y, wlr_surface->current.transform);
+	glider_drm_connector_set_layer_damage(so->output->output, so->layer,
+		&wlr_surface->buffer_damage);
+}
+
+static void output_show_surface(struct glider_output *output,
+		struct glider_surface_output *so) {
+	so->visible = true;
+	so->zpos = -1;
+	glider_output_attach_surface(so);
+}
+
+static void output_hide_surface(struct glider_output *output,
+		struct glider_surface_output *so) {
+	so->visible = false;
+	wl_list_remove(&so->visible_link);
+	wl_list_init(&so->visible_link);
+	// Disable the layer
+	liftoff_layer_set_property(so->layer, "FB_ID", 0);
+}
+
+/* Query the scene for the surfaces intersecting the output, and stack their
+ * layers. Surfaces which left the output have their layer disabled. */
+static void output_update_scene(struct glider_output *output) {
+	struct wlr_box output_box = { 0 };
+	wlr_output_transformed_resolution(output->output, &output_box.width,
+		&output_box.height);
+
+	struct glider_scene_node **nodes;
+	ssize_t nodes_len = glider_scene_get_nodes_in_box(&output->server->scene,
+		&output_box, &nodes);
+	if (nodes_len < 0) {
+		wlr_log(WLR_ERROR, "Failed to query the scene");
+		return;
+	}
+
+	struct wl_list visible;
+	wl_list_init(&visible);
+	for (ssize_t i = 0; i < nodes_len; i++) {
+		struct glider_surface *surface = nodes[i]->data;
+		struct glider_surface_output *so =
+			glider_surface_get_output(surface, output);
+		if (so == NULL) {
+			continue;
+		}
+
+		if (so->visible) {
+			wl_list_remove(&so->visible_link);
+		} else {
+			output_show_surface(output, so);
+		}
+		wl_list_insert(visible.prev, &so->visible_link);
+
+		int32_t zpos = GLIDER_OUTPUT_ZPOS_SURFACES + i;
+		if (so->zpos != zpos) {
+			so->zpos = zpos;
+			liftoff_layer_set_property(so->layer, "zpos", zpos);
+		}
+	}
+	free(nodes);
+
+	// Whatever is left in the previous list isn't visible anymore
+	struct glider_surface_output *so, *so_tmp;
+	wl_list_for_each_safe(so, so_tmp, &output->visible_surfaces,
+			visible_link) {
+		output_hide_surface(output, so);
+	}
+	wl_list_insert_list(&output->visible_surfaces, &visible);
+}
+
 static bool output_test(struct glider_output *output) {
-	struct wlr_buffer *buf = glider_swapchain_acquire(output->swapchain);
+	glider_trace_begin(GLIDER_TRACE_OUTPUT_TEST);
+	bool ok = false;
+	struct wlr_buffer *buf = glider_swapchain_acquire(output->swapchain, NULL);
 	if (buf == NULL) {
 		wlr_log(WLR_ERROR, "Failed to get next buffer");
-		return false;
+		goto out;
 	}
 	if (!glider_output_attach_buffer(output, buf, output->composition_layer)) {
-		goto error_buffer;
+		goto out;
 	}
 	if (!wlr_output_test(output->output)) {
 		wlr_log(WLR_DEBUG, "Connector test failed");
-		goto error_buffer;
+		goto out;
 	}
-	wlr_buffer_unlock(buf);
-	return true;
+	ok = true;
 
-error_buffer:
-	wlr_buffer_unlock(buf);
+out:
+	if (buf != NULL) {
+		wlr_buffer_unlock(buf);
+	}
+	glider_trace_end(GLIDER_TRACE_OUTPUT_TEST);
+	return ok;
+}
+
+static bool output_get_test_result(struct glider_output *output,
+		uint64_t signature) {
+	for (size_t i = 0; i < output->test_cache_len; i++) {
+		if (output->test_cache[i] != signature) {
+			continue;
+		}
+		// Move to front
+		memmove(&output->test_cache[1], &output->test_cache[0],
+			i * sizeof(output->test_cache[0]));
+		output->test_cache[0] = signature;
+		return true;
+	}
 	return false;
 }
 
-static void output_push_frame(struct glider_output *output) {
+static void output_add_test_result(struct glider_output *output,
+		uint64_t signature) {
+	if (output->test_cache_len < GLIDER_OUTPUT_TEST_CACHE_CAP) {
+		output->test_cache_len++;
+	}
+	// Evicts the least recently used result if the cache is full
+	memmove(&output->test_cache[1], &output->test_cache[0],
+		(output->test_cache_len - 1) * sizeof(output->test_cache[0]));
+	output->test_cache[0] = signature;
+}
+
+static void output_remove_test_result(struct glider_output *output,
+		uint64_t signature) {
+	for (size_t i = 0; i < output->test_cache_len; i++) {
+		if (output->test_cache[i] == signature) {
+			output->test_cache_len--;
+			memmove(&output->test_cache[i], &output->test_cache[i + 1],
+				(output->test_cache_len - i) * sizeof(output->test_cache[0]));
+			return;
+		}
+	}
+}
+
+/* Only issue a test-only commit if the layer configuration hasn't passed a
+ * test before. Otherwise the plane allocation of the last commit is still
+ * valid.
+ *
+ * Failures aren't cached: they may be caused by transient conditions such as
+ * an inactive session or a busy CRTC. Signatures are 64-bit hashes compared
+ * without the full key; a collision skips a test, in which case the real
+ * commit fails and evicts the signature, so the next frame is tested. */
+static bool output_test_cached(struct glider_output *output,
+		uint64_t signature) {
+	if (output_get_test_result(output, signature)) {
+		output->stats.test_cache_hits++;
+		return true;
+	}
+
+	output->stats.tests++;
 	if (!output_test(output)) {
+		return false;
+	}
+	output_add_test_result(output, signature);
+	return true;
+}
+
+static bool output_has_fullscreen_plane(struct glider_output *output) {
+	int width, height;
+	wlr_output_transformed_resolution(output->output, &width, &height);
+
+	struct glider_surface_output *so;
+	wl_list_for_each(so, &output->visible_surfaces, visible_link) {
+		if (liftoff_layer_get_plane_id(so->layer) == 0) {
+			continue;
+		}
+		const struct wlr_box *box = &so->surface->node.box;
+		if (box->x <= 0 && box->y <= 0 && box->x + box->width >= width &&
+				box->y + box->height >= height) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void output_update_vrr(struct glider_output *output) {
+	// The backend rolls the VRR state back if a commit fails, don't assume
+	// that the last requested state made it to the hardware
+	output->vrr_enabled = glider_drm_connector_get_vrr(output->output);
+
+	bool enabled;
+	switch (output->vrr_policy) {
+	case GLIDER_OUTPUT_VRR_OFF:
+		return;
+	case GLIDER_OUTPUT_VRR_ALWAYS:
+		enabled = true;
+		break;
+	case GLIDER_OUTPUT_VRR_FULLSCREEN:
+		// Uses the plane allocation of the last commit
+		enabled = output_has_fullscreen_plane(output);
+		break;
+	default:
+		abort();
+	}
+	if (enabled == output->vrr_enabled) {
+		return;
+	}
+
+	if (!glider_drm_connector_set_vrr(output->output, enabled)) {
+		wlr_log(WLR_INFO, "Output %s doesn't support VRR, disabling VRR "
+			"policy", output->output->name);
+		output->vrr_policy = GLIDER_OUTPUT_VRR_OFF;
 		return;
 	}
+	wlr_log(WLR_DEBUG, "%s VRR on output %s", enabled ? "Enabling" : "Disabling",
+		output->output->name);
+	output->vrr_enabled = enabled;
+}
+
+/* Tear if a surface which asked for it is scanned out directly, and there's
+ * nothing to composite. The backend checks that only the primary plane
+ * changes. */
+static bool output_wants_tearing(struct glider_output *output) {
+	struct glider_surface_output *so;
+	wl_list_for_each(so, &output->visible_surfaces, visible_link) {
+		if (liftoff_layer_get_plane_id(so->layer) != 0 &&
+				glider_tearing_control_manager_wants_async(
+					output->server->tearing_control,
+					so->surface->wlr_surface)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool output_attach_cursor(struct glider_output *output) {
+	if (!output_cursor_visible(output)) {
+		if (output->cursor_layer != NULL) {
+			liftoff_layer_set_property(output->cursor_layer, "FB_ID", 0);
+		}
+		return true;
+	}
+	struct glider_cursor *cursor = &output->server->cursor;
+	if (!output_attach_transformed_buffer(output, output->cursor_buffer,
+			output->cursor_layer, cursor->x - cursor->image.hotspot_x,
+			cursor->y - cursor->image.hotspot_y, WL_OUTPUT_TRANSFORM_NORMAL)) {
+		return false;
+	}
+	// The cursor buffer is only drawn once
+	pixman_region32_t damage;
+	pixman_region32_init(&damage);
+	glider_drm_connector_set_layer_damage(output->output, output->cursor_layer,
+		&damage);
+	pixman_region32_fini(&damage);
+	return true;
+}
+
+/* If only the cursor moved and it's on a plane, skip composition and
+ * test-only commits, and just update the plane position. */
+static bool output_move_cursor(struct glider_output *output) {
+	if (output->content_dirty || !output_cursor_visible(output) ||
+			liftoff_layer_get_plane_id(output->cursor_layer) == 0) {
+		return false;
+	}
+
+	struct glider_cursor *cursor = &output->server->cursor;
+	struct wlr_box box = output_get_layer_box(output, output->cursor_buffer,
+		cursor->x - cursor->image.hotspot_x,
+		cursor->y - cursor->image.hotspot_y, WL_OUTPUT_TRANSFORM_NORMAL);
+	if (!glider_drm_connector_move_layer(output->output,
+			output->cursor_layer, box.x, box.y)) {
+		return false;
+	}
+	output->stats.cursor_moves++;
+	return true;
+}
+
+/* Identifies the plane configuration of the next commit. Besides the attached
+ * buffers, it depends on the position and stacking of the visible surfaces. */
+static uint64_t output_get_signature(struct glider_output *output) {
+	uint64_t signature =
+		glider_drm_connector_get_layers_signature(output->output);
+	struct glider_surface_output *so;
+	wl_list_for_each(so, &output->visible_surfaces, visible_link) {
+		const struct wlr_box *box = &so->surface->node.box;
+		signature = glider_hash_bytes(signature, &so->zpos, sizeof(so->zpos));
+		signature = glider_hash_bytes(signature, &box->x, sizeof(box->x));
+		signature = glider_hash_bytes(signature, &box->y, sizeof(box->y));
+	}
+	signature = glider_hash_bytes(signature, &output->vrr_enabled,
+		sizeof(output->vrr_enabled));
+	bool cursor_visible = output_cursor_visible(output);
+	return glider_hash_bytes(signature, &cursor_visible,
+		sizeof(cursor_visible));
+}
+
+/* Returns true if a page-flip was committed. */
+static bool output_push_frame(struct glider_output *output) {
+	if (output->cursor_dirty && output_move_cursor(output)) {
+		output->cursor_dirty = false;
+		return true;
+	}
+
+	output_update_vrr(output);
+
+	if (output->content_dirty) {
+		output_update_scene(output);
+	}
+	if (!output_attach_cursor(output)) {
+		return false;
+	}
 
+	uint64_t signature = output_get_signature(output);
+	if (!output_test_cached(output, signature)) {
+		if (!output->vrr_enabled) {
+			return false;
+		}
+		// The failure may be unrelated to VRR: only give up on the policy if
+		// the same configuration passes without it
+		glider_drm_connector_set_vrr(output->output, false);
+		output->vrr_enabled = false;
+		signature = output_get_signature(output);
+		if (!output_test_cached(output, signature)) {
+			return false;
+		}
+		wlr_log(WLR_INFO, "Output %s rejected VRR, disabling VRR policy",
+			output->output->name);
+		output->vrr_policy = GLIDER_OUTPUT_VRR_OFF;
+	}
+
+	bool ok = false;
 	struct wlr_buffer *buf = NULL;
 	if (output_needs_render(output)) {
-		buf = glider_swapchain_acquire(output->swapchain);
+		int age;
+		buf = glider_swapchain_acquire(output->swapchain, &age);
 		if (buf == NULL) {
 			wlr_log(WLR_ERROR, "Failed to get next buffer");
-			return;
+			return false;
 		}
-		if (!output_render(output, buf)) {
+		int fence_fd = -1;
+		if (!output_render_scanout(output, buf, age, &fence_fd)) {
 			goto out;
 		}
 		if (!glider_output_attach_buffer(output, buf, output->composition_layer)) {
+			if (fence_fd >= 0) {
+				close(fence_fd);
+			}
 			goto out;
 		}
+		// The buffer differs from the previous one by the damage we've just
+		// redrawn
+		glider_drm_connector_set_layer_damage(output->output,
+			output->composition_layer, &output->damage_history[0]);
+		// Let KMS wait for rendering to complete instead of relying on
+		// implicit synchronization
+		if (fence_fd >= 0 && !glider_drm_connector_set_in_fence(
+				output->output, output->composition_layer, fence_fd)) {
+			wlr_log(WLR_ERROR, "Failed to set composition layer in-fence");
+		}
 	}
 
+	glider_drm_connector_set_tearing(output->output,
+		buf == NULL && output_wants_tearing(output));
 	if (!wlr_output_commit(output->output)) {
 		wlr_log(WLR_ERROR, "Failed to commit connector");
+		// Planes may have been taken by another output since the test, make
+		// sure the next frame is tested again
+		output_remove_test_result(output, signature);
 		goto out;
 	}
+	output->content_dirty = output->cursor_dirty = false;
+	ok = true;
 
 out:
 	if (buf != NULL) {
 		wlr_buffer_unlock(buf);
 	}
+	return ok;
 }
 
 static void handle_destroy(struct wl_listener *listener, void *data) {
 	struct glider_output *output = wl_container_of(listener, output, destroy);
 	wl_signal_emit(&output->events.destroy, NULL);
+	glider_drm_connector_destroy_layer(output->output, output->bg_layer);
+	glider_drm_connector_destroy_layer(output->output,
+		output->composition_layer);
+	if (output->cursor_layer != NULL) {
+		glider_drm_connector_destroy_layer(output->output,
+			output->cursor_layer);
+		liftoff_layer_destroy(output->cursor_layer);
+	}
+	if (output->cursor_buffer != NULL) {
+		wlr_buffer_drop(output->cursor_buffer);
+	}
 	wlr_buffer_drop(output->bg_buffer);
 	liftoff_layer_destroy(output->bg_layer);
 	glider_swapchain_destroy(output->swapchain);
+	glider_swapchain_destroy(output->render_swapchain);
 	liftoff_layer_destroy(output->composition_layer);
+	if (output->frame_timer != NULL) {
+		wl_event_source_remove(output->frame_timer);
+		close(output->frame_timer_fd);
+	}
+	if (output->idle_frame != NULL) {
+		wl_event_source_remove(output->idle_frame);
+	}
 	wl_list_remove(&output->destroy.link);
+	wl_list_remove(&output->frame.link);
+	wl_list_remove(&output->present.link);
 	wl_list_remove(&output->link);
+	pixman_region32_fini(&output->damage);
+	for (size_t i = 0; i < GLIDER_OUTPUT_DAMAGE_HISTORY; i++) {
+		pixman_region32_fini(&output->damage_history[i]);
+	}
 	free(output);
 }
 
-static void handle_frame(struct wl_listener *listener, void *data) {
-	struct glider_output *output = wl_container_of(listener, output, frame);
-	output_push_frame(output);
+static int64_t get_now_nsec(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_to_nsec(&now);
+}
+
+/* Render and commit a frame, then let clients draw the next one. */
+static void output_render_frame(struct glider_output *output) {
+	output->needs_frame = false;
+	int64_t start = get_now_nsec();
+	output->frame_pending = output_push_frame(output);
+	int64_t end = get_now_nsec();
+	if (!output->frame_pending) {
+		// Retry on the next frame event or request, without spinning
+		output->needs_frame = true;
+	}
+
+	// Exponentially weighted moving average of the CPU time spent building
+	// and submitting the frame, with a 1/8 weight for the new sample. GPU
+	// time isn't included: the slack has to cover it.
+	int64_t submit_time = end - start;
+	if (output->submit_time_nsec == 0) {
+		output->submit_time_nsec = submit_time;
+	} else {
+		output->submit_time_nsec =
+			(7 * output->submit_time_nsec + submit_time) / 8;
+	}
 
 	struct timespec t;
 	clock_gettime(CLOCK_MONOTONIC, &t);
@@ -175,6 +863,401 @@ static void handle_frame(struct wl_listener *listener, void *data) {
 	}
 }
 
+static int handle_frame_timer(int fd, uint32_t mask, void *data) {
+	struct glider_output *output = data;
+
+	uint64_t expirations;
+	if (read(fd, &expirations, sizeof(expirations)) < 0 &&
+			errno != EAGAIN) {
+		wlr_log_errno(WLR_ERROR, "Failed to read frame timer");
+	}
+
+	output_render_frame(output);
+	return 0;
+}
+
+/* Delay the frame until just before the next vblank, so that client commits
+ * which land in the meantime make it into this frame. */
+static void output_schedule_frame(struct glider_output *output) {
+	output->target_present_nsec = 0;
+	if (output->frame_timer == NULL || output->last_present_nsec == 0 ||
+			output->refresh_nsec <= 0) {
+		output_render_frame(output);
+		return;
+	}
+
+	int64_t now = get_now_nsec();
+	// Computed directly, the last presentation may be far in the past after
+	// an idle period
+	int64_t n = 1;
+	if (now >= output->last_present_nsec) {
+		n = (now - output->last_present_nsec) / output->refresh_nsec + 1;
+	}
+	int64_t next_vblank = output->last_present_nsec + n * output->refresh_nsec;
+	output->target_present_nsec = next_vblank;
+	output->stats.scheduled_frames++;
+
+	int64_t margin = output->submit_time_nsec + output->render_slack_nsec;
+	int64_t deadline = next_vblank - margin;
+	if (deadline <= now) {
+		output_render_frame(output);
+		return;
+	}
+
+	struct itimerspec timer = {
+		.it_value = {
+			.tv_sec = deadline / 1000000000,
+			.tv_nsec = deadline % 1000000000,
+		},
+	};
+	if (timerfd_settime(output->frame_timer_fd, TFD_TIMER_ABSTIME,
+			&timer, NULL) != 0) {
+		wlr_log_errno(WLR_ERROR, "timerfd_settime failed");
+		output_render_frame(output);
+		return;
+	}
+	output->frame_pending = true;
+}
+
+static void handle_frame(struct wl_listener *listener, void *data) {
+	struct glider_output *output = wl_container_of(listener, output, frame);
+	output->frame_pending = false;
+	if (!output->needs_frame) {
+		// Nothing changed, stop flipping until a frame is requested
+		wlr_log(WLR_DEBUG, "Output %s is idle", output->output->name);
+		return;
+	}
+	output_schedule_frame(output);
+}
+
+static void handle_idle_frame(void *data) {
+	struct glider_output *output = data;
+	output->idle_frame = NULL;
+	if (output->frame_pending ||
+			!glider_drm_connector_is_active(output->output)) {
+		return;
+	}
+
+	// vblanks went by without a page-flip since the last presentation
+	if (output->last_present_nsec != 0 && output->refresh_nsec > 0) {
+		output->stats.idle_vblanks +=
+			(get_now_nsec() - output->last_present_nsec) /
+			output->refresh_nsec;
+	}
+	output_schedule_frame(output);
+}
+
+void glider_output_request_frame(struct glider_output *output) {
+	output->needs_frame = true;
+	// While the session is inactive, commits would fail: wait for the frame
+	// event sent when the device state is restored
+	if (output->frame_pending || output->idle_frame != NULL ||
+			output->liftoff_output == NULL ||
+			!glider_drm_connector_is_active(output->output)) {
+		return;
+	}
+
+	// Wait for the current event loop iteration to finish, so that all the
+	// requests it makes are coalesced
+	struct wl_event_loop *event_loop =
+		wl_display_get_event_loop(output->server->display);
+	output->idle_frame =
+		wl_event_loop_add_idle(event_loop, handle_idle_frame, output);
+	if (output->idle_frame == NULL) {
+		wlr_log(WLR_ERROR, "wl_event_loop_add_idle failed");
+		handle_idle_frame(output);
+	}
+}
+
+static void handle_present(struct wl_listener *listener, void *data) {
+	struct glider_output *output = wl_container_of(listener, output, present);
+	struct wlr_output_event_present *event = data;
+	if (event->when == NULL) {
+		return;
+	}
+
+	int64_t when = timespec_to_nsec(event->when);
+	if (output->target_present_nsec != 0 &&
+			when > output->target_present_nsec + output->refresh_nsec / 2) {
+		output->stats.missed_deadlines++;
+		wlr_log(WLR_DEBUG, "Output %s missed its frame deadline by %.1fms",
+			output->output->name,
+			(double)(when - output->target_present_nsec) / 1000000);
+	}
+	output->target_present_nsec = 0;
+
+	output->last_present_nsec = when;
+	output->refresh_nsec = event->refresh;
+	output->stats.active_vblanks++;
+}
+
+static int64_t get_render_slack_nsec(void) {
+	const char *env = getenv("GLIDER_RENDER_SLACK_US");
+	if (env == NULL) {
+		return GLIDER_OUTPUT_DEFAULT_RENDER_SLACK_NSEC;
+	}
+	char *end;
+	errno = 0;
+	long slack_us = strtol(env, &end, 10);
+	if (errno != 0 || *end != '\0' || slack_us < 0) {
+		wlr_log(WLR_ERROR, "Invalid GLIDER_RENDER_SLACK_US value: %s", env);
+		return GLIDER_OUTPUT_DEFAULT_RENDER_SLACK_NSEC;
+	}
+	return (int64_t)slack_us * 1000;
+}
+
+static enum glider_output_vrr_policy get_vrr_policy(void) {
+	const char *env = getenv("GLIDER_VRR");
+	if (env == NULL || strcmp(env, "off") == 0) {
+		return GLIDER_OUTPUT_VRR_OFF;
+	} else if (strcmp(env, "always") == 0) {
+		return GLIDER_OUTPUT_VRR_ALWAYS;
+	} else if (strcmp(env, "fullscreen") == 0) {
+		return GLIDER_OUTPUT_VRR_FULLSCREEN;
+	}
+	wlr_log(WLR_ERROR, "Invalid GLIDER_VRR value: %s", env);
+	return GLIDER_OUTPUT_VRR_OFF;
+}
+
+static enum wl_output_transform get_output_transform(void) {
+	static const char *const names[] = {
+		[WL_OUTPUT_TRANSFORM_NORMAL] = "normal",
+		[WL_OUTPUT_TRANSFORM_90] = "90",
+		[WL_OUTPUT_TRANSFORM_180] = "180",
+		[WL_OUTPUT_TRANSFORM_270] = "270",
+		[WL_OUTPUT_TRANSFORM_FLIPPED] = "flipped",
+		[WL_OUTPUT_TRANSFORM_FLIPPED_90] = "flipped-90",
+		[WL_OUTPUT_TRANSFORM_FLIPPED_180] = "flipped-180",
+		[WL_OUTPUT_TRANSFORM_FLIPPED_270] = "flipped-270",
+	};
+
+	const char *env = getenv("GLIDER_OUTPUT_TRANSFORM");
+	if (env == NULL) {
+		return WL_OUTPUT_TRANSFORM_NORMAL;
+	}
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcmp(env, names[i]) == 0) {
+			return i;
+		}
+	}
+	wlr_log(WLR_ERROR, "Invalid GLIDER_OUTPUT_TRANSFORM value: %s", env);
+	return WL_OUTPUT_TRANSFORM_NORMAL;
+}
+
+static bool output_init_frame_timer(struct glider_output *output) {
+	output->render_slack_nsec = get_render_slack_nsec();
+
+	output->frame_timer_fd =
+		timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (output->frame_timer_fd < 0) {
+		wlr_log_errno(WLR_ERROR, "timerfd_create failed");
+		return false;
+	}
+
+	struct wl_event_loop *event_loop =
+		wl_display_get_event_loop(output->server->display);
+	output->frame_timer = wl_event_loop_add_fd(event_loop,
+		output->frame_timer_fd, WL_EVENT_READABLE, handle_frame_timer,
+		output);
+	if (output->frame_timer == NULL) {
+		wlr_log(WLR_ERROR, "wl_event_loop_add_fd failed");
+		close(output->frame_timer_fd);
+		output->frame_timer_fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+static bool output_try_swapchain(struct glider_output *output,
+		struct glider_allocator *alloc, const struct wlr_drm_format *format) {
+	glider_swapchain_destroy(output->swapchain);
+	output->test_cache_len = 0;
+	output->swapchain = glider_swapchain_create(alloc,
+		output->output->width, output->output->height, format);
+	if (output->swapchain == NULL) {
+		return false;
+	}
+	return output_test(output);
+}
+
+/* Try the format modifiers, then fall back to the implicit modifier. */
+static bool output_try_scanout_swapchain(struct glider_output *output,
+		struct glider_allocator *alloc, const struct wlr_drm_format *format) {
+	if (output_try_swapchain(output, alloc, format)) {
+		return true;
+	}
+
+	wlr_log(WLR_DEBUG, "Failed to enable output, retrying without modifiers");
+	struct wlr_drm_format format_no_modifiers = { .format = format->format };
+	return output_try_swapchain(output, alloc, &format_no_modifiers);
+}
+
+/* The cursor gets its own layer, so that it can be displayed on the cursor
+ * plane and moved without re-compositing. */
+static bool output_init_cursor(struct glider_output *output) {
+	struct glider_cursor *cursor = &output->server->cursor;
+	int width, height;
+	glider_drm_connector_get_cursor_size(output->output, &width, &height);
+	if (cursor->texture == NULL || (int)cursor->image.width > width ||
+			(int)cursor->image.height > height) {
+		return false;
+	}
+
+	// Cursor planes generally only support linear buffers
+	struct wlr_drm_format *linear =
+		calloc(1, sizeof(*linear) + sizeof(linear->modifiers[0]));
+	if (linear == NULL) {
+		return false;
+	}
+	linear->format = DRM_FORMAT_ARGB8888;
+	linear->len = 1;
+	linear->modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+	output->cursor_buffer = glider_allocator_create_buffer(
+		output->swapchain->allocator, width, height, linear);
+	free(linear);
+	if (output->cursor_buffer == NULL) {
+		return false;
+	}
+
+	struct glider_gl_renderer *renderer =
+		output_get_scanout_render_gpu(output)->renderer;
+	struct wlr_texture *texture = wlr_texture_from_pixels(renderer->renderer,
+		WL_SHM_FORMAT_ARGB8888, cursor->image.width * 4, cursor->image.width,
+		cursor->image.height, cursor->image.pixels);
+	if (texture == NULL) {
+		goto error_buffer;
+	}
+	if (!glider_gl_renderer_begin(renderer, output->cursor_buffer)) {
+		wlr_texture_destroy(texture);
+		goto error_buffer;
+	}
+	wlr_renderer_clear(renderer->renderer, (float[4]){ 0.0, 0.0, 0.0, 0.0 });
+	float projection[9];
+	wlr_matrix_projection(projection, width, height,
+		WL_OUTPUT_TRANSFORM_NORMAL);
+	wlr_render_texture(renderer->renderer, texture, projection, 0, 0, 1.0);
+	glider_gl_renderer_end(renderer);
+	wlr_texture_destroy(texture);
+
+	output->cursor_layer = liftoff_layer_create(output->liftoff_output);
+	liftoff_layer_set_property(output->cursor_layer, "zpos",
+		GLIDER_OUTPUT_ZPOS_CURSOR);
+	return true;
+
+error_buffer:
+	wlr_buffer_drop(output->cursor_buffer);
+	output->cursor_buffer = NULL;
+	return false;
+}
+
+static const char *render_mode_str(enum glider_output_render_mode mode) {
+	switch (mode) {
+	case GLIDER_OUTPUT_RENDER_DIRECT:
+		return "direct";
+	case GLIDER_OUTPUT_RENDER_SHARED:
+		return "shared";
+	case GLIDER_OUTPUT_RENDER_COPY:
+		return "copy";
+	}
+	abort();
+}
+
+static bool output_init_swapchain(struct glider_output *output,
+		const struct wlr_drm_format *format) {
+	struct glider_server *server = output->server;
+
+	if (output->gpu == &server->gpus[0]) {
+		output->render_mode = GLIDER_OUTPUT_RENDER_DIRECT;
+		return output_try_scanout_swapchain(output, server->allocator, format);
+	}
+
+	// Linear buffers are the most likely to be importable on both GPUs
+	struct wlr_drm_format *linear =
+		calloc(1, sizeof(*linear) + sizeof(linear->modifiers[0]));
+	if (linear == NULL) {
+		return false;
+	}
+	linear->format = format->format;
+	linear->len = 1;
+	linear->modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+
+	bool ok = false;
+	const char *env = getenv("GLIDER_MGPU");
+	bool allow_shared = env == NULL || strcmp(env, "copy") != 0;
+	bool allow_copy = env == NULL || strcmp(env, "shared") != 0;
+
+	if (allow_shared) {
+		output->render_mode = GLIDER_OUTPUT_RENDER_SHARED;
+		ok = output_try_swapchain(output, server->allocator, linear);
+		if (ok) {
+			goto out;
+		}
+		wlr_log(WLR_DEBUG, "Secondary GPU can't scan out primary GPU "
+			"buffers");
+	}
+
+	if (!allow_copy || output->gpu->renderer == NULL) {
+		goto out;
+	}
+
+	output->render_mode = GLIDER_OUTPUT_RENDER_COPY;
+	output->render_swapchain = glider_swapchain_create(server->allocator,
+		output->output->width, output->output->height, linear);
+	if (output->render_swapchain == NULL) {
+		goto out;
+	}
+	ok = output_try_scanout_swapchain(output, output->gpu->allocator, format);
+
+out:
+	free(linear);
+	if (ok) {
+		wlr_log(WLR_INFO, "Output %s uses %s multi-GPU rendering",
+			output->output->name, render_mode_str(output->render_mode));
+	}
+	return ok;
+}
+
+void glider_output_log_stats(struct glider_server *server) {
+	struct glider_output *output;
+	wl_list_for_each(output, &server->outputs, link) {
+		wlr_log(WLR_INFO, "Output %s: %"PRIu64" scheduled frames, "
+			"%"PRIu64" missed deadlines, submit time %"PRId64" us, "
+			"slack %"PRId64" us", output->output->name,
+			output->stats.scheduled_frames, output->stats.missed_deadlines,
+			output->submit_time_nsec / 1000, output->render_slack_nsec / 1000);
+		wlr_log(WLR_INFO, "Output %s: %"PRIu64" test-only commits, "
+			"%"PRIu64" skipped", output->output->name, output->stats.tests,
+			output->stats.test_cache_hits);
+		wlr_log(WLR_INFO, "Output %s: %"PRIu64" cursor-only frames",
+			output->output->name, output->stats.cursor_moves);
+		wlr_log(WLR_INFO, "Output %s: %"PRIu64" active vblanks, "
+			"%"PRIu64" idle", output->output->name,
+			output->stats.active_vblanks, output->stats.idle_vblanks);
+		double redrawn = 0;
+		if (output->stats.composited_pixels > 0) {
+			redrawn = 100.0 * output->stats.redrawn_pixels /
+				output->stats.composited_pixels;
+		}
+		wlr_log(WLR_INFO, "Output %s: %"PRIu64" compositions, "
+			"%.1f%% of the pixels redrawn", output->output->name,
+			output->stats.compositions, redrawn);
+
+		if (output->render_mode != GLIDER_OUTPUT_RENDER_COPY) {
+			continue;
+		}
+		uint64_t avg_usec = 0;
+		if (output->stats.copies > 0) {
+			avg_usec = output->stats.copy_submit_nsec /
+				output->stats.copies / 1000;
+		}
+		wlr_log(WLR_INFO, "Output %s: multi-GPU copies: %"PRIu64" frames, "
+			"%"PRIu64" bytes, %"PRIu64" us to submit on average",
+			output->output->name, output->stats.copies,
+			output->stats.copy_bytes, avg_usec);
+	}
+}
+
 void handle_new_output(struct wl_listener *listener, void *data) {
 	struct glider_server *server =
 		wl_container_of(listener, server, new_output);
@@ -183,24 +1266,53 @@ void handle_new_output(struct wl_listener *listener, void *data) {
 	struct glider_output *output = calloc(1, sizeof(*output));
 	output->output = wlr_output;
 	output->server = server;
+	wl_list_init(&output->visible_surfaces);
+	output->gpu =
+		&server->gpus[glider_drm_connector_get_device_index(wlr_output)];
 	wl_list_insert(&server->outputs, &output->link);
 	wl_signal_init(&output->events.destroy);
 
+	pixman_region32_init(&output->damage);
+	for (size_t i = 0; i < GLIDER_OUTPUT_DAMAGE_HISTORY; i++) {
+		pixman_region32_init(&output->damage_history[i]);
+	}
+
 	output->destroy.notify = handle_destroy;
 	wl_signal_add(&wlr_output->events.destroy, &output->destroy);
 
 	output->frame.notify = handle_frame;
 	wl_signal_add(&wlr_output->events.frame, &output->frame);
 
+	output->present.notify = handle_present;
+	wl_signal_add(&wlr_output->events.present, &output->present);
+
+	output->vrr_policy = get_vrr_policy();
+	if (output->vrr_policy != GLIDER_OUTPUT_VRR_OFF &&
+			!glider_drm_connector_get_vrr_capable(wlr_output)) {
+		wlr_log(WLR_INFO, "Output %s isn't VRR capable", wlr_output->name);
+		output->vrr_policy = GLIDER_OUTPUT_VRR_OFF;
+	}
+
+	if (!output_init_frame_timer(output)) {
+		wlr_log(WLR_ERROR, "Failed to create frame timer, "
+			"frames won't be delayed");
+	}
+
 	// TODO: push the first frame on modeset (this requires allocating the CRTC
 	// before making use of libliftoff)
 	struct wlr_output_mode *mode = wlr_output_preferred_mode(wlr_output);
 	wlr_output_enable(wlr_output, true);
 	wlr_output_set_mode(wlr_output, mode);
-	if (!wlr_output_commit(wlr_output)) {
+	wlr_output_set_transform(wlr_output, get_output_transform());
+	glider_trace_begin(GLIDER_TRACE_MODESET);
+	bool ok = wlr_output_commit(wlr_output);
+	glider_trace_end(GLIDER_TRACE_MODESET);
+	if (!ok) {
 		wlr_log(WLR_ERROR, "Failed to modeset output");
 		return;
 	}
+	// The modeset page-flip event starts the frame loop
+	output->frame_pending = true;
 
 	output->liftoff_output =
 		glider_drm_connector_get_liftoff_output(output->output);
@@ -225,34 +1337,21 @@ void handle_new_output(struct wl_listener *listener, void *data) {
 		return;
 	}
 
-	struct wlr_drm_format format_no_modifiers = { .format = format->format };
-
-	output->swapchain = glider_swapchain_create(output->server->allocator,
-		output->output->width, output->output->height, format);
-
-	if (!output_test(output)) {
-		wlr_log(WLR_DEBUG, "Failed to enable output, retrying without modifiers");
-		format = &format_no_modifiers;
-
-		glider_swapchain_destroy(output->swapchain);
-		output->swapchain = glider_swapchain_create(
-			output->server->allocator, output->output->width,
-			output->output->height, &format_no_modifiers);
-
-		if (!output_test(output)) {
-			wlr_log(WLR_ERROR, "Failed to enable output");
-			return;
-		}
+	if (!output_init_swapchain(output, format)) {
+		wlr_log(WLR_ERROR, "Failed to enable output");
+		return;
 	}
 
 	liftoff_output_set_composition_layer(output->liftoff_output,
 		output->composition_layer);
 
 	output->bg_layer = liftoff_layer_create(output->liftoff_output);
-	liftoff_layer_set_property(output->bg_layer, "zpos", 1);
+	liftoff_layer_set_property(output->bg_layer, "zpos",
+		GLIDER_OUTPUT_ZPOS_BG);
 
-	output->bg_buffer = glider_allocator_create_buffer(server->allocator,
-		output->output->width, output->output->height, format);
+	output->bg_buffer = glider_allocator_create_buffer(
+		output->swapchain->allocator, output->output->width,
+		output->output->height, output->swapchain->format);
 	if (output->bg_buffer == NULL) {
 		wlr_log(WLR_ERROR, "Failed to create background buffer");
 		return;
@@ -264,4 +1363,11 @@ void handle_new_output(struct wl_listener *listener, void *data) {
 			output->bg_layer)) {
 		return;
 	}
+
+	if (!output_init_cursor(output)) {
+		wlr_log(WLR_ERROR, "Failed to create cursor on output %s, "
+			"it won't be displayed", output->output->name);
+	}
+	output->content_dirty = true;
+	glider_output_request_frame(output);
 }
@@ -0,0 +1,241 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <wlr/util/log.h>
+#include "scene.h"
+
+struct glider_scene_cell {
+	struct glider_hash_entry entry; // glider_scene.cells
+	int32_t x, y; // in cells
+	struct wl_list refs; // glider_scene_node_ref.link
+};
+
+bool glider_scene_init(struct glider_scene *scene) {
+	*scene = (struct glider_scene){0};
+	return glider_hash_table_init(&scene->cells);
+}
+
+void glider_scene_finish(struct glider_scene *scene) {
+	assert(scene->nodes_len == 0);
+	glider_hash_table_finish(&scene->cells);
+}
+
+/* Index of the cell containing a coordinate, rounding towards minus
+ * infinity. */
+static int32_t get_cell_coord(int64_t v) {
+	if (v >= 0) {
+		return v / GLIDER_SCENE_CELL_SIZE;
+	}
+	return -((-v + GLIDER_SCENE_CELL_SIZE - 1) / GLIDER_SCENE_CELL_SIZE);
+}
+
+/* Range of cells covered by a non-empty box, bounds included. */
+static void get_cell_range(const struct wlr_box *box, int32_t *x1, int32_t *y1,
+		int32_t *x2, int32_t *y2) {
+	*x1 = get_cell_coord(box->x);
+	*y1 = get_cell_coord(box->y);
+	*x2 = get_cell_coord((int64_t)box->x + box->width - 1);
+	*y2 = get_cell_coord((int64_t)box->y + box->height - 1);
+}
+
+static uint64_t hash_cell(int32_t x, int32_t y) {
+	return glider_hash_u64((uint64_t)(uint32_t)x << 32 | (uint32_t)y);
+}
+
+static struct glider_scene_cell *get_cell(struct glider_scene *scene,
+		int32_t x, int32_t y, bool create) {
+	uint64_t hash = hash_cell(x, y);
+	struct wl_list *bucket = glider_hash_table_bucket(&scene->cells, hash);
+	struct glider_scene_cell *cell;
+	wl_list_for_each(cell, bucket, entry.link) {
+		if (cell->entry.hash == hash && cell->x == x && cell->y == y) {
+			return cell;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	cell = calloc(1, sizeof(*cell));
+	if (cell == NULL) {
+		wlr_log_errno(WLR_ERROR, "calloc failed");
+		return NULL;
+	}
+	cell->x = x;
+	cell->y = y;
+	wl_list_init(&cell->refs);
+	glider_hash_table_insert(&scene->cells, &cell->entry, hash);
+	return cell;
+}
+
+static void unlink_refs(struct glider_scene *scene,
+		struct glider_scene_node_ref *refs, size_t refs_len) {
+	for (size_t i = 0; i < refs_len; i++) {
+		struct glider_scene_cell *cell = refs[i].cell;
+		if (cell == NULL) {
+			continue;
+		}
+		wl_list_remove(&refs[i].link);
+		if (wl_list_empty(&cell->refs)) {
+			glider_hash_table_remove(&scene->cells, &cell->entry);
+			free(cell);
+		}
+	}
+}
+
+void glider_scene_node_init(struct glider_scene_node *node,
+		struct glider_scene *scene, void *data) {
+	*node = (struct glider_scene_node){
+		.scene = scene,
+		.order = ++scene->top_order,
+		.data = data,
+	};
+	scene->nodes_len++;
+}
+
+void glider_scene_node_finish(struct glider_scene_node *node) {
+	unlink_refs(node->scene, node->refs, node->refs_len);
+	free(node->refs);
+	node->scene->nodes_len--;
+	node->refs = NULL;
+	node->refs_len = 0;
+}
+
+bool glider_scene_node_set_box(struct glider_scene_node *node,
+		const struct wlr_box *box) {
+	struct glider_scene *scene = node->scene;
+
+	struct glider_scene_node_ref *refs = NULL;
+	size_t refs_len = 0;
+	if (!wlr_box_empty(box)) {
+		int32_t x1, y1, x2, y2;
+		get_cell_range(box, &x1, &y1, &x2, &y2);
+		refs_len = (size_t)(x2 - x1 + 1) * (size_t)(y2 - y1 + 1);
+		refs = calloc(refs_len, sizeof(*refs));
+		if (refs == NULL) {
+			wlr_log_errno(WLR_ERROR, "calloc failed");
+			return false;
+		}
+
+		// Index the new box before dropping the old one, so that the node
+		// is left untouched on failure
+		size_t i = 0;
+		for (int32_t y = y1; y <= y2; y++) {
+			for (int32_t x = x1; x <= x2; x++) {
+				struct glider_scene_cell *cell = get_cell(scene, x, y, true);
+				if (cell == NULL) {
+					unlink_refs(scene, refs, refs_len);
+					free(refs);
+					return false;
+				}
+				refs[i].node = node;
+				refs[i].cell = cell;
+				wl_list_insert(&cell->refs, &refs[i].link);
+				i++;
+			}
+		}
+	}
+
+	unlink_refs(scene, node->refs, node->refs_len);
+	free(node->refs);
+	node->refs = refs;
+	node->refs_len = refs_len;
+	node->box = *box;
+	return true;
+}
+
+void glider_scene_node_raise_to_top(struct glider_scene_node *node) {
+	if (node->order != node->scene->top_order) {
+		node->order = ++node->scene->top_order;
+	}
+}
+
+void glider_scene_node_lower_to_bottom(struct glider_scene_node *node) {
+	if (node->order != node->scene->bottom_order) {
+		node->order = --node->scene->bottom_order;
+	}
+}
+
+struct glider_scene_node *glider_scene_node_at(struct glider_scene *scene,
+		double x, double y) {
+	// Round towards minus infinity before looking up the cell
+	int64_t ix = (int64_t)x, iy = (int64_t)y;
+	ix -= ix > x;
+	iy -= iy > y;
+	struct glider_scene_cell *cell =
+		get_cell(scene, get_cell_coord(ix), get_cell_coord(iy), false);
+	if (cell == NULL) {
+		return NULL;
+	}
+
+	struct glider_scene_node *top = NULL;
+	struct glider_scene_node_ref *ref;
+	wl_list_for_each(ref, &cell->refs, link) {
+		if ((top == NULL || ref->node->order > top->order) &&
+				wlr_box_contains_point(&ref->node->box, x, y)) {
+			top = ref->node;
+		}
+	}
+	return top;
+}
+
+static int node_order_cmp(const void *_a, const void *_b) {
+	const struct glider_scene_node *const *a = _a, *const *b = _b;
+	if ((*a)->order == (*b)->order) {
+		return 0;
+	}
+	return (*a)->order < (*b)->order ? -1 : 1;
+}
+
+ssize_t glider_scene_get_nodes_in_box(struct glider_scene *scene,
+		const struct wlr_box *box, struct glider_scene_node ***nodes_ptr) {
+	*nodes_ptr = NULL;
+	if (wlr_box_empty(box)) {
+		return 0;
+	}
+
+	// Nodes covering several cells are only reported once per query
+	uint64_t seq = ++scene->query_seq;
+	struct glider_scene_node **nodes = NULL;
+	size_t nodes_len = 0, nodes_cap = 0;
+
+	int32_t x1, y1, x2, y2;
+	get_cell_range(box, &x1, &y1, &x2, &y2);
+	for (int32_t y = y1; y <= y2; y++) {
+		for (int32_t x = x1; x <= x2; x++) {
+			struct glider_scene_cell *cell = get_cell(scene, x, y, false);
+			if (cell == NULL) {
+				continue;
+			}
+
+			struct glider_scene_node_ref *ref;
+			wl_list_for_each(ref, &cell->refs, link) {
+				struct glider_scene_node *node = ref->node;
+				struct wlr_box intersection;
+				if (node->query_seq == seq || !wlr_box_intersection(
+						&intersection, &node->box, box)) {
+					continue;
+				}
+				node->query_seq = seq;
+
+				if (nodes_len == nodes_cap) {
+					nodes_cap = nodes_cap == 0 ? 16 : 2 * nodes_cap;
+					struct glider_scene_node **new_nodes =
+						realloc(nodes, nodes_cap * sizeof(nodes[0]));
+					if (new_nodes == NULL) {
+						wlr_log_errno(WLR_ERROR, "realloc failed");
+						free(nodes);
+						return -1;
+					}
+					nodes = new_nodes;
+				}
+				nodes[nodes_len++] = node;
+			}
+		}
+	}
+
+	if (nodes_len > 1) {
+		qsort(nodes, nodes_len, sizeof(nodes[0]), node_order_cmp);
+	}
+	*nodes_ptr = nodes;
+	return nodes_len;
+}
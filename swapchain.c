@@ -79,7 +79,7 @@ static struct wlr_buffer *slot_acquire(struct glider_swapchain_slot *slot) {
 }
 
 struct wlr_buffer *glider_swapchain_acquire(
-		struct glider_swapchain *swapchain) {
+		struct glider_swapchain *swapchain, int *age) {
 	struct glider_swapchain_slot *free_slot = NULL;
 	for (size_t i = 0; i < GLIDER_SWAPCHAIN_CAP; i++) {
 		struct glider_swapchain_slot *slot = &swapchain->slots[i];
@@ -87,6 +87,9 @@ struct wlr_buffer *glider_swapchain_acquire(
 			continue;
 		}
 		if (slot->buffer != NULL) {
+			if (age != NULL) {
+				*age = slot->age;
+			}
 			return slot_acquire(slot);
 		}
 		free_slot = slot;
@@ -107,9 +110,24 @@ struct wlr_buffer *glider_swapchain_acquire(
 		wlr_log(WLR_ERROR, "Failed to allocate buffer");
 		return NULL;
 	}
+	if (age != NULL) {
+		*age = 0;
+	}
 	return slot_acquire(free_slot);
 }
 
+void glider_swapchain_set_buffer_submitted(struct glider_swapchain *swapchain,
+		struct wlr_buffer *buffer) {
+	for (size_t i = 0; i < GLIDER_SWAPCHAIN_CAP; i++) {
+		struct glider_swapchain_slot *slot = &swapchain->slots[i];
+		if (slot->buffer == buffer) {
+			slot->age = 1;
+		} else if (slot->age > 0) {
+			slot->age++;
+		}
+	}
+}
+
 bool glider_swapchain_resize(struct glider_swapchain *swapchain,
 		int width, int height) {
 	if (swapchain->width == width && swapchain->height == height) {
@@ -0,0 +1,186 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <wlr/types/wlr_surface.h>
+#include "tearing-control-v1-protocol.h"
+#include "tearing_control.h"
+
+#define TEARING_CONTROL_MANAGER_VERSION 1
+
+static const struct wp_tearing_control_v1_interface control_impl;
+
+/* Returns NULL if the surface has been destroyed */
+static struct glider_tearing_control *control_from_resource(
+		struct wl_resource *resource) {
+	assert(wl_resource_instance_of(resource, &wp_tearing_control_v1_interface,
+		&control_impl));
+	return wl_resource_get_user_data(resource);
+}
+
+static void control_destroy(struct glider_tearing_control *control) {
+	if (control == NULL) {
+		return;
+	}
+	wl_resource_set_user_data(control->resource, NULL);
+	wl_list_remove(&control->link);
+	wl_list_remove(&control->surface_commit.link);
+	wl_list_remove(&control->surface_destroy.link);
+	free(control);
+}
+
+static void control_handle_set_presentation_hint(struct wl_client *client,
+		struct wl_resource *resource, uint32_t hint) {
+	struct glider_tearing_control *control = control_from_resource(resource);
+	if (control == NULL) {
+		return;
+	}
+	control->pending_async =
+		hint == WP_TEARING_CONTROL_V1_PRESENTATION_HINT_ASYNC;
+}
+
+static void control_handle_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static const struct wp_tearing_control_v1_interface control_impl = {
+	.set_presentation_hint = control_handle_set_presentation_hint,
+	.destroy = control_handle_destroy,
+};
+
+static void control_handle_resource_destroy(struct wl_resource *resource) {
+	// Destroying the object resets the hint to vsync
+	control_destroy(control_from_resource(resource));
+}
+
+static void control_handle_surface_commit(struct wl_listener *listener,
+		void *data) {
+	struct glider_tearing_control *control =
+		wl_container_of(listener, control, surface_commit);
+	control->current_async = control->pending_async;
+}
+
+static void control_handle_surface_destroy(struct wl_listener *listener,
+		void *data) {
+	struct glider_tearing_control *control =
+		wl_container_of(listener, control, surface_destroy);
+	control_destroy(control);
+}
+
+static struct glider_tearing_control *manager_get_control(
+		struct glider_tearing_control_manager *manager,
+		struct wlr_surface *surface) {
+	struct glider_tearing_control *control;
+	wl_list_for_each(control, &manager->controls, link) {
+		if (control->surface == surface) {
+			return control;
+		}
+	}
+	return NULL;
+}
+
+static void manager_handle_get_tearing_control(struct wl_client *client,
+		struct wl_resource *manager_resource, uint32_t id,
+		struct wl_resource *surface_resource) {
+	struct glider_tearing_control_manager *manager =
+		wl_resource_get_user_data(manager_resource);
+	struct wlr_surface *surface = wlr_surface_from_resource(surface_resource);
+
+	if (manager_get_control(manager, surface) != NULL) {
+		wl_resource_post_error(manager_resource,
+			WP_TEARING_CONTROL_MANAGER_V1_ERROR_TEARING_CONTROL_EXISTS,
+			"wp_tearing_control_v1 already exists for this surface");
+		return;
+	}
+
+	struct glider_tearing_control *control = calloc(1, sizeof(*control));
+	if (control == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	control->resource = wl_resource_create(client,
+		&wp_tearing_control_v1_interface,
+		wl_resource_get_version(manager_resource), id);
+	if (control->resource == NULL) {
+		free(control);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(control->resource, &control_impl,
+		control, control_handle_resource_destroy);
+
+	control->surface = surface;
+	wl_list_insert(&manager->controls, &control->link);
+
+	control->surface_commit.notify = control_handle_surface_commit;
+	wl_signal_add(&surface->events.commit, &control->surface_commit);
+	control->surface_destroy.notify = control_handle_surface_destroy;
+	wl_signal_add(&surface->events.destroy, &control->surface_destroy);
+}
+
+static void manager_handle_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static const struct wp_tearing_control_manager_v1_interface manager_impl = {
+	.destroy = manager_handle_destroy,
+	.get_tearing_control = manager_handle_get_tearing_control,
+};
+
+static void manager_bind(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct glider_tearing_control_manager *manager = data;
+
+	struct wl_resource *resource = wl_resource_create(client,
+		&wp_tearing_control_manager_v1_interface, version, id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &manager_impl, manager, NULL);
+}
+
+static void handle_display_destroy(struct wl_listener *listener, void *data) {
+	struct glider_tearing_control_manager *manager =
+		wl_container_of(listener, manager, display_destroy);
+	struct glider_tearing_control *control, *control_tmp;
+	wl_list_for_each_safe(control, control_tmp, &manager->controls, link) {
+		control_destroy(control);
+	}
+	wl_list_remove(&manager->display_destroy.link);
+	wl_global_destroy(manager->global);
+	free(manager);
+}
+
+struct glider_tearing_control_manager *glider_tearing_control_manager_create(
+		struct wl_display *display) {
+	struct glider_tearing_control_manager *manager =
+		calloc(1, sizeof(*manager));
+	if (manager == NULL) {
+		return NULL;
+	}
+
+	manager->global = wl_global_create(display,
+		&wp_tearing_control_manager_v1_interface,
+		TEARING_CONTROL_MANAGER_VERSION, manager, manager_bind);
+	if (manager->global == NULL) {
+		free(manager);
+		return NULL;
+	}
+
+	wl_list_init(&manager->controls);
+
+	manager->display_destroy.notify = handle_display_destroy;
+	wl_display_add_destroy_listener(display, &manager->display_destroy);
+
+	return manager;
+}
+
+bool glider_tearing_control_manager_wants_async(
+		struct glider_tearing_control_manager *manager,
+		struct wlr_surface *surface) {
+	struct glider_tearing_control *control =
+		manager_get_control(manager, surface);
+	return control != NULL && control->current_async;
+}
@@ -0,0 +1,142 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <wlr/util/log.h>
+#include "trace.h"
+
+struct trace_span {
+	int64_t begin, end; // nsec since glider_trace_init, -1 if unset
+};
+
+static const char *phase_names[GLIDER_TRACE_PHASE_COUNT] = {
+	[GLIDER_TRACE_SESSION] = "session",
+	[GLIDER_TRACE_DRM_PROBE] = "drm-probe",
+	[GLIDER_TRACE_DRM_RESOURCES] = "drm-resources",
+	[GLIDER_TRACE_RENDERER] = "renderer",
+	[GLIDER_TRACE_DRM_WAIT] = "drm-wait",
+	[GLIDER_TRACE_MODESET] = "modeset",
+	[GLIDER_TRACE_OUTPUT_TEST] = "output-test",
+	[GLIDER_TRACE_FIRST_FRAME] = "first-frame",
+};
+
+// Phases are recorded from the DRM probe threads too
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec trace_start;
+static struct trace_span spans[GLIDER_TRACE_PHASE_COUNT];
+static bool trace_done = false;
+
+static int64_t trace_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)(t.tv_sec - trace_start.tv_sec) * 1000000000 +
+		(t.tv_nsec - trace_start.tv_nsec);
+}
+
+void glider_trace_init(void) {
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	for (size_t i = 0; i < GLIDER_TRACE_PHASE_COUNT; i++) {
+		spans[i].begin = spans[i].end = -1;
+	}
+}
+
+void glider_trace_begin(enum glider_trace_phase phase) {
+	int64_t now = trace_now();
+	pthread_mutex_lock(&trace_mutex);
+	if (!trace_done && (spans[phase].begin < 0 || now < spans[phase].begin)) {
+		spans[phase].begin = now;
+	}
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+void glider_trace_end(enum glider_trace_phase phase) {
+	int64_t now = trace_now();
+	pthread_mutex_lock(&trace_mutex);
+	if (!trace_done && now > spans[phase].end) {
+		spans[phase].end = now;
+	}
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+static double nsec_to_msec(int64_t nsec) {
+	return (double)nsec / 1000000;
+}
+
+static void log_trace(void) {
+	char buf[1024];
+	size_t len = 0;
+	for (size_t i = 0; i < GLIDER_TRACE_FIRST_FRAME; i++) {
+		const struct trace_span *span = &spans[i];
+		if (span->begin < 0 || span->end < 0 || len >= sizeof(buf)) {
+			continue;
+		}
+		len += snprintf(buf + len, sizeof(buf) - len, "%s %.1fms, ",
+			phase_names[i], nsec_to_msec(span->end - span->begin));
+	}
+	wlr_log(WLR_INFO, "Startup trace: %sfirst frame at %.1fms",
+		len > 0 ? buf : "", nsec_to_msec(spans[GLIDER_TRACE_FIRST_FRAME].end));
+}
+
+/* The file is written atomically, so that scripts can poll for it. */
+static void write_trace_json(const char *path) {
+	char tmp_path[4096];
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+			(int)sizeof(tmp_path)) {
+		wlr_log(WLR_ERROR, "Startup trace path too long");
+		return;
+	}
+
+	FILE *f = fopen(tmp_path, "w");
+	if (f == NULL) {
+		wlr_log_errno(WLR_ERROR, "Failed to open startup trace file %s",
+			tmp_path);
+		return;
+	}
+
+	fprintf(f, "{\n\t\"phases\": [");
+	bool first = true;
+	for (size_t i = 0; i < GLIDER_TRACE_PHASE_COUNT; i++) {
+		const struct trace_span *span = &spans[i];
+		if (span->begin < 0 || span->end < 0) {
+			continue;
+		}
+		fprintf(f, "%s\n\t\t{ \"name\": \"%s\", \"begin_ms\": %.3f, "
+			"\"end_ms\": %.3f }", first ? "" : ",", phase_names[i],
+			nsec_to_msec(span->begin), nsec_to_msec(span->end));
+		first = false;
+	}
+	fprintf(f, "\n\t],\n\t\"first_frame_ms\": %.3f\n}\n",
+		nsec_to_msec(spans[GLIDER_TRACE_FIRST_FRAME].end));
+
+	if (fclose(f) != 0) {
+		wlr_log_errno(WLR_ERROR, "Failed to write startup trace file %s",
+			tmp_path);
+		return;
+	}
+	if (rename(tmp_path, path) != 0) {
+		wlr_log_errno(WLR_ERROR, "Failed to rename startup trace file %s",
+			tmp_path);
+	}
+}
+
+void glider_trace_first_frame(void) {
+	int64_t now = trace_now();
+	pthread_mutex_lock(&trace_mutex);
+	if (trace_done) {
+		pthread_mutex_unlock(&trace_mutex);
+		return;
+	}
+	spans[GLIDER_TRACE_FIRST_FRAME].begin = now;
+	spans[GLIDER_TRACE_FIRST_FRAME].end = now;
+	trace_done = true;
+	pthread_mutex_unlock(&trace_mutex);
+
+	log_trace();
+
+	const char *path = getenv("GLIDER_STARTUP_TRACE");
+	if (path != NULL) {
+		write_trace_json(path);
+	}
+}
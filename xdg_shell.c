@@ -1,7 +1,10 @@
 #include <libliftoff.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wlr/types/wlr_xdg_shell.h>
+#include <wlr/util/log.h>
 #include "allocator.h"
+#include "backend/backend.h"
 #include "server.h"
 #include "surface.h"
 
@@ -10,7 +13,9 @@ static void surface_output_destroy(struct glider_surface_output *so) {
 		so->surface->primary_output = NULL;
 	}
 	wl_list_remove(&so->link);
+	wl_list_remove(&so->visible_link);
 	wl_list_remove(&so->destroy.link);
+	glider_drm_connector_destroy_layer(so->output->output, so->layer);
 	liftoff_layer_destroy(so->layer);
 	free(so);
 }
@@ -25,8 +30,12 @@ static void handle_surface_destroy(struct wl_listener *listener, void *data) {
 
 	struct glider_surface_output *so, *so_tmp;
 	wl_list_for_each_safe(so, so_tmp, &surface->outputs, link) {
+		so->output->content_dirty = true;
+		glider_output_add_damage_box(so->output, &surface->node.box);
+		glider_output_request_frame(so->output);
 		surface_output_destroy(so);
 	}
+	glider_scene_node_finish(&surface->node);
 
 	wl_list_remove(&surface->destroy.link);
 	wl_list_remove(&surface->commit.link);
@@ -42,13 +51,36 @@ static void handle_surface_commit(struct wl_listener *listener, void *data) {
 		return;
 	}
 
+	pixman_region32_t damage;
+	pixman_region32_init(&damage);
+	wlr_surface_get_effective_damage(surface->wlr_surface, &damage);
+	struct wlr_box prev_box = surface->node.box;
+	struct wlr_box box = { .x = prev_box.x, .y = prev_box.y,
+		.width = surface->wlr_surface->current.width,
+		.height = surface->wlr_surface->current.height };
+	bool resized = memcmp(&prev_box, &box, sizeof(box)) != 0;
+	if (resized && !glider_scene_node_set_box(&surface->node, &box)) {
+		wlr_log(WLR_ERROR, "Failed to resize surface scene node");
+		box = prev_box;
+		resized = false;
+	}
+	// Surface-local to output-local coordinates
+	pixman_region32_translate(&damage, box.x, box.y);
+
 	struct glider_surface_output *so;
 	wl_list_for_each(so, &surface->outputs, link) {
-		liftoff_layer_set_fb_composited(so->layer);
-		liftoff_layer_set_property(so->layer, "zpos", 2);
-
-		glider_output_attach_buffer(so->output, &buffer->base, so->layer);
+		so->output->content_dirty = true;
+		glider_output_request_frame(so->output);
+		glider_output_add_damage(so->output, &damage);
+		if (resized) {
+			glider_output_add_damage_box(so->output, &prev_box);
+			glider_output_add_damage_box(so->output, &box);
+		}
+		// Surfaces entering the output are attached by the next scene update
+		glider_output_attach_surface(so);
 	}
+
+	pixman_region32_fini(&damage);
 }
 
 void handle_new_xdg_surface(struct wl_listener *listener, void *data) {
@@ -62,6 +94,13 @@ void handle_new_xdg_surface(struct wl_listener *listener, void *data) {
 	wl_list_insert(&server->surfaces, &surface->link);
 	wl_list_init(&surface->outputs);
 
+	// Cascade new surfaces so that they don't entirely cover each other. The
+	// size is set on the first commit.
+	glider_scene_node_init(&surface->node, &server->scene, surface);
+	int offset = ((server->scene.nodes_len - 1) % 8) * 32;
+	struct wlr_box box = { .x = offset, .y = offset };
+	glider_scene_node_set_box(&surface->node, &box);
+
 	surface->destroy.notify = handle_surface_destroy;
 	wl_signal_add(&xdg_surface->surface->events.destroy, &surface->destroy);
 
@@ -80,6 +119,7 @@ void handle_new_xdg_surface(struct wl_listener *listener, void *data) {
 		so->surface = surface;
 		so->layer = liftoff_layer_create(output->liftoff_output);
 		wl_list_insert(&surface->outputs, &so->link);
+		wl_list_init(&so->visible_link);
 
 		so->destroy.notify = handle_output_destroy;
 		wl_signal_add(&output->events.destroy, &so->destroy);